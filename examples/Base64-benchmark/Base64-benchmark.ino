@@ -0,0 +1,81 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+// Measures base64 / base64url encode and decode throughput on the board.
+#include <CloudIoTCoreBase64.h>
+
+#define BENCH_BYTES 768
+#define BENCH_ROUNDS 200
+
+unsigned char raw[BENCH_BYTES];
+char encoded[BASE64_ENCODED_LENGTH(BENCH_BYTES)];
+
+void report(const char* name, const char* run, unsigned long elapsed_us) {
+  Serial.print(name);
+  Serial.print(" ");
+  Serial.print(run);
+  Serial.print(": ");
+  Serial.print((long)elapsed_us);
+  Serial.print(" us, ");
+  Serial.print((long)((unsigned long long)BENCH_BYTES * BENCH_ROUNDS * 1000000ULL /
+                      1024 / (elapsed_us ? elapsed_us : 1)));
+  Serial.println(" KB/s");
+}
+
+void bench(const char* name, Base64Alphabet alphabet) {
+  size_t length = 0;
+  unsigned long start = micros();
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    length = base64_encode(raw, BENCH_BYTES, encoded, alphabet);
+    yield();
+  }
+  report(name, "encode", micros() - start);
+
+  int decoded = 0;
+  start = micros();
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    decoded = base64_decode(encoded, length, raw, alphabet);
+    yield();
+  }
+  report(name, "decode", micros() - start);
+  if (decoded != BENCH_BYTES) {
+    Serial.println("Round trip failed!");
+  }
+
+  // Same data fed through the streaming encoder in MQTT sized chunks.
+  Base64Encoder encoder(alphabet);
+  start = micros();
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    size_t out = 0;
+    for (size_t in = 0; in < BENCH_BYTES; in += 100) {
+      size_t chunk = BENCH_BYTES - in < 100 ? BENCH_BYTES - in : 100;
+      out += encoder.update(raw + in, chunk, encoded + out);
+    }
+    encoder.final(encoded + out);
+    yield();
+  }
+  report(name, "chunked encode", micros() - start);
+}
+
+void setup() {
+  Serial.begin(115200);
+  for (int i = 0; i < BENCH_BYTES; i++) {
+    raw[i] = random(256);
+  }
+  bench("base64", BASE64_STANDARD);
+  bench("base64url", BASE64_URL);
+}
+
+void loop() {
+}
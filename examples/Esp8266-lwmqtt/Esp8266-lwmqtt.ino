@@ -38,6 +38,7 @@ void loop()
 {
   char data[100];
   mqttClient.loop();
+  device.loop(); // signs the next JWT in slices before the current one expires
 
   delay(10); // <- fixes some issues with WiFi stability
 
@@ -0,0 +1,88 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+// Compresses a minute of 1 Hz sensor samples (temperature, RSSI, supply
+// voltage) with GorillaEncoder, checks the round trip and prints the size
+// and the time per sample.
+#include <CloudIoTCoreGorilla.h>
+
+#define SAMPLES 60
+#define COLUMNS 3
+#define ROUNDS 50
+
+uint32_t timestamps[SAMPLES];
+float readings[SAMPLES][COLUMNS];
+uint8_t payload[512];
+
+void makeSamples() {
+  float temperature = 21.5;
+  float volts = 3.3;
+  for (int i = 0; i < SAMPLES; i++) {
+    // Regular timestamps with the odd millisecond of jitter.
+    timestamps[i] = 1000UL * i + (random(10) == 0 ? 1 : 0);
+    // DS18B20 style 1/16 degree steps, integer RSSI, 10 mV steps.
+    temperature += (random(3) - 1) * 0.0625;
+    readings[i][0] = temperature;
+    readings[i][1] = -67 + random(3);
+    if (random(5) == 0) {
+      volts += (random(3) - 1) * 0.01;
+    }
+    readings[i][2] = volts;
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  makeSamples();
+
+  GorillaEncoder encoder(payload, sizeof(payload), COLUMNS);
+  unsigned long start = micros();
+  for (int r = 0; r < ROUNDS; r++) {
+    encoder.reset();
+    for (int i = 0; i < SAMPLES; i++) {
+      encoder.append(timestamps[i], readings[i]);
+    }
+    yield();
+  }
+  unsigned long encode_us = micros() - start;
+
+  uint32_t timestamp;
+  float values[COLUMNS];
+  bool match = true;
+  start = micros();
+  for (int r = 0; r < ROUNDS; r++) {
+    GorillaDecoder decoder(encoder.data(), encoder.length());
+    for (int i = 0; decoder.next(&timestamp, values); i++) {
+      match &= timestamp == timestamps[i] &&
+               memcmp(values, readings[i], sizeof(values)) == 0;
+    }
+    yield();
+  }
+  unsigned long decode_us = micros() - start;
+
+  Serial.print("samples: ");
+  Serial.println(encoder.count());
+  Serial.print("raw bytes: ");
+  Serial.println(SAMPLES * (4 + 4 * COLUMNS));
+  Serial.print("encoded bytes: ");
+  Serial.println(encoder.length());
+  Serial.print("encode us/sample: ");
+  Serial.println((float)encode_us / ROUNDS / SAMPLES);
+  Serial.print("decode us/sample: ");
+  Serial.println((float)decode_us / ROUNDS / SAMPLES);
+  Serial.println(match ? "round trip OK" : "Round trip failed!");
+}
+
+void loop() {
+}
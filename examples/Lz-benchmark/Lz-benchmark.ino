@@ -0,0 +1,88 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+// Measures LzEncoder compression ratio and throughput on typical payloads
+// and checks the round trip with lz_decompress().
+#include <CloudIoTCoreLz.h>
+
+#define BENCH_ROUNDS 20
+
+const char *json_sample =
+    "[{\"t\":1571234567,\"temp\":21.5,\"hum\":40.2,\"rssi\":-67},"
+    "{\"t\":1571234568,\"temp\":21.5,\"hum\":40.3,\"rssi\":-66},"
+    "{\"t\":1571234569,\"temp\":21.6,\"hum\":40.3,\"rssi\":-67},"
+    "{\"t\":1571234570,\"temp\":21.6,\"hum\":40.2,\"rssi\":-68},"
+    "{\"t\":1571234571,\"temp\":21.6,\"hum\":40.1,\"rssi\":-67}]";
+
+const char *log_sample =
+    "I: connecting...\n"
+    "E: -3 LWMQTT_NETWORK_FAILED_CONNECT\n"
+    "I: Delaying 2522ms\n"
+    "I: connecting...\n"
+    "E: -3 LWMQTT_NETWORK_FAILED_CONNECT\n"
+    "I: Delaying 6363ms\n"
+    "I: connecting...\n"
+    "I: connected!\n"
+    "W: sensor 2 read timeout, retrying\n"
+    "W: sensor 2 read timeout, retrying\n";
+
+uint8_t compressed[LZ_OUTPUT_MAX(512)];
+uint8_t restored[512];
+
+void bench(const char *name, const char *sample) {
+  size_t length = strlen(sample);
+  size_t n = 0;
+  LzEncoder encoder;
+
+  unsigned long start = micros();
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    n = encoder.update((const uint8_t *)sample, length, compressed);
+    n += encoder.final(compressed + n);
+    yield();
+  }
+  unsigned long encode_us = micros() - start;
+
+  int decoded = 0;
+  start = micros();
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    decoded = lz_decompress(compressed, n, restored, sizeof(restored));
+    yield();
+  }
+  unsigned long decode_us = micros() - start;
+
+  Serial.print(name);
+  Serial.print(": ");
+  Serial.print((long)length);
+  Serial.print(" -> ");
+  Serial.print((long)n);
+  Serial.print(" bytes, encode ");
+  Serial.print((long)((unsigned long long)length * BENCH_ROUNDS * 1000000ULL /
+                      1024 / (encode_us ? encode_us : 1)));
+  Serial.print(" KB/s, decode ");
+  Serial.print((long)((unsigned long long)length * BENCH_ROUNDS * 1000000ULL /
+                      1024 / (decode_us ? decode_us : 1)));
+  Serial.println(" KB/s");
+  if (decoded != (int)length || memcmp(restored, sample, length) != 0) {
+    Serial.println("Round trip failed!");
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  bench("json", json_sample);
+  bench("log", log_sample);
+}
+
+void loop() {
+}
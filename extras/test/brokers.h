@@ -0,0 +1,140 @@
+// Stand-in brokers for the host tests: one network Client that answers
+// for both Cloud IoT Core hosts with its own latency, and can be taken
+// down per host.
+#ifndef brokers_h
+#define brokers_h
+
+#include <Client.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "CloudIoTCore.h"
+
+struct StandInBroker {
+  const char *host;
+  unsigned long latency_ms;
+  bool down;
+  int connects;
+};
+
+// A packet written to the network; id, topic and payload are filled in
+// for PUBLISH and SUBSCRIBE.
+struct WrittenPacket {
+  uint8_t header;
+  uint16_t id;
+  std::string topic;
+  std::string payload;
+};
+
+class StandInNetwork : public Client {
+  public:
+    StandInBroker brokers[2];
+    StandInBroker *current;
+    // Everything written, whether writes fail, and what the broker sends
+    // back next.
+    std::string written;
+    bool failWrites = false;
+    std::string inbound;
+
+    StandInNetwork(unsigned long primary_ms, unsigned long lts_ms)
+        : current(NULL)
+    {
+      brokers[0] = {CLOUD_IOT_CORE_MQTT_HOST, primary_ms, false, 0};
+      brokers[1] = {CLOUD_IOT_CORE_MQTT_HOST_LTS, lts_ms, false, 0};
+    }
+
+    StandInBroker *find(const char *host)
+    {
+      for (int i = 0; i < 2; i++) {
+        if (strcmp(brokers[i].host, host) == 0) {
+          return &brokers[i];
+        }
+      }
+      return NULL;
+    }
+
+    // Connects after the broker's latency, or fails at once if it is down.
+    int connect(const char *host, uint16_t)
+    {
+      StandInBroker *b = find(host);
+      current = NULL;
+      if (b == NULL || b->down) {
+        return 0;
+      }
+      delay(b->latency_ms);
+      b->connects++;
+      current = b;
+      return 1;
+    }
+    int connect(IPAddress, uint16_t) { return 0; }
+
+    // The connection drops (or not) on the test's say.
+    void drop() { current = NULL; }
+
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t size)
+    {
+      if (current == NULL || failWrites) {
+        return 0;
+      }
+      written.append((const char *)buf, size);
+      return size;
+    }
+    // Splits written into packets.
+    std::vector<WrittenPacket> packets() const
+    {
+      std::vector<WrittenPacket> out;
+      const uint8_t *p = (const uint8_t *)written.data();
+      size_t at = 0;
+      while (at < written.size()) {
+        WrittenPacket packet = {p[at++], 0, "", ""};
+        size_t remaining = 0;
+        int shift = 0;
+        uint8_t b;
+        do {
+          b = p[at++];
+          remaining |= (size_t)(b & 0x7f) << shift;
+          shift += 7;
+        } while (b & 0x80);
+        size_t end = at + remaining;
+        if ((packet.header & 0xf0) == 0x30) {
+          size_t topic = p[at] << 8 | p[at + 1];
+          packet.topic = written.substr(at + 2, topic);
+          at += 2 + topic;
+          if (packet.header & 0x06) {
+            packet.id = p[at] << 8 | p[at + 1];
+            at += 2;
+          }
+          packet.payload = written.substr(at, end - at);
+        } else if ((packet.header & 0xf0) == 0x80) {
+          packet.id = p[at] << 8 | p[at + 1];
+          size_t topic = p[at + 2] << 8 | p[at + 3];
+          packet.topic = written.substr(at + 4, topic);
+        }
+        out.push_back(packet);
+        at = end;
+      }
+      return out;
+    }
+
+    int available() { return current != NULL ? inbound.size() : 0; }
+    int read()
+    {
+      uint8_t b;
+      return read(&b, 1) == 1 ? b : -1;
+    }
+    int read(uint8_t *buf, size_t size)
+    {
+      size_t n = available() < (int)size ? available() : size;
+      memcpy(buf, inbound.data(), n);
+      inbound.erase(0, n);
+      return n;
+    }
+    int peek() { return available() ? (uint8_t)inbound[0] : -1; }
+    void flush() {}
+    void stop() { current = NULL; }
+    uint8_t connected() { return current != NULL; }
+    operator bool() { return true; }
+};
+
+#endif  // brokers_h
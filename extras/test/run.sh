@@ -0,0 +1,43 @@
+#!/bin/sh
+# Builds the library for the host against stubs/ and runs every test_*.cpp,
+# or every bench_*.cpp with "./run.sh bench". A "// flags: ..." line in a
+# test adds compiler flags for it and the library build it links against.
+set -e
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--std=gnu++11 -O2 -Wall -Wextra}
+prefix=test
+if [ "$1" = bench ]; then
+  prefix=bench
+fi
+
+build() {
+  dir=build/lib$(echo "$1" | cksum | cut -d' ' -f1)
+  if [ ! -d "$dir" ]; then
+    mkdir -p "$dir.tmp"
+    for f in ../../src/*.cpp stubs/stubs.cpp; do
+      $CXX $CXXFLAGS $1 -I stubs -I ../../src -c "$f" \
+        -o "$dir.tmp/$(basename "$f" .cpp).o"
+    done
+    # Vendored, built as is.
+    for f in ../../src/crypto/*.cpp; do
+      $CXX $CXXFLAGS $1 -w -I stubs -I ../../src -c "$f" \
+        -o "$dir.tmp/crypto_$(basename "$f" .cpp).o"
+    done
+    mv "$dir.tmp" "$dir"
+  fi
+  echo "$dir"
+}
+
+# Library builds are shared by tests with the same flags within one run.
+rm -rf build/lib*
+mkdir -p build
+failed=0
+for t in ${prefix}_*.cpp; do
+  flags=$(sed -n 's|^// flags: ||p' "$t")
+  lib=$(build "$flags")
+  $CXX $CXXFLAGS $flags -pthread -I stubs -I ../../src "$t" "$lib"/*.o \
+    -o "build/${t%.cpp}"
+  "./build/${t%.cpp}" || failed=1
+done
+exit $failed
@@ -0,0 +1,75 @@
+// Just enough of the Arduino core to build the library on a desktop host.
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size)
+    {
+      size_t n = 0;
+      while (n < size && write(buf[n])) {
+        n++;
+      }
+      return n;
+    }
+    size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(const char *s) { return write(s); }
+    size_t print(long v)
+    {
+      char b[24];
+      snprintf(b, sizeof(b), "%ld", v);
+      return write(b);
+    }
+    size_t print(double v)
+    {
+      char b[32];
+      snprintf(b, sizeof(b), "%.2f", v);
+      return write(b);
+    }
+    size_t println() { return write('\n'); }
+    size_t println(const char *s) { return print(s) + println(); }
+    size_t println(long v) { return print(v) + println(); }
+    size_t println(int v) { return println((long)v); }
+    size_t println(unsigned v) { return println((long)v); }
+    size_t println(unsigned long v) { return println((long)v); }
+    size_t println(double v) { return print(v) + println(); }
+    virtual void flush() {}
+    virtual int availableForWrite() { return 64; }
+};
+
+class HardwareSerial : public Print {
+  public:
+    void begin(long) {}
+    size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+    using Print::write;
+};
+extern HardwareSerial Serial;
+
+class String : public std::string {
+  public:
+    String() {}
+    String(const char *s) : std::string(s) {}
+    const char *c_str() const { return std::string::c_str(); }
+};
+
+#endif  // Arduino_h
@@ -0,0 +1,161 @@
+// Stand-in for arduino-mqtt. SUBSCRIBE and PUBLISH packets are written to
+// the Client with ids counted up like lwmqtt's; CONNECT and the broker's
+// answers are not, a test plays the broker through the public fields.
+#ifndef MQTTClient_h
+#define MQTTClient_h
+
+#include <string.h>
+#include <string>
+#include "Arduino.h"
+#include "Client.h"
+
+typedef enum {
+  LWMQTT_SUCCESS = 0,
+  LWMQTT_BUFFER_TOO_SHORT = -1,
+  LWMQTT_VARNUM_OVERFLOW = -2,
+  LWMQTT_NETWORK_FAILED_CONNECT = -3,
+  LWMQTT_NETWORK_TIMEOUT = -4,
+  LWMQTT_NETWORK_FAILED_READ = -5,
+  LWMQTT_NETWORK_FAILED_WRITE = -6,
+  LWMQTT_REMAINING_LENGTH_OVERFLOW = -7,
+  LWMQTT_REMAINING_LENGTH_MISMATCH = -8,
+  LWMQTT_MISSING_OR_WRONG_PACKET = -9,
+  LWMQTT_CONNECTION_DENIED = -10,
+  LWMQTT_FAILED_SUBSCRIPTION = -11,
+  LWMQTT_SUBACK_ARRAY_OVERFLOW = -12,
+  LWMQTT_PONG_TIMEOUT = -13
+} lwmqtt_err_t;
+
+typedef enum {
+  LWMQTT_CONNECTION_ACCEPTED = 0,
+  LWMQTT_UNACCEPTABLE_PROTOCOL = 1,
+  LWMQTT_IDENTIFIER_REJECTED = 2,
+  LWMQTT_SERVER_UNAVAILABLE = 3,
+  LWMQTT_BAD_USERNAME_OR_PASSWORD = 4,
+  LWMQTT_NOT_AUTHORIZED = 5,
+  LWMQTT_UNKNOWN_RETURN_CODE = 6
+} lwmqtt_return_code_t;
+
+class MQTTClient;
+typedef void (*MQTTClientCallbackSimple)(String &topic, String &payload);
+typedef void (*MQTTClientCallbackAdvanced)(MQTTClient *client, char topic[],
+                                           char bytes[], int length);
+
+class MQTTClient {
+  public:
+    // Broker side: connects to refuse, whether the broker keeps sessions
+    // of clients that ask for it, and what the client did.
+    int refuseConnects = 0;
+    bool keepsSessions = true;
+    int connects = 0;
+    int subscribes = 0;
+    int publishes = 0;
+    bool cleanSession = true;
+    uint16_t lastPacketId = 0;
+    MQTTClientCallbackAdvanced advanced = NULL;
+
+    explicit MQTTClient(int = 128) {}
+    void begin(const char *, int, Client &c) { net = &c; }
+    void onMessage(MQTTClientCallbackSimple) {}
+    void onMessageAdvanced(MQTTClientCallbackAdvanced cb) { advanced = cb; }
+    void setOptions(int, bool clean, int) { cleanSession = clean; }
+    void setCleanSession(bool clean) { cleanSession = clean; }
+
+    bool connect(const char *, const char * = NULL, const char * = NULL,
+                 bool skip = false)
+    {
+      if (!skip && (net == NULL || !net->connect("broker", 8883))) {
+        err = LWMQTT_NETWORK_FAILED_CONNECT;
+        return false;
+      }
+      connects++;
+      if (refuseConnects > 0) {
+        refuseConnects--;
+        err = LWMQTT_CONNECTION_DENIED;
+        return false;
+      }
+      present = keepsSessions && !cleanSession && session;
+      session = keepsSessions && !cleanSession;
+      err = LWMQTT_SUCCESS;
+      up = true;
+      return true;
+    }
+    bool publish(const char *topic, const char *payload, int length)
+    {
+      return publish(topic, payload, length, false, 0);
+    }
+    bool publish(const char *topic, const char *payload, int length,
+                 bool retained, int qos)
+    {
+      publishes++;
+      return write((qos ? 0x32 : 0x30) | (retained ? 1 : 0), qos > 0, topic,
+                   payload, length);
+    }
+    bool subscribe(const char *topic, int qos = 0)
+    {
+      subscribes++;
+      char q = qos;
+      return write(0x82, true, topic, &q, 1);
+    }
+    // Reads (and drops) whatever the broker sent.
+    bool loop()
+    {
+      uint8_t buf[64];
+      while (connected() && net->available() > 0) {
+        net->read(buf, sizeof(buf));
+      }
+      return up;
+    }
+    bool connected() { return up && net != NULL && net->connected(); }
+    bool sessionPresent() { return present; }
+    bool disconnect()
+    {
+      up = false;
+      return true;
+    }
+    lwmqtt_err_t lastError() { return err; }
+    lwmqtt_return_code_t returnCode() { return LWMQTT_CONNECTION_ACCEPTED; }
+
+  private:
+    Client *net = NULL;
+
+    bool write(uint8_t header, bool with_id, const char *topic,
+               const char *payload, size_t length)
+    {
+      if (!connected()) {
+        return false;
+      }
+      size_t topic_length = strlen(topic);
+      size_t remaining = 2 + topic_length + (with_id ? 2 : 0) + length;
+      std::string packet(1, (char)header);
+      do {
+        uint8_t b = remaining & 0x7f;
+        remaining >>= 7;
+        packet += (char)(remaining ? b | 0x80 : b);
+      } while (remaining);
+      std::string id;
+      if (with_id) {
+        if (++lastPacketId == 0) {
+          lastPacketId = 1;
+        }
+        id += (char)(lastPacketId >> 8);
+        id += (char)lastPacketId;
+      }
+      // The id follows the topic in a PUBLISH and leads a SUBSCRIBE.
+      bool id_first = (header & 0xf0) != 0x30;
+      packet += id_first ? id : "";
+      packet += (char)(topic_length >> 8);
+      packet += (char)topic_length;
+      packet += topic;
+      packet += id_first ? "" : id;
+      packet.append(payload, length);
+      return net->write((const uint8_t *)packet.data(), packet.size()) ==
+             packet.size();
+    }
+    bool up = false;
+    bool present = false;
+    bool session = false;
+    lwmqtt_err_t err = LWMQTT_SUCCESS;
+};
+
+#endif  // MQTTClient_h
@@ -0,0 +1,40 @@
+#include "Arduino.h"
+#include <chrono>
+#include <thread>
+
+HardwareSerial Serial;
+
+static std::chrono::steady_clock::time_point boot =
+    std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - boot).count();
+}
+
+unsigned long micros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - boot).count();
+}
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {}
+
+long random(long max)
+{
+  return max > 0 ? rand() % max : 0;
+}
+
+long random(long min, long max)
+{
+  return min + random(max - min);
+}
+
+// Sketches define this; tests that route messages define their own.
+__attribute__((weak)) void messageReceived(String &, String &) {}
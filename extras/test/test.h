@@ -0,0 +1,26 @@
+// Minimal checks for the host tests: CHECK records a failure and goes on,
+// test_result() prints the summary and gives main()'s exit status.
+#ifndef test_h
+#define test_h
+
+#include <stdio.h>
+
+static int test_checks = 0;
+static int test_failures = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    test_checks++;                                                   \
+    if (!(cond)) {                                                   \
+      test_failures++;                                               \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    }                                                                \
+  } while (0)
+
+static int test_result(const char *name)
+{
+  printf("%s: %d checks, %d failed\n", name, test_checks, test_failures);
+  return test_failures != 0;
+}
+
+#endif  // test_h
@@ -0,0 +1,127 @@
+// CloudIoTCoreAggregate: window rollover, deadband filtering, config
+// changes and the report text, including numbers formatted like %g
+// without printf float support.
+#include <math.h>
+#include <string.h>
+#include <string>
+#include "CloudIoTCoreAggregate.h"
+#include "test.h"
+
+static std::string report(CloudIoTCoreAggregate &a)
+{
+  char out[CLOUD_IOT_CORE_AGGREGATE_PAYLOAD];
+  int n = a.write(out, sizeof(out));
+  return n > 0 ? std::string(out, n) : n == 0 ? "" : "too small";
+}
+
+static void test_window()
+{
+  CloudIoTCoreAggregate a(50);
+  CHECK(a.addChannel("temp", 0.5) == 0);
+  CHECK(a.addChannel("hum") == 1);
+  CHECK(!a.due());
+  a.add("temp", 21);
+  a.add("temp", 20.5);
+  a.add("temp", 20.75);
+  a.add(1, 40);
+  CHECK(!a.add("pressure", 1000) && !a.add(5, 1));
+  CHECK(!a.due());
+  delay(50);
+  CHECK(a.due());
+  CHECK(report(a) ==
+        "{\"temp\":{\"n\":3,\"min\":20.5,\"max\":21,\"mean\":20.75},"
+        "\"hum\":{\"n\":1,\"min\":40,\"max\":40,\"mean\":40}}");
+  // The next window starts with the next sample.
+  CHECK(!a.due());
+
+  // Within the deadband of what was last reported: nothing.
+  a.add("temp", 21.25);
+  delay(50);
+  CHECK(a.due());
+  CHECK(report(a) == "");
+  CHECK(!a.due());
+
+  // Outside it, only that channel.
+  a.add("temp", 21.3);
+  a.add("hum", 40);
+  delay(50);
+  CHECK(report(a) == "{\"temp\":{\"n\":1,\"min\":21.3,\"max\":21.3,"
+                     "\"mean\":21.3}}");
+
+  // Too small a buffer keeps the window.
+  a.add("hum", 45);
+  char small[10];
+  CHECK(a.write(small, sizeof(small)) == -1);
+  CHECK(report(a) == "{\"hum\":{\"n\":1,\"min\":45,\"max\":45,\"mean\":45}}");
+}
+
+static void test_configure()
+{
+  CloudIoTCoreAggregate a;
+  a.addChannel("temp");
+  a.addChannel("hum");
+  const char *config =
+      "{\"window_s\": 0.5, \"deadband\": {\"temp\": 1.5, \"hum\":-2,"
+      " \"other\": 3}, \"unrelated\": true}";
+  CHECK(a.configure(config, strlen(config)));
+  CHECK(a.getWindow() == 500);
+  CHECK(!a.configure("{\"x\":1}", 7));
+
+  // A window of 0 reports every sample outside the deadband.
+  CHECK(a.configure("{\"window_s\":0}", 14));
+  a.add("temp", 10);
+  CHECK(a.due());
+  CHECK(report(a) == "{\"temp\":{\"n\":1,\"min\":10,\"max\":10,\"mean\":10}}");
+  a.add("temp", 11.5);
+  CHECK(report(a) == "");
+  a.add("temp", 11.6);
+  CHECK(report(a) ==
+        "{\"temp\":{\"n\":1,\"min\":11.6,\"max\":11.6,\"mean\":11.6}}");
+
+  CHECK(a.addChannel("a_name_too_long_x") == -1);
+  for (int i = 2; i < CLOUD_IOT_CORE_CHANNELS; i++) {
+    char name[4] = {'c', (char)('0' + i), 0};
+    CHECK(a.addChannel(name) == i);
+  }
+  CHECK(a.addChannel("full") == -1);
+}
+
+// The text of one value, as the mean of a single sample.
+static std::string format(float value)
+{
+  CloudIoTCoreAggregate a(0);
+  a.addChannel("v");
+  a.add("v", value);
+  std::string r = report(a);
+  size_t at = r.find("\"mean\":");
+  return at == std::string::npos ? r : r.substr(at + 7, r.size() - at - 9);
+}
+
+static void test_numbers()
+{
+  CHECK(format(0) == "0");
+  CHECK(format(-0.0f) == "-0");
+  CHECK(format(1) == "1");
+  CHECK(format(-2.5) == "-2.5");
+  CHECK(format(1.1f) == "1.1");
+  CHECK(format(100) == "100");
+  CHECK(format(123456) == "123456");
+  CHECK(format(123456.7f) == "123457");
+  CHECK(format(999999.5f) == "1e+06");
+  CHECK(format(1e6) == "1e+06");
+  CHECK(format(0.0001f) == "0.0001");
+  CHECK(format(0.000123456f) == "0.000123456");
+  CHECK(format(0.00001f) == "1e-05");
+  CHECK(format(3.4028235e38f) == "3.40282e+38");
+  CHECK(format(-1.5e-20f) == "-1.5e-20");
+  CHECK(format(NAN) == "null");
+  CHECK(format(INFINITY) == "null");
+}
+
+int main()
+{
+  test_window();
+  test_configure();
+  test_numbers();
+  return test_result("aggregate");
+}
@@ -0,0 +1,105 @@
+// base64 / base64url: round trips of every length up to a few SIMD blocks,
+// one shot and chunked, padded and not, against a plain reference encoder.
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "CloudIoTCoreBase64.h"
+#include "test.h"
+
+#define MAX_BYTES 100
+
+static std::string reference(const unsigned char *in, size_t len,
+                             Base64Alphabet alphabet, bool pad)
+{
+  const char *chars =
+      alphabet == BASE64_URL
+          ? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+          : "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = in[i] << 16;
+    v |= i + 1 < len ? in[i + 1] << 8 : 0;
+    v |= i + 2 < len ? in[i + 2] : 0;
+    out += chars[v >> 18];
+    out += chars[(v >> 12) & 0x3f];
+    out += i + 1 < len ? chars[(v >> 6) & 0x3f] : '=';
+    out += i + 2 < len ? chars[v & 0x3f] : '=';
+  }
+  if (!pad) {
+    out.erase(out.find_last_not_of('=') + 1);
+  }
+  return out;
+}
+
+static void test_round_trips(Base64Alphabet alphabet, bool pad)
+{
+  unsigned char raw[MAX_BYTES];
+  unsigned char decoded[MAX_BYTES + 2];
+  for (size_t i = 0; i < MAX_BYTES; i++) {
+    raw[i] = rand();
+  }
+  for (size_t len = 0; len <= MAX_BYTES; len++) {
+    std::string expected = reference(raw, len, alphabet, pad);
+
+    // Nothing is written past the characters returned.
+    char encoded[BASE64_ENCODED_LENGTH(MAX_BYTES) + 1];
+    memset(encoded, '#', sizeof(encoded));
+    size_t n = base64_encode(raw, len, encoded, alphabet, pad);
+    CHECK(std::string(encoded, n) == expected);
+    CHECK(encoded[n] == '#');
+
+    int m = base64_decode(encoded, n, decoded, alphabet);
+    CHECK(m == (int)len && memcmp(decoded, raw, len) == 0);
+
+    // Chunked, split every 7 bytes and characters.
+    Base64Encoder encoder(alphabet, pad);
+    memset(encoded, '#', sizeof(encoded));
+    n = 0;
+    for (size_t at = 0; at < len; at += 7) {
+      n += encoder.update(raw + at, len - at < 7 ? len - at : 7, encoded + n);
+    }
+    n += encoder.final(encoded + n);
+    CHECK(std::string(encoded, n) == expected);
+    CHECK(encoded[n] == '#');
+
+    Base64Decoder decoder(alphabet);
+    m = 0;
+    for (size_t at = 0; at < n; at += 7) {
+      int k = decoder.update(encoded + at, n - at < 7 ? n - at : 7,
+                             decoded + m);
+      CHECK(k >= 0);
+      m += k;
+    }
+    m += decoder.final(decoded + m);
+    CHECK(m == (int)len && memcmp(decoded, raw, len) == 0);
+  }
+}
+
+static void test_malformed()
+{
+  unsigned char out[64];
+  CHECK(base64_decode("QUJD", 4, out) == 3);
+  CHECK(base64_decode("QU*D", 4, out) == -1);
+  CHECK(base64_decode("QUJ\xc4", 4, out) == -1);
+  CHECK(base64_decode("Q", 1, out) == -1);
+  // Each alphabet rejects the other's two characters.
+  CHECK(base64_decode("ab+/", 4, out, BASE64_STANDARD) == 3);
+  CHECK(base64_decode("ab+/", 4, out, BASE64_URL) == -1);
+  CHECK(base64_decode("ab-_", 4, out, BASE64_URL) == 3);
+  CHECK(base64_decode("ab-_", 4, out, BASE64_STANDARD) == -1);
+  // An invalid character in a block the SIMD paths decode.
+  char in[64];
+  memset(in, 'A', sizeof(in));
+  in[40] = '.';
+  CHECK(base64_decode(in, sizeof(in), out) == -1);
+}
+
+int main()
+{
+  test_round_trips(BASE64_STANDARD, true);
+  test_round_trips(BASE64_STANDARD, false);
+  test_round_trips(BASE64_URL, true);
+  test_round_trips(BASE64_URL, false);
+  test_malformed();
+  return test_result("base64");
+}
@@ -0,0 +1,102 @@
+// A full batch fits one spool record, so it is spooled while offline.
+// Binary payloads never go into a batch.
+#include <stdlib.h>
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMqtt.h"
+#include "brokers.h"
+#include "test.h"
+
+static void test_full_batch_is_spooled(BatchFraming framing)
+{
+  static CloudIoTCoreDevice device;
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  system("rm -rf build/test_batch_spool");
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreSpool spool("build/test_batch_spool");
+  CHECK(spool.begin());
+  CloudIoTCoreBatch batch(framing, 60000);
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setBatch(&batch);
+  mqtt.setSpool(&spool);
+
+  // Never connected: every full batch has to go to the spool.
+  const char sample[] = "{\"t\":21.5}";
+  for (int i = 0; i < 200; i++) {
+    CHECK(mqtt.publishTelemetry(sample, sizeof(sample) - 1));
+    CHECK(batch.length() <= CLOUD_IOT_CORE_BATCH_SIZE);
+  }
+  CHECK(spool.depth() > 0);
+  CHECK(batch.count() < 200 / spool.depth());
+
+  char record[CLOUD_IOT_CORE_SPOOL_RECORD_MAX];
+  int n = spool.peek(record, sizeof(record));
+  CHECK(n > CLOUD_IOT_CORE_BATCH_SIZE - (int)sizeof(sample));
+  CHECK(n <= CLOUD_IOT_CORE_BATCH_SIZE);
+  if (framing == BATCH_JSON_ARRAY && n > 0) {
+    CHECK(record[0] == '[' && record[n - 1] == ']');
+  }
+  system("rm -rf build/test_batch_spool");
+}
+
+static void test_binary_is_not_batched()
+{
+  static CloudIoTCoreDevice device;
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreBatch batch(BATCH_JSON_ARRAY, 60000);
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setBatch(&batch);
+  mqtt.startMQTT();
+  unsigned long start = millis();
+  while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+         millis() - start < 5000) {
+    mqtt.poll();
+  }
+  net.written.clear();
+
+  uint8_t buffer[16];
+  CborWriter cbor(buffer, sizeof(buffer));
+  cbor.beginMap(1).key("t").addFloat(21.5f);
+  CHECK(mqtt.publishTelemetry(cbor));
+  CHECK(batch.count() == 0);
+
+  std::vector<WrittenPacket> sent = net.packets();
+  CHECK(sent.size() == 1);
+  if (sent.size() == 1) {
+    CHECK(sent[0].topic == std::string(device.getEventsTopic()) + "/cbor");
+    CHECK(sent[0].payload ==
+          std::string((const char *)cbor.data(), cbor.length()));
+  }
+
+  net.written.clear();
+  uint8_t block[32];
+  GorillaEncoder series(block, sizeof(block));
+  series.append(1000, 21.5f);
+  series.append(1060, 21.5f);
+  CHECK(mqtt.publishTelemetry(series));
+  CHECK(batch.count() == 0);
+  sent = net.packets();
+  CHECK(sent.size() == 1);
+  if (sent.size() == 1) {
+    CHECK(sent[0].topic ==
+          std::string(device.getEventsTopic()) + "/gorilla");
+    CHECK(sent[0].payload ==
+          std::string((const char *)series.data(), series.length()));
+  }
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  test_binary_is_not_batched();
+  test_full_batch_is_spooled(BATCH_JSON_ARRAY);
+  test_full_batch_is_spooled(BATCH_LENGTH_PREFIXED);
+  return test_result("batch");
+}
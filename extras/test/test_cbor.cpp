@@ -0,0 +1,138 @@
+// CborWriter against the examples of RFC 7049 appendix A: shortest form
+// integers, half/single/double floats, strings and containers.
+#include <math.h>
+#include <string.h>
+#include <string>
+#include "CloudIoTCoreCbor.h"
+#include "test.h"
+
+static uint8_t buffer[64];
+
+static std::string hex(const CborWriter &w)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  for (size_t i = 0; i < w.length(); i++) {
+    out += digits[w.data()[i] >> 4];
+    out += digits[w.data()[i] & 0xf];
+  }
+  return out;
+}
+
+#define EXPECT(expr, bytes)                       \
+  do {                                            \
+    CborWriter w(buffer, sizeof(buffer));         \
+    w.expr;                                       \
+    CHECK(w.ok() && hex(w) == bytes);             \
+  } while (0)
+
+static void test_integers()
+{
+  EXPECT(addUint(0), "00");
+  EXPECT(addUint(23), "17");
+  EXPECT(addUint(24), "1818");
+  EXPECT(addUint(255), "18ff");
+  EXPECT(addUint(256), "190100");
+  EXPECT(addUint(1000), "1903e8");
+  EXPECT(addUint(65536), "1a00010000");
+  EXPECT(addUint(1000000), "1a000f4240");
+  EXPECT(addUint(1000000000000ULL), "1b000000e8d4a51000");
+  EXPECT(addUint(18446744073709551615ULL), "1bffffffffffffffff");
+  EXPECT(addInt(10), "0a");
+  EXPECT(addInt(-1), "20");
+  EXPECT(addInt(-10), "29");
+  EXPECT(addInt(-24), "37");
+  EXPECT(addInt(-25), "3818");
+  EXPECT(addInt(-100), "3863");
+  EXPECT(addInt(-1000), "3903e7");
+  EXPECT(addInt(INT64_MIN), "3b7fffffffffffffff");
+}
+
+static void test_floats()
+{
+  EXPECT(addFloat(0.0f), "f90000");
+  EXPECT(addFloat(-0.0f), "f98000");
+  EXPECT(addFloat(1.0f), "f93c00");
+  EXPECT(addFloat(1.5f), "f93e00");
+  EXPECT(addFloat(-4.0f), "f9c400");
+  EXPECT(addFloat(65504.0f), "f97bff");
+  EXPECT(addFloat(0.00006103515625f), "f90400");
+  EXPECT(addFloat(INFINITY), "f97c00");
+  EXPECT(addFloat(-INFINITY), "f9fc00");
+  EXPECT(addFloat(NAN), "f97e00");
+  // Not exact in half precision.
+  EXPECT(addFloat(100000.0f), "fa47c35000");
+  EXPECT(addFloat(1.1f), "fa3f8ccccd");
+  EXPECT(addFloat(3.4028234663852886e+38f), "fa7f7fffff");
+  EXPECT(addDouble(1.5), "f93e00");
+  EXPECT(addDouble(100000.0), "fa47c35000");
+  EXPECT(addDouble(1.1), "fb3ff199999999999a");
+  EXPECT(addDouble(1.0e+300), "fb7e37e43c8800759c");
+}
+
+static void test_other_items()
+{
+  EXPECT(addBool(false), "f4");
+  EXPECT(addBool(true), "f5");
+  EXPECT(addNull(), "f6");
+  EXPECT(addText(""), "60");
+  EXPECT(addText("a"), "6161");
+  EXPECT(addText("IETF"), "6449455446");
+  const uint8_t bytes[] = {1, 2, 3, 4};
+  EXPECT(addBytes(bytes, 4), "4401020304");
+}
+
+static void test_containers()
+{
+  EXPECT(beginArray(0), "80");
+  EXPECT(beginArray(3).addInt(1).addInt(2).addInt(3), "83010203");
+  EXPECT(beginMap(0), "a0");
+  EXPECT(beginMap(2).key("a").addInt(1).key("b").beginArray(2).addInt(2)
+             .addInt(3),
+         "a26161016162820203");
+  EXPECT(beginArray().addInt(1).beginArray(2).addInt(2).addInt(3).end(),
+         "9f01820203ff");
+  EXPECT(beginMap().key("a").addInt(1).key("b").beginArray().addInt(2).end()
+             .end(),
+         "bf61610161629f02ffff");
+  // 25 items need a one byte length.
+  {
+    CborWriter w(buffer, sizeof(buffer));
+    w.beginArray(25);
+    for (int i = 1; i <= 25; i++) {
+      w.addInt(i);
+    }
+    CHECK(w.ok() && hex(w).substr(0, 4) == "9819" && w.length() == 2 + 23 + 4);
+  }
+
+  CborWriter w(buffer, sizeof(buffer));
+  typedef CborSchema<CBOR_UINT, CBOR_INT, CBOR_FLOAT, CBOR_TEXT> Sample;
+  CHECK(Sample::write(w, 1000u, -1, 1.5f, "a"));
+  CHECK(hex(w) == "841903e820f93e006161");
+}
+
+static void test_overflow()
+{
+  uint8_t small[4];
+  CborWriter w(small, sizeof(small));
+  w.addUint(1000);
+  CHECK(w.ok() && w.length() == 3);
+  w.addUint(1000);
+  CHECK(!w.ok());
+  // Sticky, even for an item that would fit.
+  w.addUint(1);
+  CHECK(!w.ok() && w.length() <= sizeof(small));
+  w.reset();
+  w.addUint(1);
+  CHECK(w.ok() && w.length() == 1);
+}
+
+int main()
+{
+  test_integers();
+  test_floats();
+  test_other_items();
+  test_containers();
+  test_overflow();
+  return test_result("cbor");
+}
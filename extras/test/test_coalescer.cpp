@@ -0,0 +1,203 @@
+// CloudIoTCoreCoalescer: how many packets go out per client write, the
+// buffer limit, max latency, and flushing as soon as a buffered packet
+// expects an answer, on its own and under CloudIoTCoreMqtt.
+#include <string.h>
+#include <string>
+#include <vector>
+#include "CloudIoTCoreCoalescer.h"
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMqtt.h"
+#include "brokers.h"
+#include "test.h"
+
+// Records the size of every write.
+class CountingClient : public Client {
+  public:
+    std::vector<size_t> writes;
+    std::string written;
+    bool fail = false;
+
+    int connect(IPAddress, uint16_t) { return 1; }
+    int connect(const char *, uint16_t) { return 1; }
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t size)
+    {
+      if (fail) {
+        return 0;
+      }
+      writes.push_back(size);
+      written.append((const char *)buf, size);
+      return size;
+    }
+    int available() { return 0; }
+    int read() { return -1; }
+    int read(uint8_t *, size_t) { return -1; }
+    int peek() { return -1; }
+    void flush() {}
+    void stop() {}
+    uint8_t connected() { return 1; }
+    operator bool() { return true; }
+};
+
+// A PUBLISH of the given total size and QoS.
+static std::string publish_packet(size_t size, int qos)
+{
+  size_t header = size < 130 ? 2 : 3;
+  size_t remaining = size - header;
+  std::string packet(size, 'x');
+  packet[0] = (char)(0x30 | qos << 1);
+  if (header == 2) {
+    packet[1] = (char)remaining;
+  } else {
+    packet[1] = (char)(0x80 | (remaining & 0x7f));
+    packet[2] = (char)(remaining >> 7);
+  }
+  return packet;
+}
+
+static size_t write(CloudIoTCoreCoalescer &c, Client &client,
+                    const std::string &packet)
+{
+  return c.write(client, (const uint8_t *)packet.data(), packet.size());
+}
+
+static void test_packets_per_write()
+{
+  CountingClient client;
+  CloudIoTCoreCoalescer c(1000);
+  std::string expected;
+  for (int i = 0; i < 10; i++) {
+    std::string packet = publish_packet(30, 0);
+    CHECK(write(c, client, packet) == 30);
+    expected += packet;
+  }
+  CHECK(client.writes.empty() && c.pending() == 300);
+  CHECK(!c.awaitingReply() && !c.due());
+  CHECK(c.flush(client));
+  CHECK(client.writes.size() == 1 && client.written == expected);
+  CHECK(c.flushes() == 1 && c.packets() == 10);
+  CHECK(c.flush(client) && c.flushes() == 1);
+
+  // A packet handed over in pieces, as lwmqtt may, is one packet.
+  std::string packet = publish_packet(200, 0);
+  const uint8_t *p = (const uint8_t *)packet.data();
+  c.write(client, p, 1);
+  c.write(client, p + 1, 1);
+  c.write(client, p + 2, 50);
+  c.write(client, p + 52, 148);
+  CHECK(c.packets() == 11);
+  c.flush(client);
+  CHECK(client.writes.size() == 2 && client.writes[1] == 200);
+}
+
+static void test_buffer_limit()
+{
+  CountingClient client;
+  CloudIoTCoreCoalescer c(1000);
+  std::string expected;
+  for (int i = 0; i < 30; i++) {
+    std::string packet = publish_packet(100, 0);
+    write(c, client, packet);
+    expected += packet;
+  }
+  // Ten 100 byte packets fit the buffer at a time.
+  CHECK(client.writes.size() == 2);
+  for (size_t i = 0; i < client.writes.size(); i++) {
+    CHECK(client.writes[i] == 1000);
+  }
+  c.flush(client);
+  CHECK(client.written == expected);
+
+  // Larger than the buffer: what is buffered goes first, then the packet
+  // on its own.
+  write(c, client, publish_packet(50, 0));
+  write(c, client, publish_packet(CLOUD_IOT_CORE_COALESCE_BUFFER + 10, 0));
+  CHECK(client.writes.size() == 5);
+  CHECK(client.writes[3] == 50);
+  CHECK(client.writes[4] == CLOUD_IOT_CORE_COALESCE_BUFFER + 10);
+  CHECK(c.pending() == 0);
+
+  client.fail = true;
+  CHECK(write(c, client, publish_packet(50, 0)) == 50);
+  CHECK(!c.flush(client));
+}
+
+static void test_latency_and_replies()
+{
+  CountingClient client;
+  CloudIoTCoreCoalescer c(20);
+  write(c, client, publish_packet(30, 0));
+  CHECK(!c.due());
+  delay(20);
+  CHECK(c.due());
+  // The next write past the latency goes out with it.
+  write(c, client, publish_packet(30, 0));
+  CHECK(client.writes.size() == 1 && client.writes[0] == 60);
+
+  // QoS 1 PUBLISH, PINGREQ, SUBSCRIBE and CONNECT are answered.
+  const std::string replied[] = {
+      publish_packet(30, 1), std::string("\xc0\x00", 2),
+      std::string("\x82\x02\x00\x01", 4), std::string("\x10\x00", 2)};
+  for (int i = 0; i < 4; i++) {
+    write(c, client, publish_packet(30, 0));
+    CHECK(!c.awaitingReply());
+    write(c, client, replied[i]);
+    CHECK(c.awaitingReply());
+    c.flush(client);
+    CHECK(!c.awaitingReply());
+  }
+  c.clear();
+  CHECK(c.pending() == 0);
+}
+
+static CloudIoTCoreDevice device;
+
+static void test_mqtt()
+{
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreCoalescer coalescer(1000);
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setCoalescer(&coalescer);
+  mqtt.startMQTT();
+  unsigned long start = millis();
+  while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+         millis() - start < 5000) {
+    mqtt.poll();
+  }
+  CHECK(mqtt.getState() == CloudIoTCoreMqtt::CONN_CONNECTED);
+
+  // QoS 0 telemetry waits in the buffer, even across poll().
+  mqtt.flushWrites();
+  size_t before = net.written.size();
+  uint32_t flushes = coalescer.flushes();
+  for (int i = 0; i < 5; i++) {
+    CHECK(mqtt.publishTelemetry("{\"t\":1}", 7));
+  }
+  mqtt.poll();
+  CHECK(net.written.size() == before && coalescer.pending() > 0);
+  CHECK(mqtt.flushWrites());
+  CHECK(coalescer.flushes() == flushes + 1);
+  CHECK(net.packets().size() >= 5 && coalescer.pending() == 0);
+
+  // A QoS 1 publish goes out before the next read looks for its PUBACK.
+  before = net.written.size();
+  CHECK(mqtt.publishTelemetryQos1("{\"t\":2}", 7));
+  CHECK(coalescer.awaitingReply());
+  mqtt.poll();
+  CHECK(net.written.size() > before && coalescer.pending() == 0);
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  test_packets_per_write();
+  test_buffer_limit();
+  test_latency_and_replies();
+  test_mqtt();
+  return test_result("coalescer");
+}
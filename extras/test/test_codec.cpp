@@ -0,0 +1,228 @@
+// flags: -DCLOUD_IOT_CORE_NATIVE_MQTT=1
+// The built-in MQTT codec against a scripted broker that answers CONNECT,
+// SUBSCRIBE, QoS 1 PUBLISH and PINGREQ.
+#include <string>
+#include <vector>
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMqtt.h"
+#include "test.h"
+
+struct Packet {
+  uint8_t header;
+  std::vector<uint8_t> body;
+};
+
+class ScriptedBroker : public Client {
+  public:
+    std::vector<Packet> sent;
+    std::vector<uint8_t> pending;  // to the client
+    bool up = false;
+    bool sessionPresent = false;
+
+    int connect(const char *, uint16_t)
+    {
+      up = true;
+      return 1;
+    }
+    int connect(IPAddress, uint16_t) { return 0; }
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t size)
+    {
+      if (!up) {
+        return 0;
+      }
+      out.insert(out.end(), buf, buf + size);
+      answer();
+      return size;
+    }
+    int available() { return up ? pending.size() : 0; }
+    int read() { return -1; }
+    int read(uint8_t *buf, size_t size)
+    {
+      size = size < pending.size() ? size : pending.size();
+      memcpy(buf, pending.data(), size);
+      pending.erase(pending.begin(), pending.begin() + size);
+      return size;
+    }
+    int peek() { return -1; }
+    void flush() {}
+    void stop() { up = false; }
+    uint8_t connected() { return up; }
+    operator bool() { return true; }
+
+    void deliver(uint8_t header, const std::string &topic,
+                 const std::string &payload, uint16_t id = 0)
+    {
+      size_t length = 2 + topic.size() + (header & 0x06 ? 2 : 0) +
+                      payload.size();
+      pending.push_back(header);
+      do {
+        uint8_t b = length & 0x7f;
+        length >>= 7;
+        pending.push_back(length ? b | 0x80 : b);
+      } while (length);
+      pending.push_back(topic.size() >> 8);
+      pending.push_back(topic.size());
+      pending.insert(pending.end(), topic.begin(), topic.end());
+      if (header & 0x06) {
+        pending.push_back(id >> 8);
+        pending.push_back(id);
+      }
+      pending.insert(pending.end(), payload.begin(), payload.end());
+    }
+
+    int count(uint8_t type)
+    {
+      int n = 0;
+      for (size_t i = 0; i < sent.size(); i++) {
+        n += (sent[i].header >> 4) == type;
+      }
+      return n;
+    }
+
+  private:
+    std::vector<uint8_t> out;  // from the client, partly framed
+
+    void answer()
+    {
+      while (out.size() >= 2) {
+        size_t length = 0;
+        size_t i = 1;
+        int shift = 0;
+        do {
+          if (i >= out.size()) {
+            return;
+          }
+          length |= (size_t)(out[i] & 0x7f) << shift;
+          shift += 7;
+        } while (out[i++] & 0x80);
+        if (out.size() < i + length) {
+          return;
+        }
+        Packet p = {out[0], std::vector<uint8_t>(out.begin() + i,
+                                                 out.begin() + i + length)};
+        out.erase(out.begin(), out.begin() + i + length);
+        sent.push_back(p);
+        switch (p.header >> 4) {
+          case 1:  // CONNECT
+            pending.insert(pending.end(),
+                           {0x20, 2, (uint8_t)sessionPresent, 0});
+            break;
+          case 8:  // SUBSCRIBE
+            pending.insert(pending.end(), {0x90, 3, p.body[0], p.body[1],
+                                           1});
+            break;
+          case 3:  // PUBLISH
+            if (p.header & 0x06) {
+              size_t t = (p.body[0] << 8) | p.body[1];
+              pending.insert(pending.end(), {0x40, 2, p.body[2 + t],
+                                             p.body[3 + t]});
+            }
+            break;
+          case 12:  // PINGREQ
+            pending.insert(pending.end(), {0xd0, 0});
+            break;
+        }
+      }
+    }
+};
+
+static std::vector<std::string> received;
+
+void messageReceived(String &topic, String &payload)
+{
+  received.push_back(std::string(topic.c_str()) + " " + payload.c_str());
+}
+
+static void on_config(void *, const char *, const char *payload, size_t length)
+{
+  received.push_back("config " + std::string(payload, length));
+}
+
+static CloudIoTCoreDevice device;
+
+static bool connect(CloudIoTCoreMqtt &mqtt)
+{
+  unsigned long start = millis();
+  while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+         millis() - start < 5000) {
+    mqtt.poll();
+  }
+  return mqtt.getState() == CloudIoTCoreMqtt::CONN_CONNECTED;
+}
+
+static void test_connect_publish_receive()
+{
+  ScriptedBroker broker;
+  MQTTClient mqttClient(512);
+  CloudIoTCoreMqtt mqtt(&mqttClient, &broker, &device);
+  mqtt.setLogConnect(false);
+  mqtt.onConfig(on_config, NULL);
+  mqtt.startMQTT();
+  received.clear();
+
+  CHECK(connect(mqtt));
+  CHECK(broker.count(1) == 1);
+  CHECK(broker.count(8) == 2);
+  // CONNECT carries the JWT as the password.
+  const std::vector<uint8_t> &c = broker.sent[0].body;
+  std::string jwt = device.getJWT();
+  CHECK(c.size() > jwt.size() &&
+        std::string(c.end() - jwt.size(), c.end()) == jwt);
+
+  CHECK(mqtt.publishTelemetry("hello", 5));
+  CHECK(broker.count(3) == 1);
+  const std::vector<uint8_t> &p = broker.sent.back().body;
+  std::string events = device.getEventsTopic();
+  CHECK(std::string(p.begin() + 2, p.end()) == events + "hello");
+
+  broker.deliver(0x32, device.getConfigTopic(), "{\"a\":1}", 7);
+  broker.deliver(0x30, "/devices/device/commands/x", "go");
+  mqtt.poll();
+  CHECK(received.size() == 2);
+  CHECK(received.size() > 0 && received[0] == "config {\"a\":1}");
+  CHECK(received.size() > 1 &&
+        received[1] == "/devices/device/commands/x go");
+  // The config was QoS 1 and is acknowledged.
+  CHECK(broker.count(4) == 1);
+  CHECK(broker.sent.back().body == std::vector<uint8_t>({0, 7}));
+  CHECK(mqttClient.connected());
+}
+
+static void test_oversized_messages()
+{
+  ScriptedBroker broker;
+  MQTTClient mqttClient(512);
+  CloudIoTCoreMqtt mqtt(&mqttClient, &broker, &device);
+  mqtt.setLogConnect(false);
+  mqtt.onConfig(on_config, NULL);
+  mqtt.startMQTT();
+  received.clear();
+  CHECK(connect(mqtt));
+
+  // QoS 0: skipped, the connection stays.
+  std::string big(CLOUD_IOT_CORE_CODEC_INBOUND, 'x');
+  broker.deliver(0x30, "/devices/device/commands", big);
+  mqtt.poll();
+  CHECK(received.empty());
+  CHECK(mqttClient.connected());
+
+  // QoS 1: not acknowledged, the connection is closed.
+  broker.deliver(0x32, device.getConfigTopic(), big, 9);
+  mqttClient.loop();
+  CHECK(received.empty());
+  CHECK(broker.count(4) == 0);
+  CHECK(!mqttClient.connected());
+  CHECK(mqttClient.lastError() == LWMQTT_BUFFER_TOO_SHORT);
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  test_connect_publish_receive();
+  test_oversized_messages();
+  return test_result("codec");
+}
@@ -0,0 +1,132 @@
+// CloudIoTCoreConfig: repeats of the applied config are dropped, the hash
+// and IoT Core's version survive a restart from the stored record, and
+// through CloudIoTCoreMqtt only changed configs reach the handler.
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMqtt.h"
+#include "brokers.h"
+#include "test.h"
+
+#define PATH "build/test_config.bin"
+
+static bool update(CloudIoTCoreConfig &config, const char *payload)
+{
+  return config.update(payload, strlen(payload));
+}
+
+static bool update(CloudIoTCoreConfig &config, const char *payload,
+                   uint32_t version)
+{
+  return config.update(payload, strlen(payload), version);
+}
+
+static void test_dedup()
+{
+  CloudIoTCoreConfig config;
+  CHECK(!config.begin());
+  CHECK(update(config, "{\"rate\":1}"));
+  CHECK(!update(config, "{\"rate\":1}"));
+  CHECK(update(config, "{\"rate\":2}"));
+  CHECK(update(config, "{\"rate\":1}"));
+  // MQTT does not say which version it is.
+  CHECK(config.version() == 0);
+
+  CHECK(update(config, "{\"rate\":3}", 7));
+  CHECK(config.version() == 7);
+  CHECK(!update(config, "{\"rate\":3}", 8));
+  CHECK(config.version() == 7);
+
+  config.forget();
+  CHECK(update(config, "{\"rate\":3}"));
+  CHECK(config.version() == 0);
+}
+
+static void test_restart()
+{
+  remove(PATH);
+  {
+    CloudIoTCoreConfig config(PATH);
+    CHECK(!config.begin());
+    CHECK(update(config, "{\"rate\":5}", 12));
+  }
+  {
+    CloudIoTCoreConfig config(PATH);
+    CHECK(config.begin());
+    CHECK(config.version() == 12);
+    CHECK(!update(config, "{\"rate\":5}"));
+    CHECK(update(config, "{\"rate\":6}"));
+  }
+  {
+    // The version is not made up when it is not known.
+    CloudIoTCoreConfig config(PATH);
+    CHECK(config.begin() && config.version() == 0);
+    CHECK(!update(config, "{\"rate\":6}"));
+  }
+
+  // A damaged record is ignored.
+  FILE *f = fopen(PATH, "rb+");
+  fseek(f, 10, SEEK_SET);
+  fputc(0x55, f);
+  fclose(f);
+  CloudIoTCoreConfig config(PATH);
+  CHECK(!config.begin());
+  CHECK(update(config, "{\"rate\":6}"));
+}
+
+static CloudIoTCoreDevice device;
+static std::vector<std::string> received;
+
+static void on_config(void *, const char *, const char *payload,
+                      size_t length)
+{
+  received.push_back(std::string(payload, length));
+}
+
+// As the MQTT client hands over a config message.
+static void deliver(MQTTClient &client, const std::string &payload)
+{
+  std::string bytes = payload;
+  client.advanced(&client, (char *)device.getConfigTopic(), &bytes[0],
+                  bytes.size());
+}
+
+static void test_mqtt()
+{
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreConfig config;
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setConfigTracking(&config);
+  mqtt.onConfig(on_config);
+  mqtt.startMQTT();
+  unsigned long start = millis();
+  while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+         millis() - start < 5000) {
+    mqtt.poll();
+  }
+  CHECK(mqtt.getState() == CloudIoTCoreMqtt::CONN_CONNECTED);
+
+  CHECK(mqttClient.advanced != NULL);
+  deliver(mqttClient, "{\"a\":1}");
+  deliver(mqttClient, "{\"a\":1}");
+  deliver(mqttClient, "{\"a\":2}");
+  CHECK(received.size() == 2);
+  CHECK(received.size() == 2 && received[0] == "{\"a\":1}" &&
+        received[1] == "{\"a\":2}");
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  test_dedup();
+  test_restart();
+  test_mqtt();
+  return test_result("config");
+}
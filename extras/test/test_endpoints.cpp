@@ -0,0 +1,150 @@
+// Endpoint selection against two stand-in brokers with different latencies.
+#include <stdio.h>
+#include "CloudIoTCoreEndpoints.h"
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMqtt.h"
+#include "brokers.h"
+#include "test.h"
+
+#define PRIMARY CloudIoTCoreEndpoints::ENDPOINT_PRIMARY
+#define LTS CloudIoTCoreEndpoints::ENDPOINT_LTS
+
+static const char *path = "build/test_endpoints.bin";
+
+// One connect the way CloudIoTCoreMqtt does it; returns the endpoint used.
+static int connect_once(CloudIoTCoreEndpoints &ep, StandInNetwork &net)
+{
+  const char *host = ep.select();
+  unsigned long start = millis();
+  bool ok = net.connect(host, 8883);
+  ep.report(ok, millis() - start);
+  net.stop();
+  return ep.current();
+}
+
+static void test_converges_on_faster()
+{
+  StandInNetwork net(30, 5);
+  CloudIoTCoreEndpoints ep(path);
+  CHECK(connect_once(ep, net) == PRIMARY);
+  // The other one is measured on the next connect, then the faster wins.
+  CHECK(connect_once(ep, net) == LTS);
+  CHECK(ep.preferred() == LTS);
+  CHECK(ep.latency(PRIMARY) >= 30);
+  CHECK(ep.latency(LTS) >= 5 && ep.latency(LTS) < ep.latency(PRIMARY));
+
+  // From there the slower one is only probed, every PROBE_EVERY connects.
+  int last_probe = -1;
+  int gaps = 0;
+  for (int i = 0; i < 4 * CLOUD_IOT_CORE_ENDPOINT_PROBE_EVERY; i++) {
+    if (connect_once(ep, net) == PRIMARY) {
+      if (last_probe >= 0) {
+        CHECK(i - last_probe == CLOUD_IOT_CORE_ENDPOINT_PROBE_EVERY);
+        gaps++;
+      }
+      last_probe = i;
+    }
+  }
+  CHECK(gaps >= 2);
+  CHECK(ep.preferred() == LTS);
+}
+
+static void test_failover_and_recovery()
+{
+  StandInNetwork net(30, 5);
+  CloudIoTCoreEndpoints ep(path);
+  connect_once(ep, net);
+  connect_once(ep, net);
+  CHECK(ep.preferred() == LTS);
+
+  net.brokers[1].down = true;
+  int attempts = 0;
+  while (connect_once(ep, net) == LTS && attempts < 100) {
+    attempts++;
+  }
+  CHECK(attempts == CLOUD_IOT_CORE_ENDPOINT_FAILOVER);
+  CHECK(!ep.healthy(LTS));
+  CHECK(ep.preferred() == PRIMARY);
+
+  // Once it is back, a probe finds it and it is preferred again.
+  net.brokers[1].down = false;
+  int connects = 0;
+  while (ep.preferred() != LTS && connects < 100) {
+    connect_once(ep, net);
+    connects++;
+  }
+  CHECK(connects <= CLOUD_IOT_CORE_ENDPOINT_PROBE_EVERY + 1);
+  CHECK(ep.healthy(LTS));
+  CHECK(ep.failures(LTS) == 0);
+}
+
+static void test_reload()
+{
+  StandInNetwork net(30, 5);
+  remove(path);
+  {
+    CloudIoTCoreEndpoints fresh(path);
+    CHECK(!fresh.begin());
+  }
+  CloudIoTCoreEndpoints ep(path);
+  connect_once(ep, net);
+  connect_once(ep, net);
+  net.brokers[1].down = true;
+  for (int i = 0; i < CLOUD_IOT_CORE_ENDPOINT_FAILOVER; i++) {
+    connect_once(ep, net);
+  }
+  CHECK(!ep.healthy(LTS));
+
+  CloudIoTCoreEndpoints reloaded(path);
+  CHECK(reloaded.begin());
+  for (int i = 0; i < CloudIoTCoreEndpoints::ENDPOINTS; i++) {
+    CHECK(reloaded.healthy(i) == ep.healthy(i));
+    CHECK(reloaded.failures(i) == ep.failures(i));
+    CHECK(reloaded.latency(i) == ep.latency(i));
+  }
+  CHECK(reloaded.preferred() == PRIMARY);
+  CHECK(reloaded.current() == PRIMARY);
+}
+
+// Same through CloudIoTCoreMqtt: reconnects after each drop end up on the
+// faster broker.
+static void test_mqtt_uses_faster()
+{
+  static CloudIoTCoreDevice device;
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  StandInNetwork net(30, 5);
+  MQTTClient mqttClient;
+  CloudIoTCoreEndpoints ep;
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setEndpoints(&ep);
+  mqtt.startMQTT();
+
+  for (int i = 0; i < 12; i++) {
+    unsigned long start = millis();
+    while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+           millis() - start < 5000) {
+      mqtt.poll();
+    }
+    CHECK(mqtt.getState() == CloudIoTCoreMqtt::CONN_CONNECTED);
+    net.drop();
+    mqtt.poll();
+  }
+  CHECK(net.brokers[1].connects > net.brokers[0].connects);
+  CHECK(ep.preferred() == LTS);
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  remove(path);
+  test_converges_on_faster();
+  remove(path);
+  test_failover_and_recovery();
+  test_reload();
+  test_mqtt_uses_faster();
+  remove(path);
+  return test_result("endpoints");
+}
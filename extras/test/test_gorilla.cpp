@@ -0,0 +1,151 @@
+// GorillaEncoder / GorillaDecoder round trips: every timestamp bucket,
+// repeated, drifting and random readings, and a full buffer.
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "CloudIoTCoreGorilla.h"
+#include "test.h"
+
+struct Sample {
+  uint32_t timestamp;
+  float values[CLOUD_IOT_CORE_GORILLA_COLUMNS];
+};
+
+static bool same_bits(float a, float b)
+{
+  return memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+// Encodes the samples and decodes them again, the values bit for bit.
+static void round_trip(const std::vector<Sample> &samples, uint8_t columns)
+{
+  static uint8_t buffer[16384];
+  GorillaEncoder encoder(buffer, sizeof(buffer), columns);
+  for (size_t i = 0; i < samples.size(); i++) {
+    CHECK(encoder.append(samples[i].timestamp, samples[i].values));
+  }
+  CHECK(encoder.count() == samples.size());
+
+  GorillaDecoder decoder(encoder.data(), encoder.length());
+  CHECK(decoder.ok());
+  CHECK(decoder.columns() == columns);
+  CHECK(decoder.count() == samples.size());
+  Sample out;
+  size_t i = 0;
+  bool equal = true;
+  while (decoder.next(&out.timestamp, out.values)) {
+    equal = equal && i < samples.size() &&
+            out.timestamp == samples[i].timestamp;
+    for (uint8_t c = 0; c < columns && equal; c++) {
+      equal = same_bits(out.values[c], samples[i].values[c]);
+    }
+    i++;
+  }
+  CHECK(equal);
+  CHECK(i == samples.size());
+}
+
+static void test_timestamps()
+{
+  // Deltas of delta in each bucket, both signs, and a step back in time.
+  static const int32_t steps[] = {0, 1, -1, 63, -63, 64, 200, -255, 256,
+                                  2047, -2047, 2048, 70000, -70000};
+  std::vector<Sample> samples;
+  uint32_t t = 1500000000;
+  int32_t delta = 60;
+  Sample s = {};
+  for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+    delta += steps[i];
+    t += delta;
+    s.timestamp = t;
+    s.values[0] = 21.5f;
+    samples.push_back(s);
+  }
+  s.timestamp = 0;
+  samples.push_back(s);
+  s.timestamp = 0xffffffff;
+  samples.push_back(s);
+  round_trip(samples, 1);
+}
+
+static void test_values()
+{
+  std::vector<Sample> samples;
+  Sample s = {};
+  float drift = 20.0f;
+  for (int i = 0; i < 500; i++) {
+    s.timestamp = 1000 + i * 10;
+    drift += 0.01f * (rand() % 7 - 3);
+    s.values[0] = drift;
+    s.values[1] = 42.0f;
+    uint32_t bits = rand() ^ (rand() << 16);
+    memcpy(&s.values[2], &bits, sizeof(float));
+    s.values[3] = i % 50 == 0 ? -0.0f : 0.0f;
+    samples.push_back(s);
+  }
+  round_trip(samples, 4);
+
+  // Every column in use.
+  for (size_t i = 0; i < samples.size(); i++) {
+    for (int c = 4; c < CLOUD_IOT_CORE_GORILLA_COLUMNS; c++) {
+      samples[i].values[c] = samples[i].values[c % 4] * c;
+    }
+  }
+  round_trip(samples, CLOUD_IOT_CORE_GORILLA_COLUMNS);
+}
+
+static void test_full_buffer()
+{
+  uint8_t buffer[32];
+  GorillaEncoder encoder(buffer, sizeof(buffer));
+  uint16_t appended = 0;
+  for (uint32_t i = 0; i < 100; i++) {
+    float value = (float)rand();
+    if (!encoder.append(i * 17 + (i % 3), value)) {
+      break;
+    }
+    appended++;
+  }
+  CHECK(appended > 0 && appended < 100);
+  CHECK(encoder.count() == appended);
+  CHECK(encoder.length() <= sizeof(buffer));
+
+  // What fit still decodes; cut short, the decoder stops.
+  GorillaDecoder decoder(encoder.data(), encoder.length());
+  uint32_t t;
+  float v;
+  uint16_t n = 0;
+  while (decoder.next(&t, &v)) {
+    n++;
+  }
+  CHECK(n == appended);
+
+  GorillaDecoder truncated(encoder.data(), encoder.length() / 2);
+  n = 0;
+  while (truncated.next(&t, &v)) {
+    n++;
+  }
+  CHECK(n < appended);
+
+  GorillaDecoder damaged((const uint8_t *)"X", 1);
+  CHECK(!damaged.ok());
+}
+
+static void test_single_value_needs_one_column()
+{
+  uint8_t buffer[32];
+  GorillaEncoder two(buffer, sizeof(buffer), 2);
+  CHECK(!two.append(1, 1.0f));
+  CHECK(two.count() == 0);
+  const float values[2] = {1.0f, 2.0f};
+  CHECK(two.append(1, values));
+}
+
+int main()
+{
+  test_timestamps();
+  test_values();
+  test_full_buffer();
+  test_single_value_needs_one_column();
+  return test_result("gorilla");
+}
@@ -0,0 +1,138 @@
+// CloudIoTCoreIngest: push and pop in order, a full queue that drops and
+// counts, many laps around the slots, and several producer threads
+// against one consumer.
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "CloudIoTCoreIngest.h"
+#include "test.h"
+
+static bool push(CloudIoTCoreIngest &ingest, uint32_t value)
+{
+  return ingest.push(&value, sizeof(value));
+}
+
+// The oldest value, or -1.
+static long pop(CloudIoTCoreIngest &ingest)
+{
+  uint32_t value;
+  return ingest.pop(&value, sizeof(value)) == sizeof(value) ? (long)value
+                                                           : -1;
+}
+
+static void test_full()
+{
+  CloudIoTCoreIngest ingest;
+  CHECK(ingest.empty() && pop(ingest) == -1);
+  bool pushed = true;
+  for (uint32_t i = 0; i < CLOUD_IOT_CORE_INGEST_SLOTS; i++) {
+    pushed = push(ingest, i) && pushed;
+  }
+  CHECK(pushed && !ingest.empty());
+  CHECK(!push(ingest, 99));
+  CHECK(!push(ingest, 99));
+  CHECK(ingest.dropped() == 2);
+
+  // Room for exactly one more once one is popped.
+  CHECK(pop(ingest) == 0);
+  CHECK(push(ingest, CLOUD_IOT_CORE_INGEST_SLOTS));
+  CHECK(!push(ingest, 99));
+  bool in_order = true;
+  for (uint32_t i = 1; i <= CLOUD_IOT_CORE_INGEST_SLOTS; i++) {
+    in_order = pop(ingest) == (long)i && in_order;
+  }
+  CHECK(in_order);
+  CHECK(ingest.empty() && ingest.dropped() == 3);
+}
+
+static void test_lengths()
+{
+  CloudIoTCoreIngest ingest;
+  uint8_t big[CLOUD_IOT_CORE_INGEST_PAYLOAD + 1] = {0};
+  CHECK(!ingest.push(big, 0));
+  CHECK(!ingest.push(big, sizeof(big)));
+  CHECK(ingest.dropped() == 1);
+  CHECK(ingest.push(big, CLOUD_IOT_CORE_INGEST_PAYLOAD));
+
+  // Too small a buffer leaves the payload queued.
+  uint8_t out[CLOUD_IOT_CORE_INGEST_PAYLOAD];
+  CHECK(ingest.pop(out, sizeof(out) - 1) == -1);
+  CHECK(!ingest.empty());
+  CHECK(ingest.pop(out, sizeof(out)) == CLOUD_IOT_CORE_INGEST_PAYLOAD);
+  CHECK(ingest.empty());
+}
+
+static void test_wrap_around()
+{
+  // Uneven batches so the positions cross the end of the slots at every
+  // offset.
+  CloudIoTCoreIngest ingest;
+  uint32_t next_push = 0;
+  uint32_t next_pop = 0;
+  bool in_order = true;
+  for (int round = 0; round < 500; round++) {
+    int n = 1 + round % (CLOUD_IOT_CORE_INGEST_SLOTS - 1);
+    for (int i = 0; i < n; i++) {
+      in_order = push(ingest, next_push++) && in_order;
+    }
+    for (int i = 0; i < n; i++) {
+      in_order = pop(ingest) == (long)next_pop++ && in_order;
+    }
+  }
+  CHECK(in_order);
+  CHECK(next_pop > 100 * CLOUD_IOT_CORE_INGEST_SLOTS);
+  CHECK(ingest.empty() && ingest.dropped() == 0);
+}
+
+#define PRODUCERS 4
+#define PER_PRODUCER 20000
+
+static void test_producers()
+{
+  static CloudIoTCoreIngest ingest;
+  std::vector<std::thread> threads;
+  for (uint32_t p = 0; p < PRODUCERS; p++) {
+    threads.push_back(std::thread([p] {
+      for (uint32_t i = 0; i < PER_PRODUCER; i++) {
+        // Producer in the top byte, a count below.
+        push(ingest, p << 24 | i);
+      }
+    }));
+  }
+
+  // Each producer's values arrive in order, none twice.
+  long last[PRODUCERS];
+  for (int p = 0; p < PRODUCERS; p++) {
+    last[p] = -1;
+  }
+  uint32_t received = 0;
+  bool in_order = true;
+  bool done = false;
+  while (!done) {
+    done = received + ingest.dropped() == PRODUCERS * PER_PRODUCER;
+    long value;
+    while ((value = pop(ingest)) >= 0) {
+      int p = value >> 24;
+      long i = value & 0xffffff;
+      in_order = p < PRODUCERS && i > last[p] && in_order;
+      last[p] = i;
+      received++;
+    }
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  CHECK(in_order);
+  CHECK(received + ingest.dropped() == PRODUCERS * PER_PRODUCER);
+  CHECK(received > 0 && ingest.empty());
+}
+
+int main()
+{
+  test_full();
+  test_lengths();
+  test_wrap_around();
+  test_producers();
+  return test_result("ingest");
+}
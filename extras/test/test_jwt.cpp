@@ -0,0 +1,99 @@
+// ES256 JWTs signed in slices by the device and in one go by create_jwt:
+// the token length, and the signature checked with ecdsa_verify against
+// the public key. A project id too long for the token is refused.
+#include <string.h>
+#include <string>
+#include "CloudIoTCoreBase64.h"
+#include "CloudIoTCoreDevice.h"
+#include "CloudIoTCoreLog.h"
+#include "jwt.h"
+#include "crypto/ecc.h"
+#include "crypto/sha256.h"
+#include "test.h"
+
+#define PRIVATE_KEY                                                      \
+  "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:ad:cc:" \
+  "50:7d:a5:d6:86:9c:de:fd:4f"
+// 36 characters of header, 72 of payload for "my-project" with 10 digit
+// times and 86 of signature, unpadded, with the two dots.
+#define TOKEN_LENGTH 196
+
+static NN_DIGIT priv_key[NUMWORDS];
+static point_t pub_key;
+
+static void make_keys()
+{
+  unsigned char bytes[32];
+  const char *hex = PRIVATE_KEY;
+  for (int i = 0; i < 32; i++, hex += 3) {
+    bytes[i] = (unsigned char)strtoul(hex, NULL, 16);
+  }
+  NN_Decode(priv_key, NUMWORDS, bytes, sizeof(bytes));
+  ecc_init();
+  ecc_gen_pub_key(priv_key, &pub_key);
+  ecdsa_init(&pub_key);
+}
+
+// Checks the signature over "header.payload" against the public key.
+static bool verifies(const std::string &token)
+{
+  size_t dot = token.rfind('.');
+  if (dot == std::string::npos || token.find('.') == dot) {
+    return false;
+  }
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  Sha256 sha256;
+  sha256.update((const unsigned char *)token.data(), dot);
+  sha256.final(digest);
+
+  std::string encoded = token.substr(dot + 1);
+  unsigned char signature[BASE64_DECODED_LENGTH(86)];
+  if (base64_decode(encoded.data(), encoded.size(), signature, BASE64_URL) !=
+      64) {
+    return false;
+  }
+  NN_DIGIT r[NUMWORDS], s[NUMWORDS];
+  NN_Decode(r, NUMWORDS, signature, 32);
+  NN_Decode(s, NUMWORDS, signature + 32, 32);
+  return ecdsa_verify(digest, r, s, &pub_key) == 1;
+}
+
+static void test_device_slices()
+{
+  CloudIoTCoreDevice device;
+  device.init("my-project", "location", "registry", "device", PRIVATE_KEY);
+  int slices = 1;
+  while (!device.refreshJWT(1000) && slices < 100000) {
+    slices++;
+  }
+  CHECK(slices > 1 && slices < 100000);
+  CHECK(device.isJWTValid());
+  std::string token = device.getJWT();
+  CHECK(token.size() == TOKEN_LENGTH);
+  CHECK(verifies(token));
+
+  // Damaged, it no longer verifies.
+  token[40] = token[40] == 'A' ? 'B' : 'A';
+  CHECK(!verifies(token));
+}
+
+static void test_create_jwt()
+{
+  char jwt[JWT_MAX_LENGTH];
+  size_t n = create_jwt(jwt, "my-project", 1700000000, priv_key, 3600);
+  CHECK(n == TOKEN_LENGTH && strlen(jwt) == n);
+  CHECK(verifies(jwt));
+
+  std::string project(JWT_MAX_LENGTH, 'p');
+  CHECK(create_jwt(jwt, project.c_str(), 1700000000, priv_key, 3600) == 0);
+  CHECK(jwt[0] == '\0');
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  make_keys();
+  test_device_slices();
+  test_create_jwt();
+  return test_result("jwt");
+}
@@ -0,0 +1,85 @@
+// LzEncoder / lz_decompress round trips over text, runs and random bytes,
+// fed in chunks of every size up to past the window.
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "CloudIoTCoreLz.h"
+#include "test.h"
+
+static bool round_trip(const std::string &input, size_t chunk)
+{
+  LzEncoder encoder;
+  std::vector<uint8_t> compressed;
+  uint8_t out[LZ_OUTPUT_MAX(LZ_WINDOW * 2)];
+  bool bounded = true;
+  for (size_t at = 0; at < input.size(); at += chunk) {
+    size_t n = input.size() - at < chunk ? input.size() - at : chunk;
+    size_t written =
+        encoder.update((const uint8_t *)input.data() + at, n, out);
+    bounded = bounded && written <= LZ_OUTPUT_MAX(n);
+    compressed.insert(compressed.end(), out, out + written);
+  }
+  size_t written = encoder.final(out);
+  bounded = bounded && written <= LZ_OUTPUT_MAX(0);
+  compressed.insert(compressed.end(), out, out + written);
+  CHECK(bounded);
+
+  std::vector<uint8_t> decompressed(input.size() + 1);
+  int n = lz_decompress(compressed.data(), compressed.size(),
+                        decompressed.data(), decompressed.size());
+  return n == (int)input.size() &&
+         memcmp(decompressed.data(), input.data(), input.size()) == 0;
+}
+
+static std::string inputs[4];
+
+static void make_inputs()
+{
+  for (int i = 0; i < 40; i++) {
+    inputs[0] += "{\"temp\":" + std::to_string(20 + i % 5) +
+                 ",\"hum\":" + std::to_string(40 + i % 3) + "}";
+  }
+  inputs[1] = std::string(1000, 'a');
+  for (int i = 0; i < 1000; i++) {
+    inputs[2] += (char)rand();
+  }
+  inputs[3] = "x";
+}
+
+int main()
+{
+  make_inputs();
+  CHECK(round_trip("", 1));
+  for (int i = 0; i < 4; i++) {
+    bool ok = true;
+    for (size_t chunk = 1; chunk <= LZ_WINDOW * 2; chunk++) {
+      ok = ok && round_trip(inputs[i], chunk);
+    }
+    CHECK(ok);
+  }
+
+  // The same encoder starts over after final().
+  LzEncoder encoder;
+  uint8_t first[LZ_OUTPUT_MAX(16)], second[LZ_OUTPUT_MAX(16)];
+  size_t n = encoder.update((const uint8_t *)"abababababababab", 16, first);
+  n += encoder.final(first + n);
+  size_t m = encoder.update((const uint8_t *)"abababababababab", 16, second);
+  m += encoder.final(second + m);
+  CHECK(n == m && memcmp(first, second, n) == 0);
+
+  // Repetitive data shrinks, out too small or garbage fails.
+  uint8_t compressed[LZ_OUTPUT_MAX(1000)];
+  LzEncoder runs;
+  n = runs.update((const uint8_t *)inputs[1].data(), 1000, compressed);
+  n += runs.final(compressed + n);
+  CHECK(n < 200);
+  uint8_t out[1000];
+  CHECK(lz_decompress(compressed, n, out, sizeof(out)) == 1000);
+  CHECK(lz_decompress(compressed, n, out, 999) == -1);
+  // A back reference before the start of the output.
+  const uint8_t bad[] = {0x00, 0x00, 0x00};
+  CHECK(lz_decompress(bad, sizeof(bad), out, sizeof(out)) == -1);
+
+  return test_result("lz");
+}
@@ -0,0 +1,70 @@
+// The CBOR written by ciotc_metrics_write(), byte for byte: empty, then
+// with counters, gauges, a histogram over several buckets and errors.
+#include <string>
+#include "CloudIoTCoreMetrics.h"
+#include "test.h"
+
+static std::string hex(const uint8_t *data, size_t length)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  for (size_t i = 0; i < length; i++) {
+    out += digits[data[i] >> 4];
+    out += digits[data[i] & 0xf];
+  }
+  return out;
+}
+
+static std::string written()
+{
+  uint8_t out[256];
+  size_t n = ciotc_metrics_write(out, sizeof(out));
+  return hex(out, n);
+}
+
+int main()
+{
+  ciotc_metrics_reset();
+  CHECK(written() ==
+        "a4"                              // map(4)
+        "6163" "88" "0000000000000000"    // "c": 8 counters
+        "6167" "83" "000000"              // "g": 3 gauges
+        "6168" "85"                       // "h": 5 histograms
+        "83000000" "83000000" "83000000" "83000000" "83000000"
+        "6165" "a0");                     // "e": {}
+
+  ciotc_metric_count(CIOTC_COUNTER_PUBLISHES, 3);
+  ciotc_metric_count(CIOTC_COUNTER_PUBLISH_BYTES, 300);
+  ciotc_metric_gauge(CIOTC_GAUGE_BACKOFF_MS, 2000);
+  ciotc_metric_observe(CIOTC_HISTOGRAM_JWT_SIGN_US, 0);
+  ciotc_metric_observe(CIOTC_HISTOGRAM_JWT_SIGN_US, 5);
+  ciotc_metric_observe(CIOTC_HISTOGRAM_JWT_SIGN_US, 1000);
+  ciotc_metric_observe(CIOTC_HISTOGRAM_PUBLISH_US, 0xffffffff);
+  ciotc_metric_error(-3);
+  ciotc_metric_error(-3);
+  ciotc_metric_error(-1);
+  ciotc_metric_error(-100);
+  CHECK(ciotc_metric_counter(CIOTC_COUNTER_PUBLISHES) == 3);
+  CHECK(ciotc_metric_gauge_value(CIOTC_GAUGE_LAST_ERROR) == -100);
+  CHECK(written() ==
+        "a4"
+        "6163" "88" "00000000" "03" "19012c" "0000"
+        "6167" "83" "3863" "00" "1907d0"
+        "6168" "85"
+        // 0 in bucket 0, 5 in [4, 8), 1000 in [512, 1024).
+        "8e" "03" "1903ed" "1903e8" "01000001000000000000" "01"
+        "83000000" "83000000" "83000000"
+        // Anything past the last bucket goes into it.
+        "981b" "01" "1affffffff" "1affffffff" + std::string(2 * 23, '0') +
+        "01"
+        "6165" "a2" "20" "01" "22" "02");
+
+  // Too small: nothing.
+  uint8_t small[16];
+  CHECK(ciotc_metrics_write(small, sizeof(small)) == 0);
+
+  ciotc_metrics_reset();
+  CHECK(ciotc_metric_counter(CIOTC_COUNTER_PUBLISHES) == 0);
+  CHECK(written().size() == 2 * 44);
+  return test_result("metrics");
+}
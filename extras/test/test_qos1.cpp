@@ -0,0 +1,205 @@
+// QoS 1 publishes written past mqttClient: their packet ids stay clear of
+// the ones it counts up for its own packets, and unacknowledged ones are
+// resent as DUP only into a resumed session.
+#include <vector>
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMqtt.h"
+#include "brokers.h"
+#include "test.h"
+
+struct Packet {
+  uint8_t header;
+  uint16_t id;
+};
+
+static CloudIoTCoreDevice device;
+static std::vector<Packet> completed;
+
+static void publishComplete(uint16_t packet_id, bool delivered)
+{
+  completed.push_back({(uint8_t)delivered, packet_id});
+}
+
+// Splits what was written into packets, with the id of those that have one.
+static std::vector<Packet> packets(const std::string &written)
+{
+  std::vector<Packet> out;
+  const uint8_t *p = (const uint8_t *)written.data();
+  size_t at = 0;
+  while (at < written.size()) {
+    Packet packet = {p[at++], 0};
+    size_t remaining = 0;
+    int shift = 0;
+    uint8_t b;
+    do {
+      b = p[at++];
+      remaining |= (size_t)(b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    size_t body = at;
+    if ((packet.header & 0xf0) == 0x80) {
+      packet.id = p[body] << 8 | p[body + 1];
+    } else if ((packet.header & 0xf0) == 0x30 && (packet.header & 0x06)) {
+      size_t topic = p[body] << 8 | p[body + 1];
+      packet.id = p[body + 2 + topic] << 8 | p[body + 3 + topic];
+    }
+    out.push_back(packet);
+    at = body + remaining;
+  }
+  return out;
+}
+
+static bool connect(CloudIoTCoreMqtt &mqtt)
+{
+  unsigned long start = millis();
+  while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+         millis() - start < 5000) {
+    mqtt.poll();
+  }
+  return mqtt.getState() == CloudIoTCoreMqtt::CONN_CONNECTED;
+}
+
+static void reconnect(StandInNetwork &net, CloudIoTCoreMqtt &mqtt)
+{
+  net.drop();
+  mqtt.poll();
+  net.written.clear();
+  CHECK(connect(mqtt));
+}
+
+static void testIdsClearOfClient()
+{
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.onPublishComplete(publishComplete);
+  completed.clear();
+  // Just short of where ids 0x8000 and up would collide at once.
+  mqttClient.lastPacketId = 0x7ff0;
+  mqtt.startMQTT();
+  CHECK(connect(mqtt));
+
+  std::vector<Packet> sent = packets(net.written);
+  CHECK(sent.size() == 2);
+  CHECK(sent[1].header == 0x82 && sent[1].id == 0x7ff2);
+
+  uint16_t id = 0;
+  CHECK(mqtt.publishTelemetryQos1("{}", 2, &id));
+  CHECK(id == 0xfff2);
+  sent = packets(net.written);
+  CHECK(sent.size() == 3);
+  CHECK(sent[2].header == 0x32 && sent[2].id == id);
+
+  // mqttClient's own QoS 1 publishes go on for a thousand ids without
+  // reaching ours.
+  for (int i = 0; i < 1000; i++) {
+    mqttClient.publish("t", "x", 1, false, 1);
+  }
+  CHECK(mqttClient.lastPacketId == 0x7ff2 + 1000);
+  CHECK(completed.empty());
+
+  // A PUBACK for one of mqttClient's ids is not taken for ours.
+  net.inbound = std::string("\x40\x02", 2) + (char)0x80 + (char)0x00;
+  mqtt.poll();
+  CHECK(completed.empty());
+
+  net.inbound = std::string("\x40\x02", 2) + (char)(id >> 8) + (char)id;
+  mqtt.poll();
+  CHECK(completed.size() == 1);
+  CHECK(completed[0].header == 1 && completed[0].id == id);
+
+  // The next one is again half the range ahead of mqttClient.
+  uint16_t next = 0;
+  CHECK(mqtt.publishTelemetryQos1("{}", 2, &next));
+  CHECK((uint16_t)(next - mqttClient.lastPacketId) >= 0x8000);
+}
+
+static void testReusedId()
+{
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.onPublishComplete(publishComplete);
+  completed.clear();
+  mqtt.startMQTT();
+  CHECK(connect(mqtt));
+
+  uint16_t id = 0;
+  CHECK(mqtt.publishTelemetryQos1("{}", 2, &id));
+  // Should mqttClient get to our id after all, ours is given up.
+  mqttClient.lastPacketId = id - 1;
+  mqttClient.publish("t", "x", 1, false, 1);
+  CHECK(completed.size() == 1);
+  CHECK(completed[0].header == 0 && completed[0].id == id);
+}
+
+// Publishes once, reconnects and returns the header it is resent with.
+static uint8_t resentHeader(bool persistent)
+{
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  mqttClient.keepsSessions = true;
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setPersistentSession(persistent);
+  mqtt.startMQTT();
+  CHECK(connect(mqtt));
+
+  uint16_t id = 0;
+  CHECK(mqtt.publishTelemetryQos1("{}", 2, &id));
+  reconnect(net, mqtt);
+  uint8_t header = 0;
+  std::vector<Packet> sent = packets(net.written);
+  for (size_t i = 0; i < sent.size(); i++) {
+    if ((sent[i].header & 0xf0) == 0x30 && sent[i].id == id) {
+      header = sent[i].header;
+    }
+  }
+  return header;
+}
+
+// Reconnects until the publish is given up and returns how many it took.
+static int reconnectsToGiveUp(bool first_write_fails)
+{
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.onPublishComplete(publishComplete);
+  completed.clear();
+  mqtt.startMQTT();
+  CHECK(connect(mqtt));
+
+  net.failWrites = first_write_fails;
+  CHECK(mqtt.publishTelemetryQos1("{}", 2));
+  net.failWrites = false;
+  int reconnects = 0;
+  while (completed.empty() && reconnects < 10) {
+    reconnect(net, mqtt);
+    reconnects++;
+  }
+  CHECK(completed.size() == 1 && completed[0].header == 0);
+  return reconnects;
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+
+  testIdsClearOfClient();
+  testReusedId();
+
+  CHECK(resentHeader(true) == 0x3a);
+  CHECK(resentHeader(false) == 0x32);
+
+  CHECK(reconnectsToGiveUp(false) == CLOUD_IOT_CORE_QOS1_RETRIES + 1);
+  // A write that did not go out does not count as an attempt.
+  CHECK(reconnectsToGiveUp(true) == CLOUD_IOT_CORE_QOS1_RETRIES + 2);
+
+  return test_result("qos1");
+}
@@ -0,0 +1,142 @@
+// CloudIoTCoreScheduler: token buckets that refill with time, lanes sent
+// urgent first, classes that block only their own messages and a full
+// queue that gives way to higher lanes.
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreScheduler.h"
+#include "test.h"
+
+typedef CloudIoTCoreScheduler Scheduler;
+static const int TELEMETRY = Scheduler::CLASS_TELEMETRY;
+
+static bool push(Scheduler &s, int cls, Scheduler::Lane lane, const char *text)
+{
+  return s.push(cls, lane, "/topic", text, strlen(text));
+}
+
+// The payload peek() returns, popped, or "" if nothing may go.
+static std::string next(Scheduler &s)
+{
+  Scheduler::Message *m = s.peek();
+  if (m == NULL) {
+    return "";
+  }
+  std::string payload(m->payload, m->length);
+  s.pop();
+  return payload;
+}
+
+static void test_refill()
+{
+  Scheduler s;
+  // Telemetry starts with a burst of 10.
+  int taken = 0;
+  while (taken < 20 && s.take(Scheduler::CLASS_TELEMETRY)) {
+    taken++;
+  }
+  CHECK(taken == 10);
+  // 10 per second: one token back after 100 ms, not two.
+  delay(150);
+  CHECK(s.take(Scheduler::CLASS_TELEMETRY));
+  CHECK(!s.take(Scheduler::CLASS_TELEMETRY));
+
+  // State, 1 per second with no burst.
+  CHECK(s.take(Scheduler::CLASS_STATE));
+  CHECK(!s.take(Scheduler::CLASS_STATE));
+
+  // The bucket fills up to its burst and no further.
+  s.setRate(Scheduler::CLASS_STATE, 100, 2);
+  CHECK(s.take(Scheduler::CLASS_STATE) && s.take(Scheduler::CLASS_STATE));
+  CHECK(!s.take(Scheduler::CLASS_STATE));
+  delay(100);
+  CHECK(s.take(Scheduler::CLASS_STATE) && s.take(Scheduler::CLASS_STATE));
+  CHECK(!s.take(Scheduler::CLASS_STATE));
+
+  CHECK(!s.take(-1) && !s.take(Scheduler::CLASS_TELEMETRY + 1));
+}
+
+static void test_lanes()
+{
+  Scheduler s;
+  CHECK(push(s, TELEMETRY, Scheduler::LANE_BULK, "bulk 1"));
+  CHECK(push(s, TELEMETRY, Scheduler::LANE_NORMAL, "normal 1"));
+  CHECK(push(s, TELEMETRY, Scheduler::LANE_BULK, "bulk 2"));
+  CHECK(push(s, TELEMETRY, Scheduler::LANE_URGENT, "urgent"));
+  CHECK(push(s, TELEMETRY, Scheduler::LANE_NORMAL, "normal 2"));
+  CHECK(s.depth() == 5 && s.depth(Scheduler::LANE_BULK) == 2);
+
+  CHECK(next(s) == "urgent");
+  CHECK(next(s) == "normal 1");
+  CHECK(next(s) == "normal 2");
+  CHECK(next(s) == "bulk 1");
+  CHECK(next(s) == "bulk 2");
+  CHECK(next(s) == "" && s.depth() == 0);
+
+  // Each send used a token.
+  int left = 0;
+  while (s.take(Scheduler::CLASS_TELEMETRY)) {
+    left++;
+  }
+  CHECK(left == 5);
+}
+
+static void test_blocked_class()
+{
+  Scheduler s;
+  int alerts = s.addSubfolder("/alerts", 1, 1);
+  CHECK(alerts > Scheduler::CLASS_TELEMETRY);
+  CHECK(s.classFor("/alerts") == alerts);
+  CHECK(s.classFor("/other") == Scheduler::CLASS_TELEMETRY);
+  CHECK(s.classFor(NULL) == Scheduler::CLASS_TELEMETRY);
+
+  // State has no token left: its urgent message waits, bulk telemetry
+  // goes.
+  CHECK(s.take(Scheduler::CLASS_STATE));
+  push(s, Scheduler::CLASS_STATE, Scheduler::LANE_URGENT, "state");
+  push(s, TELEMETRY, Scheduler::LANE_BULK, "telemetry");
+  push(s, alerts, Scheduler::LANE_NORMAL, "alert 1");
+  push(s, alerts, Scheduler::LANE_NORMAL, "alert 2");
+  CHECK(next(s) == "alert 1");
+  CHECK(next(s) == "telemetry");
+  CHECK(next(s) == "");
+  CHECK(s.depth() == 2);
+  delay(1000);
+  CHECK(next(s) == "state");
+  CHECK(next(s) == "alert 2");
+}
+
+static void test_full_queue()
+{
+  Scheduler s;
+  char text[8];
+  for (int i = 0; i < CLOUD_IOT_CORE_SCHED_SLOTS; i++) {
+    snprintf(text, sizeof(text), "bulk %d", i);
+    CHECK(push(s, TELEMETRY, Scheduler::LANE_BULK, text));
+  }
+  // Bulk is dropped for bulk, and gives way to normal oldest first.
+  CHECK(!push(s, TELEMETRY, Scheduler::LANE_BULK, "late"));
+  CHECK(s.dropped(Scheduler::LANE_BULK) == 1);
+  CHECK(push(s, TELEMETRY, Scheduler::LANE_NORMAL, "normal"));
+  CHECK(s.dropped(Scheduler::LANE_BULK) == 2);
+  CHECK(s.depth() == CLOUD_IOT_CORE_SCHED_SLOTS);
+  CHECK(next(s) == "normal");
+  CHECK(next(s) == "bulk 1");
+
+  // Too long for a slot.
+  std::string big(CLOUD_IOT_CORE_SCHED_PAYLOAD + 1, 'x');
+  CHECK(!push(s, TELEMETRY, Scheduler::LANE_URGENT, big.c_str()));
+  CHECK(s.dropped(Scheduler::LANE_URGENT) == 1);
+  CHECK(s.dropped() == 3);
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  test_refill();
+  test_lanes();
+  test_blocked_class();
+  test_full_queue();
+  return test_result("scheduler");
+}
@@ -0,0 +1,65 @@
+// Round trips saved by setPersistentSession(): SUBSCRIBEs sent over a
+// number of reconnects with and without a resumed session.
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMetrics.h"
+#include "CloudIoTCoreMqtt.h"
+#include "brokers.h"
+#include "test.h"
+
+#define RECONNECTS 5
+
+static CloudIoTCoreDevice device;
+
+// Connects RECONNECTS times and returns the SUBSCRIBEs sent.
+static int run(bool persistent, bool broker_keeps_sessions, bool *clean)
+{
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  mqttClient.keepsSessions = broker_keeps_sessions;
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setPersistentSession(persistent);
+  mqtt.startMQTT();
+  *clean = mqttClient.cleanSession;
+
+  for (int i = 0; i < RECONNECTS; i++) {
+    unsigned long start = millis();
+    while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+           millis() - start < 5000) {
+      mqtt.poll();
+    }
+    CHECK(mqtt.getState() == CloudIoTCoreMqtt::CONN_CONNECTED);
+    net.drop();
+    mqtt.poll();
+  }
+  CHECK(mqttClient.connects == RECONNECTS);
+  return mqttClient.subscribes;
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  bool clean;
+
+  int plain = run(false, true, &clean);
+  CHECK(clean);
+  CHECK(plain == 2 * RECONNECTS);
+
+  uint32_t resumed = ciotc_metric_counter(CIOTC_COUNTER_SESSIONS_RESUMED);
+  int persistent = run(true, true, &clean);
+  CHECK(!clean);
+  // Only the first connect subscribes, the broker keeps the rest.
+  CHECK(persistent == 2);
+  CHECK(ciotc_metric_counter(CIOTC_COUNTER_SESSIONS_RESUMED) - resumed ==
+        RECONNECTS - 1);
+
+  // A broker that drops sessions anyway still gets its subscriptions.
+  CHECK(run(true, false, &clean) == 2 * RECONNECTS);
+
+  printf("SUBSCRIBE round trips over %d connects: %d clean, %d persistent\n",
+         RECONNECTS, plain, persistent);
+  return test_result("session");
+}
@@ -0,0 +1,299 @@
+// flags: -DCLOUD_IOT_CORE_SPOOL_SEGMENT=256 -DCLOUD_IOT_CORE_SPOOL_SEGMENTS=4 -DCLOUD_IOT_CORE_SPOOL_SYNC_EVERY=4
+// CloudIoTCoreSpool on its own: wrap-around and dropped segments, restart
+// from the cursor files and damaged records. Then through
+// CloudIoTCoreMqtt: telemetry published while a backlog is replayed
+// queues behind it, and the backlog drains while new telemetry arrives.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMqtt.h"
+#include "brokers.h"
+#include "test.h"
+
+#define DIR "build/test_spool"
+// 64 bytes with the record header, four to a segment.
+#define RECORD_LENGTH 60
+
+static CloudIoTCoreDevice device;
+
+static std::string record(int i)
+{
+  char text[RECORD_LENGTH + 1];
+  snprintf(text, sizeof(text), "%04d", i);
+  return std::string(text) + std::string(RECORD_LENGTH - 4, '.');
+}
+
+static bool push(CloudIoTCoreSpool &spool, int i)
+{
+  std::string r = record(i);
+  return spool.push(r.data(), r.size());
+}
+
+// The oldest record, -1 if there is none.
+static int peek(CloudIoTCoreSpool &spool)
+{
+  char out[CLOUD_IOT_CORE_SPOOL_RECORD_MAX];
+  int n = spool.peek(out, sizeof(out));
+  return n == RECORD_LENGTH ? atoi(std::string(out, 4).c_str()) : -1;
+}
+
+static void fresh()
+{
+  system("rm -rf " DIR);
+}
+
+static void corrupt(const char *file, long offset)
+{
+  FILE *f = fopen((std::string(DIR "/") + file).c_str(), "rb+");
+  CHECK(f != NULL);
+  if (f != NULL) {
+    fseek(f, offset, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, offset, SEEK_SET);
+    fputc(c ^ 0x55, f);
+    fclose(f);
+  }
+}
+
+static void test_wrap_around()
+{
+  fresh();
+  CloudIoTCoreSpool spool(DIR);
+  CHECK(spool.begin());
+  CHECK(spool.depth() == 0 && peek(spool) == -1);
+  bool pushed = true;
+  for (int i = 0; i < 40; i++) {
+    pushed = push(spool, i) && pushed;
+  }
+  CHECK(pushed);
+  // Ten segments were written, the oldest six dropped whole.
+  CHECK(spool.depth() == 16);
+  CHECK(spool.dropped() == 24);
+  CHECK(spool.bytes() == 16 * RECORD_LENGTH);
+  CHECK(fopen(DIR "/00000006.spl", "rb") == NULL);
+
+  bool in_order = true;
+  for (int i = 24; i < 40; i++) {
+    in_order = peek(spool) == i && in_order;
+    spool.commit();
+  }
+  CHECK(in_order);
+  CHECK(spool.depth() == 0 && spool.bytes() == 0 && peek(spool) == -1);
+
+  // Writing goes on past the wrap.
+  CHECK(push(spool, 40));
+  CHECK(peek(spool) == 40);
+}
+
+static void test_restart()
+{
+  fresh();
+  {
+    CloudIoTCoreSpool spool(DIR);
+    CHECK(spool.begin());
+    for (int i = 0; i < 10; i++) {
+      push(spool, i);
+    }
+    // The cursor is written on the fourth commit and when the first
+    // segment is left behind, not for the last two.
+    for (int i = 0; i < 6; i++) {
+      peek(spool);
+      spool.commit();
+    }
+    CHECK(spool.depth() == 4);
+  }
+
+  // After a crash the unsynced commits come again.
+  {
+    CloudIoTCoreSpool spool(DIR);
+    CHECK(spool.begin());
+    CHECK(spool.depth() == 6);
+    CHECK(peek(spool) == 4);
+    spool.commit();
+    spool.sync();
+  }
+  {
+    CloudIoTCoreSpool spool(DIR);
+    CHECK(spool.begin());
+    CHECK(spool.depth() == 5);
+    CHECK(peek(spool) == 5);
+  }
+
+  // A torn cursor write: the other, older cursor file is used.
+  corrupt("cursor1", 8);
+  {
+    CloudIoTCoreSpool spool(DIR);
+    CHECK(spool.begin());
+    CHECK(spool.depth() == 6);
+    CHECK(peek(spool) == 4);
+  }
+
+  // Neither is readable: everything still on flash is replayed.
+  corrupt("cursor0", 8);
+  {
+    CloudIoTCoreSpool spool(DIR);
+    CHECK(spool.begin());
+    CHECK(spool.depth() == 6);
+    CHECK(peek(spool) == 4);
+  }
+}
+
+static void test_damaged_record()
+{
+  fresh();
+  CloudIoTCoreSpool spool(DIR);
+  CHECK(spool.begin());
+  for (int i = 0; i < 8; i++) {
+    push(spool, i);
+  }
+  // Record 1 of the first segment, so 2 and 3 behind it are lost too.
+  corrupt("00000001.spl", 64 + 4 + 10);
+  CHECK(peek(spool) == 0);
+  spool.commit();
+  bool in_order = true;
+  for (int i = 4; i < 8; i++) {
+    in_order = peek(spool) == i && in_order;
+    spool.commit();
+  }
+  CHECK(in_order);
+  CHECK(spool.dropped() == 3);
+  CHECK(spool.depth() == 0 && spool.bytes() == 0 && peek(spool) == -1);
+
+  // Damage in the segment being written: newer records go to a new one.
+  push(spool, 8);
+  push(spool, 9);
+  corrupt("00000003.spl", 4);
+  CHECK(peek(spool) == -1);
+  CHECK(spool.depth() == 0 && spool.dropped() == 5);
+  push(spool, 10);
+  CHECK(spool.depth() == 1);
+  CHECK(peek(spool) == 10);
+  spool.commit();
+  CHECK(spool.depth() == 0);
+
+  // Counted again on restart, up to the damage.
+  fresh();
+  {
+    CloudIoTCoreSpool before(DIR);
+    before.begin();
+    for (int i = 0; i < 8; i++) {
+      push(before, i);
+    }
+  }
+  corrupt("00000002.spl", 128 + 4);
+  CloudIoTCoreSpool after(DIR);
+  CHECK(after.begin());
+  CHECK(after.depth() == 6);
+}
+
+static void publish(CloudIoTCoreMqtt &mqtt, const std::string &payload)
+{
+  CHECK(mqtt.publishTelemetry(payload.data(), payload.size()));
+}
+
+static bool connect(CloudIoTCoreMqtt &mqtt)
+{
+  unsigned long start = millis();
+  while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+         millis() - start < 5000) {
+    mqtt.poll();
+  }
+  return mqtt.getState() == CloudIoTCoreMqtt::CONN_CONNECTED;
+}
+
+// Records sent, in order from first, with nothing missing.
+static bool sent_in_order(const StandInNetwork &net, int first, int count)
+{
+  std::vector<WrittenPacket> packets = net.packets();
+  int sent = 0;
+  for (size_t i = 0; i < packets.size(); i++) {
+    if ((packets[i].header & 0xf0) != 0x30) {
+      continue;
+    }
+    if (packets[i].payload != record(first + sent)) {
+      return false;
+    }
+    sent++;
+  }
+  return sent == count;
+}
+
+static void test_ordering()
+{
+  fresh();
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreSpool spool(DIR);
+  CHECK(spool.begin());
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setSpool(&spool, 0);
+  mqtt.startMQTT();
+
+  // Offline, both are spooled.
+  publish(mqtt, record(1));
+  publish(mqtt, record(2));
+  CHECK(spool.depth() == 2);
+  CHECK(connect(mqtt));
+
+  // Connected with a backlog: 3 waits its turn.
+  publish(mqtt, record(3));
+  CHECK(spool.depth() == 3);
+  for (int i = 0; i < 10 && spool.depth() > 0; i++) {
+    mqtt.poll();
+  }
+  CHECK(spool.depth() == 0);
+
+  // Once the backlog is gone telemetry is sent at once again.
+  publish(mqtt, record(4));
+  CHECK(spool.depth() == 0);
+  CHECK(sent_in_order(net, 1, 4));
+}
+
+static void test_drain()
+{
+  fresh();
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreSpool spool(DIR);
+  CHECK(spool.begin());
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setSpool(&spool, 100);
+  mqtt.startMQTT();
+
+  int next = 0;
+  for (; next < 8; next++) {
+    publish(mqtt, record(next));
+  }
+  CHECK(connect(mqtt));
+
+  // A sample every 20 ms, more than one per replay interval: the backlog
+  // still drains.
+  unsigned long start = millis();
+  while (spool.depth() > 0 && millis() - start < 1000) {
+    publish(mqtt, record(next++));
+    mqtt.poll();
+    delay(20);
+  }
+  CHECK(spool.depth() == 0 && spool.dropped() == 0);
+  publish(mqtt, record(next++));
+  CHECK(sent_in_order(net, 0, next));
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  test_wrap_around();
+  test_restart();
+  test_damaged_record();
+  test_ordering();
+  test_drain();
+  fresh();
+  return test_result("spool");
+}
@@ -0,0 +1,128 @@
+// CloudIoTCoreStateSlot: only the newest of several writes is published,
+// a value equal (by length and FNV hash) to the published one is not
+// published again, and publishes are spaced by the minimum interval.
+#include <string.h>
+#include <string>
+#include <vector>
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMqtt.h"
+#include "brokers.h"
+#include "test.h"
+
+static bool write(CloudIoTCoreStateSlot &slot, const char *text)
+{
+  return slot.write(text, strlen(text));
+}
+
+static std::string pending_value(CloudIoTCoreStateSlot &slot)
+{
+  return std::string(slot.data(), slot.length());
+}
+
+static void test_dedup()
+{
+  CloudIoTCoreStateSlot slot(0);
+  CHECK(!slot.pending() && !slot.due());
+  CHECK(write(slot, "on"));
+  CHECK(slot.pending() && slot.due());
+  slot.sent();
+  CHECK(!slot.pending());
+
+  // Identical: nothing to send.
+  CHECK(write(slot, "on"));
+  CHECK(!slot.pending() && slot.skipped() == 1);
+
+  // Same length, other bytes: sent.
+  CHECK(write(slot, "no"));
+  CHECK(slot.pending() && pending_value(slot) == "no");
+  // Replaced before it went out, the newest one wins.
+  CHECK(write(slot, "off"));
+  CHECK(slot.superseded() == 1 && pending_value(slot) == "off");
+  // Back to the published value before it went out: nothing to send.
+  CHECK(write(slot, "on"));
+  CHECK(!slot.pending());
+  CHECK(slot.superseded() == 2 && slot.skipped() == 2);
+
+  CHECK(write(slot, "off"));
+  slot.sent();
+  CHECK(write(slot, "on"));
+  CHECK(slot.pending() && pending_value(slot) == "on");
+
+  std::string big(CLOUD_IOT_CORE_STATE_MAX + 1, 'x');
+  CHECK(!slot.write(big.data(), big.size()));
+  CHECK(pending_value(slot) == "on");
+}
+
+static void test_interval()
+{
+  CloudIoTCoreStateSlot slot(100);
+  write(slot, "1");
+  CHECK(slot.due());
+  slot.sent();
+  write(slot, "2");
+  CHECK(slot.pending() && !slot.due());
+  delay(100);
+  CHECK(slot.due());
+}
+
+static CloudIoTCoreDevice device;
+
+static std::vector<std::string> states(const StandInNetwork &net)
+{
+  std::vector<std::string> out;
+  std::vector<WrittenPacket> packets = net.packets();
+  for (size_t i = 0; i < packets.size(); i++) {
+    if ((packets[i].header & 0xf0) == 0x30 &&
+        packets[i].topic == device.getStateTopic()) {
+      out.push_back(packets[i].payload);
+    }
+  }
+  return out;
+}
+
+static void test_publish()
+{
+  device.init("project", "location", "registry", "device",
+              "0e:08:8c:0f:aa:15:5b:79:78:03:01:c2:0d:24:be:04:e0:8f:60:46:39:"
+              "ad:cc:50:7d:a5:d6:86:9c:de:fd:4f");
+  StandInNetwork net(0, 0);
+  MQTTClient mqttClient;
+  CloudIoTCoreStateSlot slot(50);
+  CloudIoTCoreMqtt mqtt(&mqttClient, &net, &device);
+  mqtt.setLogConnect(false);
+  mqtt.setStateSlot(&slot);
+  mqtt.startMQTT();
+  unsigned long start = millis();
+  while (mqtt.getState() != CloudIoTCoreMqtt::CONN_CONNECTED &&
+         millis() - start < 5000) {
+    mqtt.poll();
+  }
+  CHECK(mqtt.getState() == CloudIoTCoreMqtt::CONN_CONNECTED);
+
+  mqtt.publishState("{\"on\":1}", 8);
+  mqtt.poll();
+  // Within the interval: only the last one goes, later.
+  mqtt.publishState("{\"on\":0}", 8);
+  mqtt.publishState("{\"on\":2}", 8);
+  mqtt.poll();
+  CHECK(states(net).size() == 1);
+  delay(50);
+  mqtt.poll();
+  // Unchanged, not sent again.
+  mqtt.publishState("{\"on\":2}", 8);
+  delay(50);
+  mqtt.poll();
+
+  std::vector<std::string> sent = states(net);
+  CHECK(sent.size() == 2);
+  CHECK(sent.size() == 2 && sent[0] == "{\"on\":1}" && sent[1] == "{\"on\":2}");
+}
+
+int main()
+{
+  ciotc_log_set_output(NULL);
+  test_dedup();
+  test_interval();
+  test_publish();
+  return test_result("state_slot");
+}
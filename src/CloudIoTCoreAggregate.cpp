@@ -0,0 +1,349 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "CloudIoTCoreAggregate.h"
+
+static const char *skip_space(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+    p++;
+  }
+  return p;
+}
+
+// Returns the position after "key": or NULL.
+static const char *find_key(const char *p, const char *end, const char *key)
+{
+  size_t key_length = strlen(key);
+  for (; p + key_length + 2 <= end; p++) {
+    if (*p != '"' || p[key_length + 1] != '"' ||
+        memcmp(p + 1, key, key_length) != 0) {
+      continue;
+    }
+    const char *colon = skip_space(p + key_length + 2, end);
+    if (colon < end && *colon == ':') {
+      return skip_space(colon + 1, end);
+    }
+  }
+  return NULL;
+}
+
+// Plain decimals only, which is all the config needs.
+static const char *parse_number(const char *p, const char *end, float *value)
+{
+  bool negative = false;
+  bool digits = false;
+  float result = 0;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p++ == '-';
+  }
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    result = result * 10 + (*p - '0');
+    digits = true;
+  }
+  if (p < end && *p == '.') {
+    float scale = 0.1f;
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      result += (*p - '0') * scale;
+      scale /= 10;
+      digits = true;
+    }
+  }
+  if (!digits) {
+    return NULL;
+  }
+  *value = negative ? -result : result;
+  return p;
+}
+
+// Longest text format_float() writes, with the terminator.
+#define FLOAT_TEXT 16
+
+// Writes value the way %g does, six significant digits without trailing
+// zeros, since printf on some boards (newlib-nano on SAMD) has no float
+// support. NaN and infinities, which JSON cannot hold, become null.
+static void format_float(char *out, float value)
+{
+  if (isnan(value) || isinf(value)) {
+    strcpy(out, "null");
+    return;
+  }
+  char *p = out;
+  if (signbit(value)) {
+    *p++ = '-';
+    value = -value;
+  }
+  if (value == 0) {
+    strcpy(p, "0");
+    return;
+  }
+
+  int exponent = 0;
+  for (float v = value; v >= 10; v /= 10) {
+    exponent++;
+  }
+  for (float v = value; v < 1; v *= 10) {
+    exponent--;
+  }
+  // Scaled to six digits in one multiplication or division, in double
+  // where there is one, then rounded half to even like printf.
+  double power = 1;
+  for (int i = exponent > 5 ? exponent - 5 : 5 - exponent; i > 0; i--) {
+    power *= 10;
+  }
+  double scaled = exponent > 5 ? value / power : value * power;
+  uint32_t digits = (uint32_t)scaled;
+  double fraction = scaled - digits;
+  if (fraction > 0.5 || (fraction == 0.5 && (digits & 1))) {
+    digits++;
+  }
+  if (digits < 100000) {
+    // Float rounding in the loops above left the exponent one too high.
+    digits = (uint32_t)(scaled * 10 + 0.5);
+    exponent--;
+  }
+  if (digits >= 1000000) {
+    digits = (digits + 5) / 10;
+    exponent++;
+  }
+  char significant[6];
+  for (int i = 5; i >= 0; i--) {
+    significant[i] = '0' + digits % 10;
+    digits /= 10;
+  }
+  int n = 6;
+  while (n > 1 && significant[n - 1] == '0') {
+    n--;
+  }
+
+  bool scientific = exponent < -4 || exponent >= 6;
+  // Digits before the decimal point.
+  int point = scientific ? 1 : exponent + 1;
+  if (point <= 0) {
+    *p++ = '0';
+    *p++ = '.';
+    for (int i = point; i < 0; i++) {
+      *p++ = '0';
+    }
+    point = 0;
+  }
+  for (int i = 0; i < n || i < point; i++) {
+    if (i == point && i > 0) {
+      *p++ = '.';
+    }
+    *p++ = i < n ? significant[i] : '0';
+  }
+  if (scientific) {
+    int e = exponent < 0 ? -exponent : exponent;
+    *p++ = 'e';
+    *p++ = exponent < 0 ? '-' : '+';
+    *p++ = '0' + e / 10;
+    *p++ = '0' + e % 10;
+  }
+  *p = 0;
+}
+
+CloudIoTCoreAggregate::CloudIoTCoreAggregate(unsigned long window_ms)
+    : nchannels(0), window_ms(window_ms), window_start(0), pending(false) {}
+
+int CloudIoTCoreAggregate::findChannel(const char *name)
+{
+  for (int i = 0; i < nchannels; i++) {
+    if (strcmp(channels[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int CloudIoTCoreAggregate::addChannel(const char *name, float deadband)
+{
+  int channel = findChannel(name);
+  if (channel >= 0) {
+    channels[channel].deadband = deadband;
+    return channel;
+  }
+  if (nchannels == CLOUD_IOT_CORE_CHANNELS ||
+      strlen(name) >= CLOUD_IOT_CORE_CHANNEL_NAME) {
+    return -1;
+  }
+  Channel &c = channels[nchannels];
+  strcpy(c.name, name);
+  c.deadband = deadband;
+  c.count = 0;
+  c.has_reported = false;
+  return nchannels++;
+}
+
+bool CloudIoTCoreAggregate::add(int channel, float value)
+{
+  if (channel < 0 || channel >= nchannels) {
+    return false;
+  }
+  Channel &c = channels[channel];
+  if (c.count == 0) {
+    c.min = c.max = c.sum = value;
+  } else {
+    c.min = value < c.min ? value : c.min;
+    c.max = value > c.max ? value : c.max;
+    c.sum += value;
+  }
+  c.count++;
+  if (!pending) {
+    pending = true;
+    window_start = millis();
+  }
+  return true;
+}
+
+bool CloudIoTCoreAggregate::add(const char *name, float value)
+{
+  return add(findChannel(name), value);
+}
+
+void CloudIoTCoreAggregate::setWindow(unsigned long _window_ms)
+{
+  window_ms = _window_ms;
+}
+
+unsigned long CloudIoTCoreAggregate::getWindow()
+{
+  return window_ms;
+}
+
+bool CloudIoTCoreAggregate::setDeadband(const char *name, float deadband)
+{
+  int channel = findChannel(name);
+  if (channel < 0) {
+    return false;
+  }
+  channels[channel].deadband = deadband;
+  return true;
+}
+
+bool CloudIoTCoreAggregate::configure(const char *config, size_t length)
+{
+  const char *end = config + length;
+  bool applied = false;
+  float value;
+
+  const char *p = find_key(config, end, "window_s");
+  if (p != NULL && parse_number(p, end, &value) != NULL && value >= 0) {
+    window_ms = (unsigned long)(value * 1000);
+    applied = true;
+  }
+
+  p = find_key(config, end, "deadband");
+  if (p == NULL || p == end || *p != '{') {
+    return applied;
+  }
+  for (p = skip_space(p + 1, end); p < end && *p == '"';) {
+    char name[CLOUD_IOT_CORE_CHANNEL_NAME];
+    const char *quote = (const char *)memchr(p + 1, '"', end - p - 1);
+    if (quote == NULL) {
+      break;
+    }
+    size_t name_length = quote - p - 1;
+    p = skip_space(quote + 1, end);
+    if (p == end || *p != ':') {
+      break;
+    }
+    p = parse_number(skip_space(p + 1, end), end, &value);
+    if (p == NULL) {
+      break;
+    }
+    if (name_length < sizeof(name)) {
+      memcpy(name, quote - name_length, name_length);
+      name[name_length] = 0;
+      applied |= setDeadband(name, value);
+    }
+    p = skip_space(p, end);
+    if (p < end && *p == ',') {
+      p = skip_space(p + 1, end);
+    }
+  }
+  return applied;
+}
+
+bool CloudIoTCoreAggregate::due()
+{
+  return pending && millis() - window_start >= window_ms;
+}
+
+void CloudIoTCoreAggregate::clear()
+{
+  for (int i = 0; i < nchannels; i++) {
+    channels[i].count = 0;
+  }
+  pending = false;
+}
+
+int CloudIoTCoreAggregate::write(char *out, size_t size)
+{
+  size_t used = 1;
+  if (size < 2) {
+    return -1;
+  }
+  out[0] = '{';
+  for (int i = 0; i < nchannels; i++) {
+    Channel &c = channels[i];
+    if (c.count == 0) {
+      continue;
+    }
+    float mean = c.sum / c.count;
+    if (c.has_reported && fabsf(mean - c.reported) <= c.deadband) {
+      continue;
+    }
+    char min[FLOAT_TEXT], max[FLOAT_TEXT], average[FLOAT_TEXT];
+    format_float(min, c.min);
+    format_float(max, c.max);
+    format_float(average, mean);
+    int n = snprintf(out + used, size - used,
+                     "%s\"%s\":{\"n\":%lu,\"min\":%s,\"max\":%s,\"mean\":%s}",
+                     used > 1 ? "," : "", c.name, (unsigned long)c.count,
+                     min, max, average);
+    if (n < 0 || (size_t)n >= size - used) {
+      return -1;
+    }
+    used += n;
+  }
+  if (used + 1 >= size) {
+    return -1;
+  }
+
+  // Everything fit, remember what was reported.
+  bool any = used > 1;
+  for (int i = 0; i < nchannels; i++) {
+    Channel &c = channels[i];
+    if (c.count == 0) {
+      continue;
+    }
+    float mean = c.sum / c.count;
+    if (!c.has_reported || fabsf(mean - c.reported) > c.deadband) {
+      c.reported = mean;
+      c.has_reported = true;
+    }
+  }
+  clear();
+  if (!any) {
+    return 0;
+  }
+  out[used++] = '}';
+  out[used] = 0;
+  return used;
+}
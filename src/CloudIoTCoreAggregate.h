@@ -0,0 +1,93 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreAggregate_h
+#define CloudIoTCoreAggregate_h
+
+#include <Arduino.h>
+
+// Channels an aggregate tracks and the longest channel name.
+#ifndef CLOUD_IOT_CORE_CHANNELS
+#define CLOUD_IOT_CORE_CHANNELS 8
+#endif
+#ifndef CLOUD_IOT_CORE_CHANNEL_NAME
+#define CLOUD_IOT_CORE_CHANNEL_NAME 16
+#endif
+// Largest report CloudIoTCoreMqtt publishes.
+#ifndef CLOUD_IOT_CORE_AGGREGATE_PAYLOAD
+#define CLOUD_IOT_CORE_AGGREGATE_PAYLOAD 512
+#endif
+
+// Reduces raw readings to one report per window. Each channel keeps the
+// min, max, mean and count of the samples added during the window; at the
+// end of the window a channel is only reported if its mean moved by more
+// than its deadband since it was last reported, and nothing is published
+// if no channel did. A window of 0 reports every sample that clears its
+// deadband, a plain change filter.
+//
+// Attach it with CloudIoTCoreMqtt::setAggregate() and poll() publishes the
+// reports as
+//
+//   {"temp":{"n":12,"min":20.5,"max":21,"mean":20.75},...}
+//
+// Both window and deadbands can be changed from the device config with
+// configure(), e.g. {"window_s":60,"deadband":{"temp":0.5,"hum":2}}.
+class CloudIoTCoreAggregate {
+  public:
+    CloudIoTCoreAggregate(unsigned long window_ms = 60000);
+
+    // Returns the channel index, or -1 if the table is full or the name
+    // too long. Adding an existing name updates its deadband.
+    int addChannel(const char *name, float deadband = 0);
+    int findChannel(const char *name);
+    // False for an unknown channel.
+    bool add(int channel, float value);
+    bool add(const char *name, float value);
+
+    void setWindow(unsigned long window_ms);
+    unsigned long getWindow();
+    bool setDeadband(const char *name, float deadband);
+
+    // Applies "window_s" and "deadband" from a JSON config payload, other
+    // keys and unknown channels are ignored. True if anything was applied.
+    bool configure(const char *config, size_t length);
+
+    // The window has passed and holds samples.
+    bool due();
+    // Writes the report and starts the next window. Returns its length, 0
+    // if every channel stayed within its deadband, or -1 if out is too
+    // small, in which case the window is left as it was.
+    int write(char *out, size_t size);
+    void clear();
+
+  private:
+    struct Channel {
+      char name[CLOUD_IOT_CORE_CHANNEL_NAME];
+      float deadband;
+      float min;
+      float max;
+      float sum;
+      float reported;
+      uint32_t count;
+      bool has_reported;
+    };
+    Channel channels[CLOUD_IOT_CORE_CHANNELS];
+    uint8_t nchannels;
+    unsigned long window_ms;
+    unsigned long window_start;
+    bool pending;
+};
+
+#endif  // CloudIoTCoreAggregate_h
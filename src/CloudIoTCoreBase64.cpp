@@ -0,0 +1,501 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <cstring>
+
+#include "CloudIoTCoreBase64.h"
+
+#if defined(BASE64_AVX2) || defined(BASE64_SSSE3)
+#include <immintrin.h>
+#endif
+#if BASE64_LUT12 && defined(__AVR__)
+#include <avr/pgmspace.h>
+#define BASE64_FLASH PROGMEM
+#define base64_copy_pair memcpy_P
+#elif BASE64_LUT12 && defined(ESP8266)
+#include <pgmspace.h>
+#define BASE64_FLASH PROGMEM
+#define base64_copy_pair memcpy_P
+#else
+#define BASE64_FLASH
+#define base64_copy_pair memcpy
+#endif
+
+static const char* const base64_alphabets[2] = {
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"};
+
+// Character to 6-bit value, -1 for characters outside the alphabet.
+// Only the first 128 characters are listed, the rest are never valid.
+static const int8_t decode_table[2][128] = {
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+      52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+      -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+      15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+      -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+      41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1},
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1,
+      52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+      -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+      15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+      -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+      41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1}};
+
+static inline int32_t decode_char(const int8_t* table, char c)
+{
+  return (uint8_t)c < 128 ? table[(uint8_t)c] : -1;
+}
+
+#if BASE64_LUT12
+// 12-bit value to the two characters encoding it, generated by the
+// preprocessor: entry (hi << 6 | lo) is {alphabet[hi], alphabet[lo]}.
+#define B64_CHAR(a, i)                                                  \
+  (char)((i) < 26 ? 'A' + (i) : (i) < 52 ? 'a' + (i) - 26               \
+         : (i) < 62 ? '0' + (i) - 52 : (i) == 62 ? ((a) ? '-' : '+')    \
+         : ((a) ? '_' : '/'))
+#define B64_PAIR(a, hi, lo) {B64_CHAR(a, hi), B64_CHAR(a, lo)}
+#define B64_PAIRS4(a, hi, lo)                                           \
+  B64_PAIR(a, hi, lo), B64_PAIR(a, hi, lo + 1), B64_PAIR(a, hi, lo + 2), \
+      B64_PAIR(a, hi, lo + 3)
+#define B64_PAIRS16(a, hi, lo)                                 \
+  B64_PAIRS4(a, hi, lo), B64_PAIRS4(a, hi, lo + 4),            \
+      B64_PAIRS4(a, hi, lo + 8), B64_PAIRS4(a, hi, lo + 12)
+#define B64_ROW(a, hi)                                            \
+  B64_PAIRS16(a, hi, 0), B64_PAIRS16(a, hi, 16),                  \
+      B64_PAIRS16(a, hi, 32), B64_PAIRS16(a, hi, 48)
+#define B64_ROWS4(a, hi)                                                 \
+  B64_ROW(a, hi), B64_ROW(a, hi + 1), B64_ROW(a, hi + 2), B64_ROW(a, hi + 3)
+#define B64_ROWS16(a, hi)                                      \
+  B64_ROWS4(a, hi), B64_ROWS4(a, hi + 4), B64_ROWS4(a, hi + 8), \
+      B64_ROWS4(a, hi + 12)
+#define B64_TABLE(a)                                                    \
+  {B64_ROWS16(a, 0), B64_ROWS16(a, 16), B64_ROWS16(a, 32),              \
+   B64_ROWS16(a, 48)}
+
+static const char encode_table[2][4096][2] BASE64_FLASH = {B64_TABLE(0),
+                                                          B64_TABLE(1)};
+#endif
+
+///////////////////////////////
+// SIMD kernels (host builds)
+///////////////////////////////
+// Encoding follows Mula's pshufb method: spread 3 bytes over a 32-bit lane,
+// isolate the four 6-bit fields with multiplies, then map each index to its
+// character by adding a per-range offset. Only the offsets for index 62 and
+// 63 depend on the alphabet.
+#ifdef BASE64_SSSE3
+static inline __m128i encode_offsets128(int alphabet)
+{
+  const char* chars = base64_alphabets[alphabet];
+  return _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                       '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                       '0' - 52, chars[62] - 62, chars[63] - 63, 'A', 0, 0);
+}
+
+static inline __m128i encode_ssse3(__m128i in, __m128i offsets)
+{
+  in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                          7, 6, 8, 7, 10, 9, 11, 10));
+  const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  const __m128i indices = _mm_or_si128(t1, t3);
+
+  __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+
+// Returns the 6-bit values of 16 characters, or sets *valid to false.
+static inline __m128i decode_values_ssse3(__m128i in, int alphabet,
+                                          bool* valid)
+{
+  const char* chars = base64_alphabets[alphabet];
+  const __m128i upper = _mm_and_si128(
+      _mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+      _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+  const __m128i lower = _mm_and_si128(
+      _mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+      _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+  const __m128i digit = _mm_and_si128(
+      _mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+      _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+  const __m128i c62 = _mm_cmpeq_epi8(in, _mm_set1_epi8(chars[62]));
+  const __m128i c63 = _mm_cmpeq_epi8(in, _mm_set1_epi8(chars[63]));
+
+  __m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+  shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+  shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+  shift = _mm_or_si128(shift, _mm_and_si128(c62, _mm_set1_epi8(62 - chars[62])));
+  shift = _mm_or_si128(shift, _mm_and_si128(c63, _mm_set1_epi8(63 - chars[63])));
+
+  const __m128i ok = _mm_or_si128(_mm_or_si128(upper, lower),
+                                  _mm_or_si128(digit, _mm_or_si128(c62, c63)));
+  *valid = _mm_movemask_epi8(ok) == 0xffff;
+  return _mm_add_epi8(in, shift);
+}
+
+// Packs 16 6-bit values into 12 bytes at the bottom of the register.
+static inline __m128i decode_pack_ssse3(__m128i values)
+{
+  const __m128i ab = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  const __m128i abcd = _mm_madd_epi16(ab, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                              14, 13, 12, -1, -1, -1, -1));
+}
+#endif  // BASE64_SSSE3
+
+#ifdef BASE64_AVX2
+static inline __m256i encode_avx2(__m256i in, __m256i offsets)
+{
+  const __m256i spread = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  in = _mm256_shuffle_epi8(in, spread);
+  const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+  const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+  const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+  const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+  const __m256i indices = _mm256_or_si256(t1, t3);
+
+  __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+  const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+  range = _mm256_or_si256(range,
+                          _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+  return _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indices);
+}
+
+static inline __m256i decode_values_avx2(__m256i in, int alphabet,
+                                         bool* valid)
+{
+  const char* chars = base64_alphabets[alphabet];
+  const __m256i upper = _mm256_and_si256(
+      _mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+  const __m256i lower = _mm256_and_si256(
+      _mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), in));
+  const __m256i digit = _mm256_and_si256(
+      _mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+  const __m256i c62 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(chars[62]));
+  const __m256i c63 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(chars[63]));
+
+  __m256i shift = _mm256_and_si256(upper, _mm256_set1_epi8(-'A'));
+  shift = _mm256_or_si256(shift,
+      _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')));
+  shift = _mm256_or_si256(shift,
+      _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+  shift = _mm256_or_si256(shift,
+      _mm256_and_si256(c62, _mm256_set1_epi8(62 - chars[62])));
+  shift = _mm256_or_si256(shift,
+      _mm256_and_si256(c63, _mm256_set1_epi8(63 - chars[63])));
+
+  const __m256i ok = _mm256_or_si256(
+      _mm256_or_si256(upper, lower),
+      _mm256_or_si256(digit, _mm256_or_si256(c62, c63)));
+  *valid = _mm256_movemask_epi8(ok) == -1;
+  return _mm256_add_epi8(in, shift);
+}
+
+// Packs 32 6-bit values into 24 bytes at the bottom of the register.
+static inline __m256i decode_pack_avx2(__m256i values)
+{
+  const __m256i ab = _mm256_maddubs_epi16(values,
+                                          _mm256_set1_epi32(0x01400140));
+  const __m256i abcd = _mm256_madd_epi16(ab, _mm256_set1_epi32(0x00011000));
+  const __m256i lanes = _mm256_shuffle_epi8(abcd, _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  return _mm256_permutevar8x32_epi32(lanes,
+                                     _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+}
+#endif  // BASE64_AVX2
+
+///////////////////////////////
+// Whole quantum kernels
+///////////////////////////////
+// Encodes len bytes, len must be a multiple of 3.
+static size_t encode_quanta(const unsigned char* in, size_t len, char* out,
+                            int alphabet)
+{
+#if !BASE64_LUT12
+  const char* chars = base64_alphabets[alphabet];
+#endif
+  size_t i = 0;
+  char* o = out;
+
+#ifdef BASE64_AVX2
+  const __m256i offsets256 = _mm256_broadcastsi128_si256(
+      encode_offsets128(alphabet));
+  // Each lane loads 16 bytes and uses 12 of them.
+  for (; len - i >= 28; i += 24, o += 32) {
+    __m256i v = _mm256_castsi128_si256(
+        _mm_loadu_si128((const __m128i*)(in + i)));
+    v = _mm256_inserti128_si256(
+        v, _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+    _mm256_storeu_si256((__m256i*)o, encode_avx2(v, offsets256));
+  }
+#endif
+#ifdef BASE64_SSSE3
+  const __m128i offsets128 = encode_offsets128(alphabet);
+  for (; len - i >= 16; i += 12, o += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm_storeu_si128((__m128i*)o, encode_ssse3(v, offsets128));
+  }
+#endif
+
+  for (; i < len; i += 3, o += 4) {
+    uint32_t v = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) |
+                 in[i + 2];
+#if BASE64_LUT12
+    base64_copy_pair(o, encode_table[alphabet][v >> 12], 2);
+    base64_copy_pair(o + 2, encode_table[alphabet][v & 0xfff], 2);
+#else
+    o[0] = chars[v >> 18];
+    o[1] = chars[(v >> 12) & 0x3f];
+    o[2] = chars[(v >> 6) & 0x3f];
+    o[3] = chars[v & 0x3f];
+#endif
+  }
+  return o - out;
+}
+
+// Encodes the final 1 or 2 bytes.
+static size_t encode_tail(const unsigned char* in, size_t len, char* out,
+                          int alphabet, bool pad)
+{
+  const char* chars = base64_alphabets[alphabet];
+  if (len == 0) {
+    return 0;
+  }
+  uint32_t v = (uint32_t)in[0] << 16;
+  if (len == 2) {
+    v |= (uint32_t)in[1] << 8;
+  }
+  out[0] = chars[v >> 18];
+  out[1] = chars[(v >> 12) & 0x3f];
+  if (len == 2) {
+    out[2] = chars[(v >> 6) & 0x3f];
+  }
+  if (!pad) {
+    return len + 1;
+  }
+  if (len == 1) {
+    out[2] = '=';
+  }
+  out[3] = '=';
+  return 4;
+}
+
+// Decodes len characters, len must be a multiple of 4.
+static int decode_quanta(const char* in, size_t len, unsigned char* out,
+                         int alphabet)
+{
+  size_t i = 0;
+  unsigned char* o = out;
+  bool valid = true;
+
+#ifdef BASE64_AVX2
+  // Stores 32 bytes of which 24 are valid, the rest is overwritten by the
+  // following quanta.
+  for (; valid && len - i >= 48; i += 32, o += 24) {
+    const __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+    const __m256i values = decode_values_avx2(v, alphabet, &valid);
+    if (valid) {
+      _mm256_storeu_si256((__m256i*)o, decode_pack_avx2(values));
+    } else {
+      break;
+    }
+  }
+#endif
+#ifdef BASE64_SSSE3
+  for (; valid && len - i >= 24; i += 16, o += 12) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+    const __m128i values = decode_values_ssse3(v, alphabet, &valid);
+    if (valid) {
+      _mm_storeu_si128((__m128i*)o, decode_pack_ssse3(values));
+    } else {
+      break;
+    }
+  }
+#endif
+  (void)valid;
+
+  const int8_t* table = decode_table[alphabet];
+  for (; i < len; i += 4, o += 3) {
+    int32_t a = decode_char(table, in[i]);
+    int32_t b = decode_char(table, in[i + 1]);
+    int32_t c = decode_char(table, in[i + 2]);
+    int32_t d = decode_char(table, in[i + 3]);
+    if ((a | b | c | d) < 0) {
+      return -1;
+    }
+    uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+    o[0] = v >> 16;
+    o[1] = v >> 8;
+    o[2] = v;
+  }
+  return o - out;
+}
+
+// Decodes the final 2 or 3 characters of unpadded input.
+static int decode_tail(const char* in, size_t len, unsigned char* out,
+                       int alphabet)
+{
+  const int8_t* table = decode_table[alphabet];
+  if (len == 0) {
+    return 0;
+  }
+  if (len == 1) {
+    return -1;
+  }
+  int32_t a = decode_char(table, in[0]);
+  int32_t b = decode_char(table, in[1]);
+  int32_t c = len == 3 ? decode_char(table, in[2]) : 0;
+  if ((a | b | c) < 0) {
+    return -1;
+  }
+  uint32_t v = (a << 18) | (b << 12) | (c << 6);
+  out[0] = v >> 16;
+  if (len == 3) {
+    out[1] = v >> 8;
+  }
+  return len - 1;
+}
+
+///////////////////////////////
+// One shot API
+///////////////////////////////
+size_t base64_encode(const unsigned char* in, size_t len, char* out,
+                     Base64Alphabet alphabet, bool pad)
+{
+  size_t full = len - len % 3;
+  size_t n = encode_quanta(in, full, out, alphabet);
+  return n + encode_tail(in + full, len - full, out + n, alphabet, pad);
+}
+
+int base64_decode(const char* in, size_t len, unsigned char* out,
+                  Base64Alphabet alphabet)
+{
+  for (int i = 0; i < 2 && len > 0 && in[len - 1] == '='; i++) {
+    len--;
+  }
+  size_t full = len - len % 4;
+  int n = decode_quanta(in, full, out, alphabet);
+  if (n < 0) {
+    return -1;
+  }
+  int tail = decode_tail(in + full, len - full, out + n, alphabet);
+  if (tail < 0) {
+    return -1;
+  }
+  return n + tail;
+}
+
+///////////////////////////////
+// Streaming API
+///////////////////////////////
+Base64Encoder::Base64Encoder(Base64Alphabet _alphabet, bool _pad)
+    : alphabet(_alphabet), pad(_pad), npending(0)
+{
+}
+
+size_t Base64Encoder::update(const unsigned char* in, size_t len, char* out)
+{
+  size_t n = 0;
+  while (npending > 0 && npending < 3 && len > 0) {
+    pending[npending++] = *in++;
+    len--;
+  }
+  if (npending == 3) {
+    n += encode_quanta(pending, 3, out, alphabet);
+    npending = 0;
+  }
+  size_t full = len - len % 3;
+  n += encode_quanta(in, full, out + n, alphabet);
+  for (size_t i = full; i < len; i++) {
+    pending[npending++] = in[i];
+  }
+  return n;
+}
+
+size_t Base64Encoder::final(char* out)
+{
+  size_t n = encode_tail(pending, npending, out, alphabet, pad);
+  npending = 0;
+  return n;
+}
+
+Base64Decoder::Base64Decoder(Base64Alphabet _alphabet)
+    : alphabet(_alphabet), npadding(0), failed(false), npending(0)
+{
+}
+
+int Base64Decoder::update(const char* in, size_t len, unsigned char* out)
+{
+  // Padding may only appear at the very end of the stream.
+  size_t end = len;
+  while (end > 0 && in[end - 1] == '=') {
+    end--;
+  }
+  npadding += len - end;
+  if (failed || (npadding > 0 && end > 0 && npadding > (int)(len - end)) ||
+      npadding > 2) {
+    failed = true;
+    return -1;
+  }
+  len = end;
+
+  int n = 0;
+  while (npending > 0 && npending < 4 && len > 0) {
+    pending[npending++] = *in++;
+    len--;
+  }
+  if (npending == 4) {
+    n = decode_quanta(pending, 4, out, alphabet);
+    npending = 0;
+  }
+  size_t full = len - len % 4;
+  int m = n < 0 ? -1 : decode_quanta(in, full, out + n, alphabet);
+  if (m < 0) {
+    failed = true;
+    return -1;
+  }
+  for (size_t i = full; i < len; i++) {
+    pending[npending++] = in[i];
+  }
+  return n + m;
+}
+
+int Base64Decoder::final(unsigned char* out)
+{
+  if (failed) {
+    return -1;
+  }
+  int n = decode_tail(pending, npending, out, alphabet);
+  npending = 0;
+  if (n < 0) {
+    failed = true;
+  }
+  return n;
+}
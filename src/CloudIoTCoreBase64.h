@@ -0,0 +1,95 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreBase64_h
+#define CloudIoTCoreBase64_h
+
+#include <stddef.h>
+
+// Host builds use SSSE3 / AVX2 when the compiler targets them. Define
+// BASE64_NO_SIMD to force the portable path.
+#if !defined(BASE64_NO_SIMD) && defined(__AVX2__)
+#define BASE64_AVX2 1
+#endif
+#if !defined(BASE64_NO_SIMD) && defined(__SSSE3__)
+#define BASE64_SSSE3 1
+#endif
+
+// Encode through a table of the character pairs for every 12-bit value,
+// 8KB of const data per alphabet kept in flash (PROGMEM on AVR and
+// ESP8266). Left out on AVR, where flash is small. Define BASE64_LUT12 to
+// 0 or 1 to override.
+#ifndef BASE64_LUT12
+#if defined(__AVR__)
+#define BASE64_LUT12 0
+#else
+#define BASE64_LUT12 1
+#endif
+#endif
+
+enum Base64Alphabet {
+  BASE64_STANDARD = 0,  // RFC 4648 section 4, "+/"
+  BASE64_URL = 1        // RFC 4648 section 5, "-_", used by JWTs
+};
+
+// Upper bounds for output buffers.
+#define BASE64_ENCODED_LENGTH(n) (((n) + 2) / 3 * 4)
+#define BASE64_DECODED_LENGTH(n) (((n) + 3) / 4 * 3)
+
+// Encodes len bytes into out and returns the number of characters written.
+// out is not NUL terminated.
+size_t base64_encode(const unsigned char* in, size_t len, char* out,
+                     Base64Alphabet alphabet = BASE64_STANDARD,
+                     bool pad = true);
+
+// Decodes len characters into out, trailing '=' padding is optional.
+// Returns the number of bytes written or -1 if the input is malformed.
+int base64_decode(const char* in, size_t len, unsigned char* out,
+                  Base64Alphabet alphabet = BASE64_STANDARD);
+
+// Chunked encoder, input may be split at arbitrary byte boundaries.
+class Base64Encoder {
+  public:
+    Base64Encoder(Base64Alphabet alphabet = BASE64_STANDARD, bool pad = true);
+    // Returns the number of characters written, at most
+    // BASE64_ENCODED_LENGTH(len + 2).
+    size_t update(const unsigned char* in, size_t len, char* out);
+    // Writes the trailing partial quantum (at most 4 characters).
+    size_t final(char* out);
+  private:
+    Base64Alphabet alphabet;
+    bool pad;
+    unsigned char pending[3];
+    int npending;
+};
+
+// Chunked decoder, input may be split at arbitrary character boundaries.
+class Base64Decoder {
+  public:
+    Base64Decoder(Base64Alphabet alphabet = BASE64_STANDARD);
+    // Returns the number of bytes written, at most
+    // BASE64_DECODED_LENGTH(len + 3), or -1 once the input is malformed.
+    int update(const char* in, size_t len, unsigned char* out);
+    // Writes the trailing partial quantum (at most 2 bytes).
+    int final(unsigned char* out);
+  private:
+    Base64Alphabet alphabet;
+    int npadding;
+    bool failed;
+    char pending[4];
+    int npending;
+};
+
+#endif  // CloudIoTCoreBase64_h
@@ -0,0 +1,109 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include "CloudIoTCoreBatch.h"
+
+CloudIoTCoreBatch::CloudIoTCoreBatch(
+    BatchFraming _framing, unsigned long _max_age_ms, size_t _max_size)
+    : framing(_framing), max_age_ms(_max_age_ms), first_ms(0), used(0),
+      samples(0)
+{
+  max_size = _max_size < CLOUD_IOT_CORE_BATCH_SIZE ? _max_size
+                                                   : CLOUD_IOT_CORE_BATCH_SIZE;
+}
+
+// Bytes a sample takes in the buffer, separators and prefixes included.
+size_t CloudIoTCoreBatch::framedLength(size_t length)
+{
+  if (framing == BATCH_JSON_ARRAY) {
+    return length + 1;  // leading '[' or ','
+  }
+  size_t prefix = 1;
+  for (size_t n = length; n >= 0x80; n >>= 7) {
+    prefix++;
+  }
+  return length + prefix;
+}
+
+// A JSON array keeps room for its closing ']'.
+bool CloudIoTCoreBatch::fits(size_t length)
+{
+  size_t closing = framing == BATCH_JSON_ARRAY ? 1 : 0;
+  return used + framedLength(length) + closing <= max_size;
+}
+
+bool CloudIoTCoreBatch::add(const char *data, size_t length)
+{
+  if (!fits(length)) {
+    return false;
+  }
+  if (samples == 0) {
+    first_ms = millis();
+  }
+
+  if (framing == BATCH_JSON_ARRAY) {
+    buffer[used++] = samples == 0 ? '[' : ',';
+  } else {
+    size_t n = length;
+    while (n >= 0x80) {
+      buffer[used++] = (char)(0x80 | (n & 0x7f));
+      n >>= 7;
+    }
+    buffer[used++] = (char)n;
+  }
+  memcpy(buffer + used, data, length);
+  used += length;
+  samples++;
+  return true;
+}
+
+bool CloudIoTCoreBatch::due()
+{
+  if (samples == 0) {
+    return false;
+  }
+  // Full when not even a one byte sample would fit.
+  return !fits(1) || millis() - first_ms >= max_age_ms;
+}
+
+const char *CloudIoTCoreBatch::data()
+{
+  if (framing == BATCH_JSON_ARRAY) {
+    if (samples == 0) {
+      buffer[0] = '[';
+    }
+    buffer[length() - 1] = ']';
+  }
+  return buffer;
+}
+
+size_t CloudIoTCoreBatch::length()
+{
+  if (framing == BATCH_JSON_ARRAY) {
+    return samples == 0 ? 2 : used + 1;
+  }
+  return used;
+}
+
+uint16_t CloudIoTCoreBatch::count()
+{
+  return samples;
+}
+
+void CloudIoTCoreBatch::clear()
+{
+  used = 0;
+  samples = 0;
+}
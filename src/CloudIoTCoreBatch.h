@@ -0,0 +1,70 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreBatch_h
+#define CloudIoTCoreBatch_h
+
+#include <Arduino.h>
+
+// Largest batched payload, bytes, closing ']' included. Batches that cannot
+// be sent are spooled, so it may not exceed CLOUD_IOT_CORE_SPOOL_RECORD_MAX.
+#ifndef CLOUD_IOT_CORE_BATCH_SIZE
+#define CLOUD_IOT_CORE_BATCH_SIZE 512
+#endif
+
+enum BatchFraming {
+  // Each sample preceded by its length as a base 128 varint, the same
+  // framing as protobuf's writeDelimitedTo().
+  BATCH_LENGTH_PREFIXED,
+  // [sample,sample,...], samples must be JSON values.
+  BATCH_JSON_ARRAY
+};
+
+// Packs telemetry samples into a single payload. Attach it with
+// CloudIoTCoreMqtt::setBatch() and publishTelemetry(data, length) adds to
+// the batch instead of publishing; the batch goes out as one PUBLISH once
+// it is full, older than max_age_ms, or on flushTelemetry().
+class CloudIoTCoreBatch {
+  public:
+    CloudIoTCoreBatch(BatchFraming framing = BATCH_JSON_ARRAY,
+                      unsigned long max_age_ms = 10000,
+                      size_t max_size = CLOUD_IOT_CORE_BATCH_SIZE);
+
+    // True if a sample of this length fits without flushing first.
+    bool fits(size_t length);
+    // False if it does not fit, the batch is left unchanged.
+    bool add(const char *data, size_t length);
+    // Non empty and either full or older than max_age_ms.
+    bool due();
+
+    // The framed payload, valid until the next add() or clear().
+    const char *data();
+    size_t length();
+    uint16_t count();
+    void clear();
+
+  private:
+    BatchFraming framing;
+    unsigned long max_age_ms;
+    size_t max_size;
+    unsigned long first_ms;
+    size_t used;
+    uint16_t samples;
+    char buffer[CLOUD_IOT_CORE_BATCH_SIZE];
+
+    size_t framedLength(size_t length);
+};
+
+#endif  // CloudIoTCoreBatch_h
@@ -0,0 +1,235 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <string.h>
+#include "CloudIoTCoreCbor.h"
+
+// Major types
+#define CBOR_MAJOR_UINT 0
+#define CBOR_MAJOR_NEGINT 1
+#define CBOR_MAJOR_BYTES 2
+#define CBOR_MAJOR_TEXT 3
+#define CBOR_MAJOR_ARRAY 4
+#define CBOR_MAJOR_MAP 5
+#define CBOR_MAJOR_SIMPLE 7
+
+#define CBOR_FALSE 0xf4
+#define CBOR_TRUE 0xf5
+#define CBOR_NULL 0xf6
+#define CBOR_HALF 0xf9
+#define CBOR_SINGLE 0xfa
+#define CBOR_DOUBLE_PRECISION 0xfb
+#define CBOR_BREAK 0xff
+
+CborWriter::CborWriter(uint8_t *_buffer, size_t _size)
+    : buffer(_buffer), size(_size), used(0), overflow(false) {}
+
+void CborWriter::reset()
+{
+  used = 0;
+  overflow = false;
+}
+
+void CborWriter::putByte(uint8_t b)
+{
+  if (used < size) {
+    buffer[used++] = b;
+  } else {
+    overflow = true;
+  }
+}
+
+void CborWriter::put(const uint8_t *data, size_t length)
+{
+  if (overflow || length > size - used) {
+    overflow = true;
+    return;
+  }
+  memcpy(buffer + used, data, length);
+  used += length;
+}
+
+// Initial byte plus the shortest big endian argument.
+void CborWriter::head(uint8_t major, uint64_t value)
+{
+  uint8_t bytes[9];
+  int n;
+  if (value < 24) {
+    bytes[0] = (major << 5) | value;
+    n = 0;
+  } else if (value <= 0xff) {
+    bytes[0] = (major << 5) | 24;
+    n = 1;
+  } else if (value <= 0xffff) {
+    bytes[0] = (major << 5) | 25;
+    n = 2;
+  } else if (value <= 0xffffffffUL) {
+    bytes[0] = (major << 5) | 26;
+    n = 4;
+  } else {
+    bytes[0] = (major << 5) | 27;
+    n = 8;
+  }
+  for (int i = n; i > 0; i--) {
+    bytes[i] = (uint8_t)value;
+    value >>= 8;
+  }
+  put(bytes, n + 1);
+}
+
+CborWriter &CborWriter::beginArray(size_t items)
+{
+  head(CBOR_MAJOR_ARRAY, items);
+  return *this;
+}
+
+CborWriter &CborWriter::beginMap(size_t pairs)
+{
+  head(CBOR_MAJOR_MAP, pairs);
+  return *this;
+}
+
+CborWriter &CborWriter::beginArray()
+{
+  putByte((CBOR_MAJOR_ARRAY << 5) | 31);
+  return *this;
+}
+
+CborWriter &CborWriter::beginMap()
+{
+  putByte((CBOR_MAJOR_MAP << 5) | 31);
+  return *this;
+}
+
+CborWriter &CborWriter::end()
+{
+  putByte(CBOR_BREAK);
+  return *this;
+}
+
+CborWriter &CborWriter::addUint(uint64_t value)
+{
+  head(CBOR_MAJOR_UINT, value);
+  return *this;
+}
+
+CborWriter &CborWriter::addInt(int64_t value)
+{
+  if (value < 0) {
+    // -1 - n without overflowing on INT64_MIN.
+    head(CBOR_MAJOR_NEGINT, ~(uint64_t)value);
+  } else {
+    head(CBOR_MAJOR_UINT, value);
+  }
+  return *this;
+}
+
+CborWriter &CborWriter::addBool(bool value)
+{
+  putByte(value ? CBOR_TRUE : CBOR_FALSE);
+  return *this;
+}
+
+CborWriter &CborWriter::addNull()
+{
+  putByte(CBOR_NULL);
+  return *this;
+}
+
+// Half precision bits for value, or -1 if it would lose precision.
+static int32_t to_half(float value)
+{
+  uint32_t f;
+  memcpy(&f, &value, 4);
+  uint32_t sign = (f >> 16) & 0x8000;
+  int32_t exp = (int32_t)((f >> 23) & 0xff) - 127;
+  uint32_t mant = f & 0x7fffff;
+
+  if (exp == 128) {
+    // Inf and NaN, NaN payloads are not kept.
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  }
+  if (exp == -127 && mant == 0) {
+    return sign;
+  }
+  if (exp >= -14 && exp <= 15) {
+    if (mant & 0x1fff) {
+      return -1;
+    }
+    return sign | ((exp + 15) << 10) | (mant >> 13);
+  }
+  if (exp >= -24 && exp < -14) {
+    uint32_t full = 0x800000 | mant;
+    int shift = -exp - 1;
+    if (full & ((1UL << shift) - 1)) {
+      return -1;
+    }
+    return sign | (full >> shift);
+  }
+  return -1;
+}
+
+CborWriter &CborWriter::addFloat(float value)
+{
+  int32_t half = to_half(value);
+  if (half >= 0) {
+    uint8_t bytes[3] = {CBOR_HALF, (uint8_t)(half >> 8), (uint8_t)half};
+    put(bytes, 3);
+    return *this;
+  }
+  uint32_t f;
+  memcpy(&f, &value, 4);
+  uint8_t bytes[5] = {CBOR_SINGLE, (uint8_t)(f >> 24), (uint8_t)(f >> 16),
+                      (uint8_t)(f >> 8), (uint8_t)f};
+  put(bytes, 5);
+  return *this;
+}
+
+CborWriter &CborWriter::addDouble(double value)
+{
+  // Also covers boards where double is single precision.
+  if (sizeof(double) != 8 || (double)(float)value == value || value != value) {
+    return addFloat((float)value);
+  }
+  uint8_t bytes[9];
+  uint64_t d;
+  memcpy(&d, &value, 8);
+  bytes[0] = CBOR_DOUBLE_PRECISION;
+  for (int i = 8; i > 0; i--) {
+    bytes[i] = (uint8_t)d;
+    d >>= 8;
+  }
+  put(bytes, 9);
+  return *this;
+}
+
+CborWriter &CborWriter::addText(const char *text)
+{
+  return addText(text, strlen(text));
+}
+
+CborWriter &CborWriter::addText(const char *text, size_t length)
+{
+  head(CBOR_MAJOR_TEXT, length);
+  put((const uint8_t *)text, length);
+  return *this;
+}
+
+CborWriter &CborWriter::addBytes(const uint8_t *data, size_t length)
+{
+  head(CBOR_MAJOR_BYTES, length);
+  put(data, length);
+  return *this;
+}
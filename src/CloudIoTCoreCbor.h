@@ -0,0 +1,136 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreCbor_h
+#define CloudIoTCoreCbor_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CBOR (RFC 7049) writer into a caller supplied buffer, no allocation.
+// Integers and lengths use the shortest encoding and floats are written as
+// half or single precision whenever that loses nothing.
+//
+//   uint8_t buffer[64];
+//   CborWriter cbor(buffer, sizeof(buffer));
+//   cbor.beginMap(2).key("rssi").addInt(rssi).key("t").addFloat(t);
+//   if (cbor.ok()) mqtt->publishTelemetry(cbor);
+//
+// Running out of space is sticky: later appends are ignored and ok()
+// returns false.
+class CborWriter {
+  public:
+    CborWriter(uint8_t *buffer, size_t size);
+    void reset();
+
+    // Containers with a known number of items (key/value pairs for maps).
+    CborWriter &beginArray(size_t items);
+    CborWriter &beginMap(size_t pairs);
+    // Indefinite length containers, closed by end().
+    CborWriter &beginArray();
+    CborWriter &beginMap();
+    CborWriter &end();
+
+    CborWriter &addUint(uint64_t value);
+    CborWriter &addInt(int64_t value);
+    CborWriter &addBool(bool value);
+    CborWriter &addNull();
+    CborWriter &addFloat(float value);
+    CborWriter &addDouble(double value);
+    CborWriter &addText(const char *text);
+    CborWriter &addText(const char *text, size_t length);
+    CborWriter &addBytes(const uint8_t *data, size_t length);
+    CborWriter &key(const char *name) { return addText(name); }
+
+    bool ok() const { return !overflow; }
+    const uint8_t *data() const { return buffer; }
+    size_t length() const { return used; }
+
+  private:
+    uint8_t *buffer;
+    size_t size;
+    size_t used;
+    bool overflow;
+
+    void head(uint8_t major, uint64_t value);
+    void put(const uint8_t *data, size_t length);
+    void putByte(uint8_t b);
+};
+
+// Compile-time schema: a record is written as a CBOR array of values in a
+// fixed order and with fixed types, so no keys are sent and the decoder
+// knows the layout from the schema:
+//
+//   typedef CborSchema<CBOR_UINT, CBOR_INT, CBOR_FLOAT> Sample;
+//   Sample::write(cbor, millis(), rssi, temperature);
+//
+// Passing the wrong number of values does not compile.
+enum CborType {
+  CBOR_UINT,
+  CBOR_INT,
+  CBOR_BOOL,
+  CBOR_FLOAT,
+  CBOR_DOUBLE,
+  CBOR_TEXT
+};
+
+template <CborType T> struct CborField;
+template <> struct CborField<CBOR_UINT> {
+  static void write(CborWriter &w, uint64_t v) { w.addUint(v); }
+};
+template <> struct CborField<CBOR_INT> {
+  static void write(CborWriter &w, int64_t v) { w.addInt(v); }
+};
+template <> struct CborField<CBOR_BOOL> {
+  static void write(CborWriter &w, bool v) { w.addBool(v); }
+};
+template <> struct CborField<CBOR_FLOAT> {
+  static void write(CborWriter &w, float v) { w.addFloat(v); }
+};
+template <> struct CborField<CBOR_DOUBLE> {
+  static void write(CborWriter &w, double v) { w.addDouble(v); }
+};
+template <> struct CborField<CBOR_TEXT> {
+  static void write(CborWriter &w, const char *v) { w.addText(v); }
+};
+
+template <CborType... Types> struct CborFields;
+template <> struct CborFields<> {
+  static void write(CborWriter &) {}
+};
+template <CborType T, CborType... Rest> struct CborFields<T, Rest...> {
+  template <typename V, typename... Vs>
+  static void write(CborWriter &w, V value, Vs... rest)
+  {
+    CborField<T>::write(w, value);
+    CborFields<Rest...>::write(w, rest...);
+  }
+};
+
+template <CborType... Types> struct CborSchema {
+  static const size_t fields = sizeof...(Types);
+
+  template <typename... Values>
+  static bool write(CborWriter &w, Values... values)
+  {
+    static_assert(sizeof...(Values) == sizeof...(Types),
+                  "value count does not match the schema");
+    w.beginArray(fields);
+    CborFields<Types...>::write(w, values...);
+    return w.ok();
+  }
+};
+
+#endif  // CloudIoTCoreCbor_h
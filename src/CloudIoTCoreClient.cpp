@@ -0,0 +1,327 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include "CloudIoTCoreClient.h"
+
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_SUBSCRIBE 8
+#define MQTT_UNSUBSCRIBE 10
+
+// Where the packet id of an outbound packet is: not there, or after the
+// topic of a PUBLISH whose length is not known yet.
+#define ID_NONE 0xffffffff
+#define ID_AFTER_TOPIC 0xfffffffe
+
+CloudIoTCoreClient::CloudIoTCoreClient(Client *_client)
+    : client(_client), coalescer(NULL), pubackCallback(NULL),
+      pubackContext(NULL), packetIdCallback(NULL), packetIdContext(NULL),
+      ownWrites(false)
+{
+  reset();
+}
+
+void CloudIoTCoreClient::onPuback(PubackCallback callback, void *context)
+{
+  pubackCallback = callback;
+  pubackContext = context;
+}
+
+void CloudIoTCoreClient::onPacketId(PacketIdCallback callback, void *context)
+{
+  packetIdCallback = callback;
+  packetIdContext = context;
+}
+
+void CloudIoTCoreClient::setOwnWrites(bool own)
+{
+  ownWrites = own;
+}
+
+void CloudIoTCoreClient::reset()
+{
+  scanState = SCAN_HEADER;
+  outState = SCAN_HEADER;
+  if (coalescer != NULL) {
+    coalescer->clear();
+  }
+}
+
+void CloudIoTCoreClient::setCoalescer(CloudIoTCoreCoalescer *_coalescer)
+{
+  if (coalescer != NULL) {
+    flushWrites();
+  }
+  coalescer = _coalescer;
+}
+
+// A failed write closes the connection so the MQTT client notices.
+bool CloudIoTCoreClient::flushWrites()
+{
+  if (coalescer == NULL || coalescer->flush(*client)) {
+    return true;
+  }
+  client->stop();
+  return false;
+}
+
+bool CloudIoTCoreClient::flushIfDue()
+{
+  return coalescer == NULL || !coalescer->due() || flushWrites();
+}
+
+// Whoever reads may be waiting for the answer to a buffered packet.
+void CloudIoTCoreClient::beforeRead()
+{
+  if (coalescer != NULL && coalescer->awaitingReply()) {
+    flushWrites();
+  }
+}
+
+void CloudIoTCoreClient::packetDone()
+{
+  if (packetType == MQTT_PUBACK && bodyRead >= 2 && pubackCallback != NULL) {
+    pubackCallback(pubackContext, packetId);
+  }
+  scanState = SCAN_HEADER;
+}
+
+void CloudIoTCoreClient::scan(const uint8_t *buf, size_t size)
+{
+  for (size_t i = 0; i < size; i++) {
+    uint8_t b = buf[i];
+    switch (scanState) {
+      case SCAN_HEADER:
+        packetType = b >> 4;
+        remaining = 0;
+        lengthShift = 0;
+        scanState = SCAN_LENGTH;
+        break;
+
+      case SCAN_LENGTH:
+        remaining |= (uint32_t)(b & 0x7f) << lengthShift;
+        lengthShift += 7;
+        if (!(b & 0x80)) {
+          bodyRead = 0;
+          packetId = 0;
+          if (remaining == 0) {
+            packetDone();
+          } else {
+            scanState = SCAN_BODY;
+          }
+        }
+        break;
+
+      case SCAN_BODY:
+        if (bodyRead < 2) {
+          packetId = (packetId << 8) | b;
+        }
+        bodyRead++;
+        // Skip the rest of long bodies in one go.
+        if (bodyRead >= 2 && remaining - bodyRead > 0) {
+          size_t skip = size - i - 1;
+          if (skip > remaining - bodyRead) {
+            skip = remaining - bodyRead;
+          }
+          bodyRead += skip;
+          i += skip;
+        }
+        if (bodyRead == remaining) {
+          packetDone();
+        }
+        break;
+    }
+  }
+}
+
+void CloudIoTCoreClient::scanOut(const uint8_t *buf, size_t size)
+{
+  for (size_t i = 0; i < size; i++) {
+    uint8_t b = buf[i];
+    switch (outState) {
+      case SCAN_HEADER:
+        outHeader = b;
+        outRemaining = 0;
+        outShift = 0;
+        outState = SCAN_LENGTH;
+        break;
+
+      case SCAN_LENGTH: {
+        outRemaining |= (uint32_t)(b & 0x7f) << outShift;
+        outShift += 7;
+        if (b & 0x80) {
+          break;
+        }
+        uint8_t type = outHeader >> 4;
+        outRead = 0;
+        outValue = 0;
+        if (type == MQTT_SUBSCRIBE || type == MQTT_UNSUBSCRIBE) {
+          outIdAt = 0;
+        } else if (type == MQTT_PUBLISH && (outHeader & 0x06)) {
+          outIdAt = ID_AFTER_TOPIC;
+        } else {
+          outIdAt = ID_NONE;
+        }
+        outState = outRemaining ? SCAN_BODY : SCAN_HEADER;
+        break;
+      }
+
+      case SCAN_BODY: {
+        uint32_t at = outRead++;
+        if (outIdAt == ID_AFTER_TOPIC) {
+          // The topic length comes first.
+          outValue = (outValue << 8) | b;
+          if (at == 1) {
+            outIdAt = 2 + outValue;
+          }
+        } else if (outIdAt != ID_NONE && at == outIdAt) {
+          outValue = b;
+        } else if (outIdAt != ID_NONE && at == outIdAt + 1) {
+          outValue = (outValue << 8) | b;
+          outIdAt = ID_NONE;
+          if (packetIdCallback != NULL) {
+            packetIdCallback(packetIdContext, outValue);
+          }
+        }
+        // Skip whatever is left once there is nothing to look for.
+        if (outIdAt == ID_NONE) {
+          size_t skip = size - i - 1;
+          if (skip > outRemaining - outRead) {
+            skip = outRemaining - outRead;
+          }
+          outRead += skip;
+          i += skip;
+        } else if (outIdAt != ID_AFTER_TOPIC && outIdAt > outRead) {
+          size_t skip = size - i - 1;
+          if (skip > outIdAt - outRead) {
+            skip = outIdAt - outRead;
+          }
+          outRead += skip;
+          i += skip;
+        }
+        if (outRead >= outRemaining) {
+          outState = SCAN_HEADER;
+        }
+        break;
+      }
+    }
+  }
+}
+
+int CloudIoTCoreClient::connect(IPAddress ip, uint16_t port)
+{
+  reset();
+  return client->connect(ip, port);
+}
+
+int CloudIoTCoreClient::connect(const char *host, uint16_t port)
+{
+  reset();
+  return client->connect(host, port);
+}
+
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 3
+int CloudIoTCoreClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+  reset();
+  return client->connect(ip, port, timeout);
+}
+
+int CloudIoTCoreClient::connect(const char *host, uint16_t port,
+                                int32_t timeout)
+{
+  reset();
+  return client->connect(host, port, timeout);
+}
+#endif
+
+size_t CloudIoTCoreClient::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+size_t CloudIoTCoreClient::write(const uint8_t *buf, size_t size)
+{
+  if (!ownWrites) {
+    scanOut(buf, size);
+  }
+  if (coalescer != NULL) {
+    size_t n = coalescer->write(*client, buf, size);
+    if (n != size) {
+      client->stop();
+    }
+    return n;
+  }
+  return client->write(buf, size);
+}
+
+int CloudIoTCoreClient::available()
+{
+  beforeRead();
+  return client->available();
+}
+
+int CloudIoTCoreClient::read()
+{
+  beforeRead();
+  int b = client->read();
+  if (b >= 0) {
+    uint8_t c = b;
+    scan(&c, 1);
+  }
+  return b;
+}
+
+int CloudIoTCoreClient::read(uint8_t *buf, size_t size)
+{
+  beforeRead();
+  int n = client->read(buf, size);
+  if (n > 0) {
+    scan(buf, n);
+  }
+  return n;
+}
+
+int CloudIoTCoreClient::peek()
+{
+  beforeRead();
+  return client->peek();
+}
+
+void CloudIoTCoreClient::flush()
+{
+  flushWrites();
+  client->flush();
+}
+
+// Buffered packets (e.g. a DISCONNECT) still go out before closing.
+void CloudIoTCoreClient::stop()
+{
+  if (coalescer != NULL) {
+    coalescer->flush(*client);
+    coalescer->clear();
+  }
+  client->stop();
+}
+
+uint8_t CloudIoTCoreClient::connected()
+{
+  return client->connected();
+}
+
+CloudIoTCoreClient::operator bool()
+{
+  return (bool)*client;
+}
@@ -0,0 +1,102 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreClient_h
+#define CloudIoTCoreClient_h
+
+#include <Arduino.h>
+#include <Client.h>
+#include "CloudIoTCoreCoalescer.h"
+
+// Client that sits between MQTTClient and the network client and passes
+// everything through. It follows the framing of the inbound MQTT stream
+// to report PUBACKs, which lwmqtt reads and discards, so CloudIoTCoreMqtt
+// can track its own QoS 1 publishes. It also follows the outbound stream
+// to report the packet ids the MQTT client uses, so CloudIoTCoreMqtt can
+// keep its ids away from them. With a coalescer attached, writes are
+// buffered in it.
+class CloudIoTCoreClient : public Client {
+  public:
+    typedef void (*PubackCallback)(void *context, uint16_t packet_id);
+    typedef void (*PacketIdCallback)(void *context, uint16_t packet_id);
+
+    CloudIoTCoreClient(Client *client);
+    void onPuback(PubackCallback callback, void *context);
+    // Called with the id of each SUBSCRIBE, UNSUBSCRIBE and QoS 1 or 2
+    // PUBLISH written, except between setOwnWrites(true) and
+    // setOwnWrites(false), which must bracket whole packets.
+    void onPacketId(PacketIdCallback callback, void *context);
+    void setOwnWrites(bool own);
+    // Forget any partly seen packet, e.g. on a new connection.
+    void reset();
+    void setCoalescer(CloudIoTCoreCoalescer *coalescer);
+    // Writes out what the coalescer holds, if there is one.
+    bool flushWrites();
+    // Same, but only once its max latency has passed.
+    bool flushIfDue();
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 3
+    int connect(IPAddress ip, uint16_t port, int32_t timeout);
+    int connect(const char *host, uint16_t port, int32_t timeout);
+#endif
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buf, size_t size);
+    int available();
+    int read();
+    int read(uint8_t *buf, size_t size);
+    int peek();
+    void flush();
+    void stop();
+    uint8_t connected();
+    operator bool();
+    using Print::write;
+
+  private:
+    enum ScanState {
+      SCAN_HEADER,
+      SCAN_LENGTH,
+      SCAN_BODY
+    };
+    Client *client;
+    CloudIoTCoreCoalescer *coalescer;
+    PubackCallback pubackCallback;
+    void *pubackContext;
+    PacketIdCallback packetIdCallback;
+    void *packetIdContext;
+    ScanState scanState;
+    uint8_t packetType;
+    uint8_t lengthShift;
+    uint32_t remaining;
+    uint16_t packetId;
+    uint32_t bodyRead;
+    // Outbound stream.
+    bool ownWrites;
+    ScanState outState;
+    uint8_t outHeader;
+    uint8_t outShift;
+    uint32_t outRemaining;
+    uint32_t outRead;
+    uint32_t outIdAt;
+    uint16_t outValue;
+
+    void scan(const uint8_t *buf, size_t size);
+    void scanOut(const uint8_t *buf, size_t size);
+    void packetDone();
+    void beforeRead();
+};
+
+#endif  // CloudIoTCoreClient_h
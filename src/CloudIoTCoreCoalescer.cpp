@@ -0,0 +1,138 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include "CloudIoTCoreCoalescer.h"
+
+#define MQTT_CONNECT 1
+#define MQTT_PUBLISH 3
+#define MQTT_SUBSCRIBE 8
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_PINGREQ 12
+
+CloudIoTCoreCoalescer::CloudIoTCoreCoalescer(unsigned long max_latency_ms)
+    : maxLatencyMs(max_latency_ms), flushCount(0), packetCount(0)
+{
+  clear();
+}
+
+void CloudIoTCoreCoalescer::clear()
+{
+  used = 0;
+  reply = false;
+  scanState = SCAN_HEADER;
+}
+
+// Follows the framing of what is written to see which packets start in it.
+void CloudIoTCoreCoalescer::scan(const uint8_t *buf, size_t size)
+{
+  for (size_t i = 0; i < size; i++) {
+    uint8_t b = buf[i];
+    switch (scanState) {
+      case SCAN_HEADER: {
+        uint8_t type = b >> 4;
+        if (type == MQTT_CONNECT || type == MQTT_SUBSCRIBE ||
+            type == MQTT_UNSUBSCRIBE || type == MQTT_PINGREQ ||
+            (type == MQTT_PUBLISH && (b & 0x06))) {
+          reply = true;
+        }
+        packetCount++;
+        remaining = 0;
+        lengthShift = 0;
+        scanState = SCAN_LENGTH;
+        break;
+      }
+
+      case SCAN_LENGTH:
+        remaining |= (uint32_t)(b & 0x7f) << lengthShift;
+        lengthShift += 7;
+        if (!(b & 0x80)) {
+          scanState = remaining ? SCAN_BODY : SCAN_HEADER;
+        }
+        break;
+
+      case SCAN_BODY: {
+        size_t skip = size - i;
+        if (skip > remaining) {
+          skip = remaining;
+        }
+        remaining -= skip;
+        i += skip - 1;
+        if (remaining == 0) {
+          scanState = SCAN_HEADER;
+        }
+        break;
+      }
+    }
+  }
+}
+
+size_t CloudIoTCoreCoalescer::write(Client &client, const uint8_t *buf,
+                                    size_t size)
+{
+  if (used + size > sizeof(buffer) && !flush(client)) {
+    return 0;
+  }
+  scan(buf, size);
+  if (size > sizeof(buffer)) {
+    flushCount++;
+    return client.write(buf, size) == size ? size : 0;
+  }
+  if (used == 0) {
+    firstBuffered = millis();
+  }
+  memcpy(buffer + used, buf, size);
+  used += size;
+  if (used == sizeof(buffer) || due()) {
+    return flush(client) ? size : 0;
+  }
+  return size;
+}
+
+bool CloudIoTCoreCoalescer::flush(Client &client)
+{
+  reply = false;
+  if (used == 0) {
+    return true;
+  }
+  size_t length = used;
+  used = 0;
+  flushCount++;
+  return client.write(buffer, length) == length;
+}
+
+size_t CloudIoTCoreCoalescer::pending()
+{
+  return used;
+}
+
+bool CloudIoTCoreCoalescer::due()
+{
+  return used > 0 && millis() - firstBuffered >= maxLatencyMs;
+}
+
+bool CloudIoTCoreCoalescer::awaitingReply()
+{
+  return reply && used > 0;
+}
+
+uint32_t CloudIoTCoreCoalescer::flushes()
+{
+  return flushCount;
+}
+
+uint32_t CloudIoTCoreCoalescer::packets()
+{
+  return packetCount;
+}
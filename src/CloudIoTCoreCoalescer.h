@@ -0,0 +1,77 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreCoalescer_h
+#define CloudIoTCoreCoalescer_h
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Bytes gathered before they are written, about one TCP segment.
+#ifndef CLOUD_IOT_CORE_COALESCE_BUFFER
+#define CLOUD_IOT_CORE_COALESCE_BUFFER 1024
+#endif
+
+// Write buffer under the MQTT client so several packets (PUBLISH, PUBACK,
+// PINGREQ) go out in one Client write, which on a TLS client is one record
+// and one encryption pass instead of one per packet.
+//
+// Attach it with CloudIoTCoreMqtt::setCoalescer(). Buffered bytes are
+// written when the buffer fills, max_latency_ms after the first of them,
+// on CloudIoTCoreMqtt::flushWrites(), and before the next read once a
+// packet the broker answers (CONNECT, SUBSCRIBE, QoS 1 PUBLISH, PINGREQ)
+// is buffered, so waits for CONNACK, SUBACK or PUBACK are not delayed.
+class CloudIoTCoreCoalescer {
+  public:
+    CloudIoTCoreCoalescer(unsigned long max_latency_ms = 20);
+
+    // Buffers buf, writing out what is buffered first if it does not fit.
+    // Returns size, or 0 if a write to client failed.
+    size_t write(Client &client, const uint8_t *buf, size_t size);
+    bool flush(Client &client);
+    // Drops buffered bytes, e.g. on a new connection.
+    void clear();
+
+    size_t pending();
+    // Something is buffered and max_latency_ms has passed.
+    bool due();
+    // A buffered packet expects an answer from the broker.
+    bool awaitingReply();
+
+    // Client writes made, and packets they carried.
+    uint32_t flushes();
+    uint32_t packets();
+
+  private:
+    enum ScanState {
+      SCAN_HEADER,
+      SCAN_LENGTH,
+      SCAN_BODY
+    };
+    unsigned long maxLatencyMs;
+    unsigned long firstBuffered;
+    bool reply;
+    ScanState scanState;
+    uint8_t lengthShift;
+    uint32_t remaining;
+    uint32_t flushCount;
+    uint32_t packetCount;
+    size_t used;
+    uint8_t buffer[CLOUD_IOT_CORE_COALESCE_BUFFER];
+
+    void scan(const uint8_t *buf, size_t size);
+};
+
+#endif  // CloudIoTCoreCoalescer_h
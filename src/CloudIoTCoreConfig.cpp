@@ -0,0 +1,155 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <string.h>
+#include "CloudIoTCoreConfig.h"
+#include "CloudIoTCoreLog.h"
+#include "crypto/sha256.h"
+#if defined(CLOUD_IOT_CORE_CONFIG_STDIO)
+#include <stdio.h>
+#endif
+
+// Stored record: magic, server version (little endian, 0 if unknown),
+// hash, fletcher16 of the bytes before it. Records with the older 'C','V'
+// magic held a local count instead and are ignored.
+#define CONFIG_RECORD (2 + 4 + 32 + 2)
+
+static uint16_t fletcher16(const uint8_t *data, size_t length)
+{
+  uint16_t a = 0;
+  uint16_t b = 0;
+  for (size_t i = 0; i < length; i++) {
+    a = (a + data[i]) % 255;
+    b = (b + a) % 255;
+  }
+  return (b << 8) | a;
+}
+
+CloudIoTCoreConfig::CloudIoTCoreConfig()
+    :
+#if defined(CLOUD_IOT_CORE_CONFIG_FS)
+      fs(NULL),
+#endif
+      path(NULL), current(0), known(false) {}
+
+#if defined(CLOUD_IOT_CORE_CONFIG_FS)
+CloudIoTCoreConfig::CloudIoTCoreConfig(fs::FS &_fs, const char *_path)
+    : fs(&_fs), path(_path), current(0), known(false) {}
+#elif defined(CLOUD_IOT_CORE_CONFIG_STDIO)
+CloudIoTCoreConfig::CloudIoTCoreConfig(const char *_path)
+    : path(_path), current(0), known(false) {}
+#endif
+
+bool CloudIoTCoreConfig::begin()
+{
+  uint8_t record[CONFIG_RECORD];
+  size_t n = 0;
+  if (path == NULL) {
+    return false;
+  }
+#if defined(CLOUD_IOT_CORE_CONFIG_FS)
+  if (fs->exists(path)) {
+    File f = fs->open(path, "r");
+    if (f) {
+      n = f.read(record, sizeof(record));
+      f.close();
+    }
+  }
+#elif defined(CLOUD_IOT_CORE_CONFIG_STDIO)
+  FILE *f = fopen(path, "rb");
+  if (f != NULL) {
+    n = fread(record, 1, sizeof(record), f);
+    fclose(f);
+  }
+#endif
+  if (n != sizeof(record) || record[0] != 'C' || record[1] != 'S' ||
+      fletcher16(record, CONFIG_RECORD - 2) !=
+          (record[CONFIG_RECORD - 2] | record[CONFIG_RECORD - 1] << 8)) {
+    return false;
+  }
+  current = record[2] | record[3] << 8 | (uint32_t)record[4] << 16 |
+            (uint32_t)record[5] << 24;
+  memcpy(hash, record + 6, sizeof(hash));
+  known = true;
+  ciotc_log_debug("config version %lu", (unsigned long)current);
+  return true;
+}
+
+void CloudIoTCoreConfig::save()
+{
+  uint8_t record[CONFIG_RECORD];
+  if (path == NULL) {
+    return;
+  }
+  record[0] = 'C';
+  record[1] = 'S';
+  for (int i = 0; i < 4; i++) {
+    record[2 + i] = current >> (8 * i);
+  }
+  memcpy(record + 6, hash, sizeof(hash));
+  uint16_t check = fletcher16(record, CONFIG_RECORD - 2);
+  record[CONFIG_RECORD - 2] = check;
+  record[CONFIG_RECORD - 1] = check >> 8;
+
+  bool ok = false;
+#if defined(CLOUD_IOT_CORE_CONFIG_FS)
+  File f = fs->open(path, "w");
+  if (f) {
+    ok = f.write(record, sizeof(record)) == sizeof(record);
+    f.close();
+  }
+#elif defined(CLOUD_IOT_CORE_CONFIG_STDIO)
+  FILE *f = fopen(path, "wb");
+  if (f != NULL) {
+    ok = fwrite(record, 1, sizeof(record), f) == sizeof(record);
+    ok = fclose(f) == 0 && ok;
+  }
+#endif
+  if (!ok) {
+    ciotc_log_warn("could not store config version in %s", path);
+  }
+}
+
+bool CloudIoTCoreConfig::update(const char *payload, size_t length)
+{
+  return update(payload, length, 0);
+}
+
+bool CloudIoTCoreConfig::update(const char *payload, size_t length,
+                                uint32_t version)
+{
+  uint8_t digest[32];
+  Sha256 sha;
+  sha.update((const BYTE *)payload, length);
+  sha.final(digest);
+  if (known && memcmp(digest, hash, sizeof(hash)) == 0) {
+    return false;
+  }
+  memcpy(hash, digest, sizeof(hash));
+  current = version;
+  known = true;
+  save();
+  return true;
+}
+
+uint32_t CloudIoTCoreConfig::version()
+{
+  return current;
+}
+
+void CloudIoTCoreConfig::forget()
+{
+  known = false;
+}
@@ -0,0 +1,74 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreConfig_h
+#define CloudIoTCoreConfig_h
+
+#include <Arduino.h>
+
+// Storage backend, the same choice as CloudIoTCoreSpool: an Arduino FS on
+// ESP32/ESP8266, stdio on Linux host builds, RAM only elsewhere.
+#if defined(ESP32) || defined(ESP8266)
+#include <FS.h>
+#define CLOUD_IOT_CORE_CONFIG_FS
+#elif !defined(ARDUINO)
+#define CLOUD_IOT_CORE_CONFIG_STDIO
+#endif
+
+// Remembers the SHA-256 of the last config applied and, when it came over
+// HTTP, the version IoT Core gave it. IoT Core sends the current config again on every
+// (re)connect; with CloudIoTCoreMqtt::setConfigTracking() those repeats
+// no longer reach the config handler.
+//
+// With a path the hash and version are kept across reboots, so a config
+// that has not changed is not delivered after a reboot either. Sketches
+// that do not keep their own settings should use the RAM only constructor
+// or call forget() at boot.
+class CloudIoTCoreConfig {
+  public:
+    CloudIoTCoreConfig();
+#if defined(CLOUD_IOT_CORE_CONFIG_FS)
+    // fs must already be mounted.
+    CloudIoTCoreConfig(fs::FS &fs, const char *path = "/ciotc_config");
+#elif defined(CLOUD_IOT_CORE_CONFIG_STDIO)
+    CloudIoTCoreConfig(const char *path);
+#endif
+
+    // Loads the stored hash and version, false if there were none.
+    bool begin();
+    // True if payload differs from the last config, which then becomes
+    // the current one. MQTT does not carry the version, so it is 0.
+    bool update(const char *payload, size_t length);
+    // Same for a config fetched over HTTP, with the version IoT Core sent.
+    bool update(const char *payload, size_t length, uint32_t version);
+    // IoT Core's version of the current config, 0 if not known. Fits
+    // CloudIoTCoreDevice::getConfigPath(), where 0 asks for the latest.
+    uint32_t version();
+    // Lets the next config through even if it is unchanged.
+    void forget();
+
+  private:
+#if defined(CLOUD_IOT_CORE_CONFIG_FS)
+    fs::FS *fs;
+#endif
+    const char *path;
+    uint32_t current;
+    bool known;
+    uint8_t hash[32];
+
+    void save();
+};
+
+#endif  // CloudIoTCoreConfig_h
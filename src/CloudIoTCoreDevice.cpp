@@ -17,8 +17,30 @@
 #include <stdio.h>
 #include <cstring>
 #include "jwt.h"
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMetrics.h"
 
 
+// Bounded strcpy at offset len, returns the new length. Never writes past
+// cap and always terminates.
+static size_t append(char *out, size_t len, size_t cap, const char *s)
+{
+  while (*s && len + 1 < cap) {
+    out[len++] = *s++;
+  }
+  out[len] = '\0';
+  return len;
+}
+
+static void copy_id(char *out, const char *id, const char *what)
+{
+  if (strlen(id) >= CLOUD_IOT_CORE_ID_MAX) {
+    ciotc_log_warn("%s longer than %d characters, truncated", what,
+                   CLOUD_IOT_CORE_ID_MAX - 1);
+  }
+  append(out, 0, CLOUD_IOT_CORE_ID_MAX, id);
+}
+
 void CloudIoTCoreDevice::init(
     const char *_project_id,
     const char *_location,
@@ -26,61 +48,198 @@ void CloudIoTCoreDevice::init(
     const char *_device_id,
     const char *_private_key)
 {
-  strcpy(this->project_id, _project_id);
-  strcpy(this->location, _location);
-  strcpy(this->registry_id, _registry_id);
-  strcpy(this->device_id, _device_id);
+  copy_id(this->project_id, _project_id, "project id");
+  copy_id(this->location, _location, "location");
+  copy_id(this->registry_id, _registry_id, "registry id");
+  copy_id(this->device_id, _device_id, "device id");
+  buildPaths();
   setPrivateKey(_private_key);
   invalidateJWT();
 }
 
+void CloudIoTCoreDevice::buildPaths()
+{
+  size_t n = 0;
+  n = append(client_id, n, sizeof(client_id), "projects/");
+  n = append(client_id, n, sizeof(client_id), project_id);
+  n = append(client_id, n, sizeof(client_id), "/locations/");
+  n = append(client_id, n, sizeof(client_id), location);
+  n = append(client_id, n, sizeof(client_id), "/registries/");
+  n = append(client_id, n, sizeof(client_id), registry_id);
+  n = append(client_id, n, sizeof(client_id), "/devices/");
+  append(client_id, n, sizeof(client_id), device_id);
+
+  n = append(path_prefix, 0, sizeof(path_prefix), "/v1/");
+  path_prefix_length = append(path_prefix, n, sizeof(path_prefix), client_id);
+  getFullPath(":publishEvent", telemetry_path);
+  getFullPath(":setState", state_path);
+
+  n = append(commands_topic, 0, sizeof(commands_topic), "/devices/");
+  n = append(commands_topic, n, sizeof(commands_topic), device_id);
+  memcpy(config_topic, commands_topic, n);
+  memcpy(events_topic, commands_topic, n);
+  memcpy(state_topic, commands_topic, n);
+  append(commands_topic, n, sizeof(commands_topic), "/commands/#");
+  append(config_topic, n, sizeof(config_topic), "/config");
+  events_topic_length = append(events_topic, n, sizeof(events_topic), "/events");
+  append(state_topic, n, sizeof(state_topic), "/state");
+
+  nsubtopics = 0;
+}
+
+void CloudIoTCoreDevice::beginJWT(long long int current_time)
+{
+  JwtSlot &next = slots[current ^ 1];
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  next_jwt_length = jwt_signing_input(next.token, project_id, current_time,
+                                      jwt_exp_secs, digest);
+  next.iss = current_time;
+  next.exp = current_time + jwt_exp_secs;
+  signer.begin(digest, priv_key);
+  sign_us = 0;
+  __atomic_store_n(&signing, true, __ATOMIC_RELEASE);
+}
+
+bool CloudIoTCoreDevice::stepJWT(unsigned long budget_us)
+{
+  unsigned long start = micros();
+  bool done = signer.step(budget_us);
+  sign_us += micros() - start;
+  if (!done) {
+    return false;
+  }
+  ciotc_metric_count(CIOTC_COUNTER_JWT_SIGNS);
+  ciotc_metric_observe(CIOTC_HISTOGRAM_JWT_SIGN_US, sign_us);
+
+  NN_DIGIT signature_r[NUMWORDS], signature_s[NUMWORDS];
+  signer.getSignature(signature_r, signature_s);
+  jwt_append_signature(slots[current ^ 1].token, next_jwt_length,
+                       signature_r, signature_s);
+  // Publish the finished slot before clearing the flag, readers may be on
+  // another core.
+  __atomic_store_n(&current, current ^ 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&signing, false, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool CloudIoTCoreDevice::refreshJWT(unsigned long budget_us)
+{
+  if (__atomic_load_n(&on_worker, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  if (!__atomic_load_n(&signing, __ATOMIC_ACQUIRE)) {
+    beginJWT(time(nullptr));
+  }
+  return stepJWT(budget_us);
+}
+
 void CloudIoTCoreDevice::createJWT(long long int current_time)
 {
-  // Disable software watchdog as these operations can take a while.
-  ESP.wdtDisable();
-  Serial.println("Refreshing JWT");
+  ciotc_log_info("Refreshing JWT");
+
+  // Finish a refresh that is already under way rather than starting over.
+  // Sign in slices and yield in between so the watchdog and the network
+  // stack keep running.
+  if (!__atomic_load_n(&signing, __ATOMIC_ACQUIRE)) {
+    beginJWT(current_time);
+  }
+  while (__atomic_load_n(&signing, __ATOMIC_ACQUIRE)) {
+    if (__atomic_load_n(&on_worker, __ATOMIC_ACQUIRE)) {
+      delay(1);
+    } else {
+      stepJWT(CLOUD_IOT_CORE_JWT_SLICE_US);
+      yield();
+    }
+  }
+
+  ciotc_log_debug("%s", slots[current].token);
+}
 
-  create_jwt(jwt, project_id, current_time, priv_key, jwt_exp_secs);
-  iss = current_time;
-  exp = current_time + jwt_exp_secs;
+bool CloudIoTCoreDevice::refreshDue(long long int current_time)
+{
+  const JwtSlot &slot = slots[__atomic_load_n(&current, __ATOMIC_ACQUIRE)];
+  return slot.iss != 0 && !__atomic_load_n(&signing, __ATOMIC_ACQUIRE) &&
+         current_time >= (long long int)slot.iss +
+                             (long long int)(jwt_refresh_fraction *
+                                             jwt_exp_secs);
+}
 
-  Serial.println(jwt);
+void CloudIoTCoreDevice::refreshTask(void *device)
+{
+  CloudIoTCoreDevice *self = (CloudIoTCoreDevice *)device;
+  while (!self->stepJWT(CLOUD_IOT_CORE_JWT_SLICE_US)) {
+    worker_yield();
+  }
+  __atomic_store_n(&self->on_worker, false, __ATOMIC_RELEASE);
+}
 
-  ESP.wdtEnable(0);
+void CloudIoTCoreDevice::startRefresh(long long int current_time)
+{
+  beginJWT(current_time);
+  __atomic_store_n(&on_worker, true, __ATOMIC_RELEASE);
+  if (!worker_start(refreshTask, this)) {
+    // No worker on this board, loop() drives the signer instead.
+    __atomic_store_n(&on_worker, false, __ATOMIC_RELEASE);
+  }
+}
+
+void CloudIoTCoreDevice::loop()
+{
+  long long int current_time = time(nullptr);
+  if (refreshDue(current_time)) {
+    startRefresh(current_time);
+  }
+  if (__atomic_load_n(&signing, __ATOMIC_ACQUIRE) &&
+      !__atomic_load_n(&on_worker, __ATOMIC_ACQUIRE)) {
+    stepJWT(CLOUD_IOT_CORE_JWT_SLICE_US);
+  }
+}
+
+bool CloudIoTCoreDevice::isJWTValid()
+{
+  const JwtSlot &slot = slots[__atomic_load_n(&current, __ATOMIC_ACQUIRE)];
+  return 0 != slot.iss && (long long int)slot.exp + 1*60 >= time(nullptr);
 }
 
 const char* CloudIoTCoreDevice::getJWT()
 {
   long long int current_time = time(nullptr);
-  if (0 == iss || exp + 1*60 < current_time) {
+  if (!isJWTValid()) {
     createJWT(current_time);
+  } else if (refreshDue(current_time)) {
+    // Still valid, hand it out and mint the next one in the background.
+    startRefresh(current_time);
   }
-  return jwt;
+  return slots[__atomic_load_n(&current, __ATOMIC_ACQUIRE)].token;
 }
 
 void CloudIoTCoreDevice::invalidateJWT()
 {
-  iss = 0;
-  exp = 0;
+  slots[current].iss = 0;
+  slots[current].exp = 0;
+}
+
+const char* CloudIoTCoreDevice::getClientId()
+{
+  return client_id;
 }
 
 void CloudIoTCoreDevice::getClientId(char* out)
 {
-  sprintf(out, "projects/%s/locations/%s/registries/%s/devices/%s",
-    project_id, location, registry_id, device_id);
+  strcpy(out, client_id);
 }
 
 void CloudIoTCoreDevice::getDeviceId(char* out)
 {
-  sprintf(out, "%s", device_id);
+  strcpy(out, device_id);
 }
 
 /* HTTP methods path */
 
 void CloudIoTCoreDevice::getFullPath(const char* path, char* out)
 {
-  sprintf(out, "/v1/projects/%s/locations/%s/registries/%s/devices/%s%s",
-      project_id, location, registry_id, device_id, path);
+  memcpy(out, path_prefix, path_prefix_length);
+  append(out, path_prefix_length, CLOUD_IOT_CORE_PATH_MAX, path);
 }
 
 void CloudIoTCoreDevice::getConfigPath(int version, char* out)
@@ -94,48 +253,103 @@ void CloudIoTCoreDevice::getConfigPath(int version, char* out)
 //   return this->getConfigPath(0);
 // }
 
+const char* CloudIoTCoreDevice::getSendTelemetryPath()
+{
+  return telemetry_path;
+}
+
 void CloudIoTCoreDevice::getSendTelemetryPath(char* out)
 {
-  getFullPath(":publishEvent", out);
+  strcpy(out, telemetry_path);
+}
+
+const char* CloudIoTCoreDevice::getSetStatePath()
+{
+  return state_path;
 }
 
 void CloudIoTCoreDevice::getSetStatePath(char* out)
 {
-  getFullPath(":setState", out);
+  strcpy(out, state_path);
 }
 
 /* MQTT methods */
 
+const char* CloudIoTCoreDevice::getConfigTopic()
+{
+  return config_topic;
+}
+
 void CloudIoTCoreDevice::getConfigTopic(char* out)
 {
-  sprintf(out, "/devices/%s/config", device_id);
+  strcpy(out, config_topic);
+}
+
+const char* CloudIoTCoreDevice::getCommandsTopic()
+{
+  return commands_topic;
 }
 
 void CloudIoTCoreDevice::getCommandsTopic(char* out)
 {
-  sprintf(out, "/devices/%s/commands/#", device_id);
+  strcpy(out, commands_topic);
+}
+
+const char* CloudIoTCoreDevice::getEventsTopic()
+{
+  return events_topic;
 }
 
 void CloudIoTCoreDevice::getEventsTopic(char* out)
 {
-  sprintf(out, "/devices/%s/events", device_id);
+  strcpy(out, events_topic);
+}
+
+const char* CloudIoTCoreDevice::getStateTopic()
+{
+  return state_topic;
 }
 
 void CloudIoTCoreDevice::getStateTopic(char* out)
 {
-  sprintf(out, "/devices/%s/state", device_id);
+  strcpy(out, state_topic);
+}
+
+const char* CloudIoTCoreDevice::internEventsTopic(const char* subtopic)
+{
+  for (uint8_t i = 0; i < nsubtopics; i++) {
+    if (strcmp(subtopics[i] + events_topic_length, subtopic) == 0) {
+      return subtopics[i];
+    }
+  }
+  if (nsubtopics == CLOUD_IOT_CORE_SUBTOPICS ||
+      strlen(subtopic) >= CLOUD_IOT_CORE_SUBTOPIC_MAX) {
+    return NULL;
+  }
+  char *topic = subtopics[nsubtopics++];
+  memcpy(topic, events_topic, events_topic_length);
+  append(topic, events_topic_length, sizeof(subtopics[0]), subtopic);
+  return topic;
 }
 
 void CloudIoTCoreDevice::setJwtExpSecs(int exp_in_secs) {
   this->jwt_exp_secs = exp_in_secs;
 }
 
+void CloudIoTCoreDevice::setJwtRefreshFraction(float fraction) {
+  if (fraction < 0) {
+    fraction = 0;
+  } else if (fraction > 1) {
+    fraction = 1;
+  }
+  this->jwt_refresh_fraction = fraction;
+}
+
 CloudIoTCoreDevice &CloudIoTCoreDevice::setPrivateKey(const char *private_key)
 {
   size_t length = strlen(private_key);
   if (length != 95) {
-    Serial.print("Warning: expected private key to be 95, was: ");
-    Serial.println(length);
+    ciotc_log_warn("expected private key to be 95, was: %u", (unsigned)length);
     return *this;
   }
 
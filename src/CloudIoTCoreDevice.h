@@ -18,23 +18,83 @@
 
 #include <Arduino.h>
 #include "jwt.h"
+#include "CloudIoTCoreSigner.h"
+#include "CloudIoTCoreWorker.h"
+
+// Longest stretch spent signing before yielding, microseconds.
+#ifndef CLOUD_IOT_CORE_JWT_SLICE_US
+#define CLOUD_IOT_CORE_JWT_SLICE_US 10000
+#endif
+
+// Buffer sizes, NUL included. Longer ids are truncated by init().
+#define CLOUD_IOT_CORE_ID_MAX 32
+// projects/<p>/locations/<l>/registries/<r>/devices/<d>
+#define CLOUD_IOT_CORE_CLIENT_ID_MAX (41 + 4 * (CLOUD_IOT_CORE_ID_MAX - 1) + 1)
+// /v1/<client id><suffix>, longest suffix is /config?local_version=<int>
+#define CLOUD_IOT_CORE_PATH_MAX (CLOUD_IOT_CORE_CLIENT_ID_MAX + 37)
+// /devices/<d>/commands/#
+#define CLOUD_IOT_CORE_TOPIC_MAX (CLOUD_IOT_CORE_ID_MAX + 20)
+
+// Events subtopics remembered by internEventsTopic() and their longest
+// length.
+#ifndef CLOUD_IOT_CORE_SUBTOPICS
+#define CLOUD_IOT_CORE_SUBTOPICS 4
+#endif
+#ifndef CLOUD_IOT_CORE_SUBTOPIC_MAX
+#define CLOUD_IOT_CORE_SUBTOPIC_MAX 48
+#endif
 
 class CloudIoTCoreDevice {
  private:
-  char project_id[32] = {0};
-  char location[32] = {0};
-  char registry_id[32] = {0};
-  char device_id[32] = {0};
+  char project_id[CLOUD_IOT_CORE_ID_MAX] = {0};
+  char location[CLOUD_IOT_CORE_ID_MAX] = {0};
+  char registry_id[CLOUD_IOT_CORE_ID_MAX] = {0};
+  char device_id[CLOUD_IOT_CORE_ID_MAX] = {0};
+
+  // Built once by init() so publishing does no formatting.
+  char client_id[CLOUD_IOT_CORE_CLIENT_ID_MAX] = {0};
+  char path_prefix[CLOUD_IOT_CORE_PATH_MAX] = {0};
+  size_t path_prefix_length = 0;
+  char telemetry_path[CLOUD_IOT_CORE_PATH_MAX] = {0};
+  char state_path[CLOUD_IOT_CORE_PATH_MAX] = {0};
+  char commands_topic[CLOUD_IOT_CORE_TOPIC_MAX] = {0};
+  char config_topic[CLOUD_IOT_CORE_TOPIC_MAX] = {0};
+  char events_topic[CLOUD_IOT_CORE_TOPIC_MAX] = {0};
+  size_t events_topic_length = 0;
+  char state_topic[CLOUD_IOT_CORE_TOPIC_MAX] = {0};
+  char subtopics[CLOUD_IOT_CORE_SUBTOPICS]
+                [CLOUD_IOT_CORE_TOPIC_MAX + CLOUD_IOT_CORE_SUBTOPIC_MAX];
+  uint8_t nsubtopics = 0;
 
   NN_DIGIT priv_key[9] = {0};
 
-  char jwt[JWT_MAX_LENGTH];
-  unsigned long iss = 0;
-  unsigned long exp = 0;
+  // Two token slots: getJWT hands out slots[current] while the next token
+  // is signed into the other one, then current flips over.
+  struct JwtSlot {
+    char token[JWT_MAX_LENGTH];
+    unsigned long iss;
+    unsigned long exp;
+  };
+  JwtSlot slots[2];
+  uint8_t current = 0;
   int jwt_exp_secs = 3600;
+  float jwt_refresh_fraction = 0.8;
+
+  // Refresh in progress, on the worker task or driven from loop().
+  EcdsaSigner signer;
+  bool signing = false;
+  bool on_worker = false;
+  size_t next_jwt_length = 0;
+  unsigned long sign_us = 0;  // CPU time spent on the signature so far
 
   CloudIoTCoreDevice &setPrivateKey(const char *private_key);
+  void beginJWT(long long int current_time);
+  bool stepJWT(unsigned long budget_us);
   void createJWT(long long int current_time);
+  bool refreshDue(long long int current_time);
+  void startRefresh(long long int current_time);
+  static void refreshTask(void *device);
+  void buildPaths();
   void getFullPath(const char* path, char* out);
 
  public:
@@ -43,24 +103,48 @@ class CloudIoTCoreDevice {
             const char *private_key);
 
   void setJwtExpSecs(int exp_in_secs);
+  /* Start signing the next JWT once this fraction of the current token's
+     lifetime has passed (default 0.8). */
+  void setJwtRefreshFraction(float fraction);
 
+  const char* getClientId();
   void getClientId(char* out);
   void getDeviceId(char* out);
 
   /* Get a valid JWT */
   const char* getJWT();
+  /* True if getJWT() can return without signing */
+  bool isJWTValid();
   void invalidateJWT();
+  /* Sign a new JWT a slice at a time, e.g. once per loop(). Returns true
+     once the new token has replaced the current one. */
+  bool refreshJWT(unsigned long budget_us);
+  /* Starts proactive refreshes and, on boards without a worker task,
+     advances them by one slice. Call from loop(). */
+  void loop();
 
-  /* HTTP methods path */
+  /* HTTP methods path, out must hold CLOUD_IOT_CORE_PATH_MAX */
+  /* version is IoT Core's version of the config applied, 0 for the latest,
+     e.g. CloudIoTCoreConfig::version(). */
   void getConfigPath(int version, char* out);
   //String getLastConfigPath();
+  const char* getSendTelemetryPath();
   void getSendTelemetryPath(char* out);
+  const char* getSetStatePath();
   void getSetStatePath(char* out);
 
-  /* MQTT methods */
+  /* MQTT methods, out must hold CLOUD_IOT_CORE_TOPIC_MAX */
+  const char* getCommandsTopic();
   void getCommandsTopic(char* out);
+  const char* getConfigTopic();
   void getConfigTopic(char* out);
+  const char* getEventsTopic();
   void getEventsTopic(char* out);
+  const char* getStateTopic();
   void getStateTopic(char* out);
+  /* Events topic for a subtopic such as "/sensors", built on first use and
+     cached. NULL once CLOUD_IOT_CORE_SUBTOPICS are in use or if the
+     subtopic is longer than CLOUD_IOT_CORE_SUBTOPIC_MAX. */
+  const char* internEventsTopic(const char* subtopic);
 };
 #endif  // CloudIoTCoreDevice_h
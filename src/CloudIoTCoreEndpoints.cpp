@@ -0,0 +1,247 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include "CloudIoTCoreEndpoints.h"
+#include "CloudIoTCoreLog.h"
+#if defined(CLOUD_IOT_CORE_ENDPOINTS_STDIO)
+#include <stdio.h>
+#endif
+
+// Stored record: magic, then per endpoint latency (little endian) and
+// failures, then the sum of the bytes before it.
+#define ENDPOINT_RECORD (2 + ENDPOINTS * 5 + 1)
+
+CloudIoTCoreEndpoints::CloudIoTCoreEndpoints()
+    :
+#if defined(CLOUD_IOT_CORE_ENDPOINTS_FS)
+      fs(NULL),
+#endif
+      path(NULL), selected(ENDPOINT_PRIMARY), since_probe(0)
+{
+  endpoints[ENDPOINT_PRIMARY] = {CLOUD_IOT_CORE_MQTT_HOST, 0, 0};
+  endpoints[ENDPOINT_LTS] = {CLOUD_IOT_CORE_MQTT_HOST_LTS, 0, 0};
+}
+
+#if defined(CLOUD_IOT_CORE_ENDPOINTS_FS)
+CloudIoTCoreEndpoints::CloudIoTCoreEndpoints(fs::FS &_fs, const char *_path)
+    : CloudIoTCoreEndpoints()
+{
+  fs = &_fs;
+  path = _path;
+}
+#elif defined(CLOUD_IOT_CORE_ENDPOINTS_STDIO)
+CloudIoTCoreEndpoints::CloudIoTCoreEndpoints(const char *_path)
+    : CloudIoTCoreEndpoints()
+{
+  path = _path;
+}
+#endif
+
+static uint8_t checksum(const uint8_t *data, size_t length)
+{
+  uint8_t sum = 0;
+  for (size_t i = 0; i < length; i++) {
+    sum += data[i];
+  }
+  return sum;
+}
+
+bool CloudIoTCoreEndpoints::begin()
+{
+  uint8_t record[ENDPOINT_RECORD];
+  size_t n = 0;
+  if (path == NULL) {
+    return false;
+  }
+#if defined(CLOUD_IOT_CORE_ENDPOINTS_FS)
+  if (fs->exists(path)) {
+    File f = fs->open(path, "r");
+    if (f) {
+      n = f.read(record, sizeof(record));
+      f.close();
+    }
+  }
+#elif defined(CLOUD_IOT_CORE_ENDPOINTS_STDIO)
+  FILE *f = fopen(path, "rb");
+  if (f != NULL) {
+    n = fread(record, 1, sizeof(record), f);
+    fclose(f);
+  }
+#endif
+  if (n != sizeof(record) || record[0] != 'E' || record[1] != 'P' ||
+      checksum(record, ENDPOINT_RECORD - 1) != record[ENDPOINT_RECORD - 1]) {
+    return false;
+  }
+  for (int i = 0; i < ENDPOINTS; i++) {
+    const uint8_t *p = record + 2 + i * 5;
+    endpoints[i].latency_ms = p[0] | p[1] << 8 | (uint32_t)p[2] << 16 |
+                              (uint32_t)p[3] << 24;
+    endpoints[i].failures = p[4];
+  }
+  selected = preferred();
+  ciotc_log_debug("endpoint %s preferred", endpoints[selected].host);
+  return true;
+}
+
+void CloudIoTCoreEndpoints::save()
+{
+  uint8_t record[ENDPOINT_RECORD];
+  if (path == NULL) {
+    return;
+  }
+  record[0] = 'E';
+  record[1] = 'P';
+  for (int i = 0; i < ENDPOINTS; i++) {
+    uint8_t *p = record + 2 + i * 5;
+    for (int b = 0; b < 4; b++) {
+      p[b] = endpoints[i].latency_ms >> (8 * b);
+    }
+    p[4] = endpoints[i].failures;
+  }
+  record[ENDPOINT_RECORD - 1] = checksum(record, ENDPOINT_RECORD - 1);
+
+  bool ok = false;
+#if defined(CLOUD_IOT_CORE_ENDPOINTS_FS)
+  File f = fs->open(path, "w");
+  if (f) {
+    ok = f.write(record, sizeof(record)) == sizeof(record);
+    f.close();
+  }
+#elif defined(CLOUD_IOT_CORE_ENDPOINTS_STDIO)
+  FILE *f = fopen(path, "wb");
+  if (f != NULL) {
+    ok = fwrite(record, 1, sizeof(record), f) == sizeof(record);
+    ok = fclose(f) == 0 && ok;
+  }
+#endif
+  if (!ok) {
+    ciotc_log_warn("could not store endpoint health in %s", path);
+  }
+}
+
+bool CloudIoTCoreEndpoints::healthy(int endpoint)
+{
+  return endpoint >= 0 && endpoint < ENDPOINTS &&
+         endpoints[endpoint].failures < CLOUD_IOT_CORE_ENDPOINT_FAILOVER;
+}
+
+// Healthy and fastest; unmeasured endpoints lose to measured ones and the
+// primary wins ties. If none is healthy, the one with the fewest failures.
+int CloudIoTCoreEndpoints::preferred()
+{
+  int best = -1;
+  for (int i = 0; i < ENDPOINTS; i++) {
+    if (!healthy(i)) {
+      continue;
+    }
+    if (best < 0) {
+      best = i;
+      continue;
+    }
+    uint32_t a = endpoints[i].latency_ms;
+    uint32_t b = endpoints[best].latency_ms;
+    if (a != 0 && (b == 0 || a < b)) {
+      best = i;
+    }
+  }
+  if (best >= 0) {
+    return best;
+  }
+  best = 0;
+  for (int i = 1; i < ENDPOINTS; i++) {
+    if (endpoints[i].failures < endpoints[best].failures) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+const char *CloudIoTCoreEndpoints::select()
+{
+  int best = preferred();
+  if (healthy(best)) {
+    selected = best;
+    // Now and then try the other endpoint so its latency does not go
+    // stale and a failed one gets the chance to recover. One that was
+    // never measured is tried on the next connect.
+    int other = (best + 1) % ENDPOINTS;
+    if (since_probe >= CLOUD_IOT_CORE_ENDPOINT_PROBE_EVERY ||
+        (since_probe > 0 && endpoints[other].latency_ms == 0 &&
+         healthy(other))) {
+      selected = other;
+      since_probe = 0;
+    }
+  } else if (selected == best) {
+    // Everything is failing, alternate.
+    selected = (best + 1) % ENDPOINTS;
+  } else {
+    selected = best;
+  }
+  return endpoints[selected].host;
+}
+
+void CloudIoTCoreEndpoints::report(bool ok, unsigned long latency_ms)
+{
+  Endpoint &e = endpoints[selected];
+  int before = preferred();
+  bool was_healthy = healthy(selected);
+  bool first = e.latency_ms == 0;
+
+  if (ok) {
+    if (latency_ms == 0) {
+      latency_ms = 1;
+    }
+    e.latency_ms = first ? latency_ms : (e.latency_ms * 3 + latency_ms) / 4;
+    e.failures = 0;
+    since_probe++;
+  } else if (e.failures < 255) {
+    e.failures++;
+  }
+
+  if (was_healthy && !healthy(selected)) {
+    ciotc_log_warn("%s failed %d times, failing over", e.host, e.failures);
+  }
+  if (first && ok) {
+    ciotc_log_debug("%s connects in %lums", e.host, latency_ms);
+  }
+  if (before != preferred() || was_healthy != healthy(selected) ||
+      (first && ok)) {
+    save();
+  }
+}
+
+const char *CloudIoTCoreEndpoints::host(int endpoint)
+{
+  return endpoint >= 0 && endpoint < ENDPOINTS ? endpoints[endpoint].host
+                                               : NULL;
+}
+
+uint32_t CloudIoTCoreEndpoints::latency(int endpoint)
+{
+  return endpoint >= 0 && endpoint < ENDPOINTS
+             ? endpoints[endpoint].latency_ms
+             : 0;
+}
+
+uint8_t CloudIoTCoreEndpoints::failures(int endpoint)
+{
+  return endpoint >= 0 && endpoint < ENDPOINTS ? endpoints[endpoint].failures
+                                               : 0;
+}
+
+int CloudIoTCoreEndpoints::current()
+{
+  return selected;
+}
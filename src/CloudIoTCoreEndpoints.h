@@ -0,0 +1,100 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreEndpoints_h
+#define CloudIoTCoreEndpoints_h
+
+#include <Arduino.h>
+#include "CloudIoTCore.h"
+
+// Storage backend, the same choice as CloudIoTCoreConfig.
+#if defined(ESP32) || defined(ESP8266)
+#include <FS.h>
+#define CLOUD_IOT_CORE_ENDPOINTS_FS
+#elif !defined(ARDUINO)
+#define CLOUD_IOT_CORE_ENDPOINTS_STDIO
+#endif
+
+// Consecutive connect failures after which an endpoint is avoided, and how
+// many successful connects pass before the other endpoint is tried once to
+// refresh its latency.
+#ifndef CLOUD_IOT_CORE_ENDPOINT_FAILOVER
+#define CLOUD_IOT_CORE_ENDPOINT_FAILOVER 3
+#endif
+#ifndef CLOUD_IOT_CORE_ENDPOINT_PROBE_EVERY
+#define CLOUD_IOT_CORE_ENDPOINT_PROBE_EVERY 10
+#endif
+
+// Chooses between CLOUD_IOT_CORE_MQTT_HOST and CLOUD_IOT_CORE_MQTT_HOST_LTS.
+// CloudIoTCoreMqtt reports the time from the start of the TCP connect to
+// the CONNACK and whether the attempt failed; the next connect goes to the
+// healthy endpoint with the lowest average latency. Every
+// CLOUD_IOT_CORE_ENDPOINT_PROBE_EVERY connects the other endpoint is used
+// once so its latency stays current and a failed one can recover.
+// Credential errors do not count against an endpoint.
+//
+// With a path the latencies and failure counts are kept across reboots;
+// they are written when the preferred endpoint or a health state changes.
+//
+// The network client has to trust the root certificates of both hosts.
+class CloudIoTCoreEndpoints {
+  public:
+    enum {
+      ENDPOINT_PRIMARY,
+      ENDPOINT_LTS,
+      ENDPOINTS
+    };
+
+    CloudIoTCoreEndpoints();
+#if defined(CLOUD_IOT_CORE_ENDPOINTS_FS)
+    // fs must already be mounted.
+    CloudIoTCoreEndpoints(fs::FS &fs, const char *path = "/ciotc_endpoints");
+#elif defined(CLOUD_IOT_CORE_ENDPOINTS_STDIO)
+    CloudIoTCoreEndpoints(const char *path);
+#endif
+
+    // Loads the stored health, false if there was none.
+    bool begin();
+    // Picks the endpoint for the next connect and returns its host.
+    const char *select();
+    // Result of a connect to the endpoint select() returned last.
+    void report(bool ok, unsigned long latency_ms);
+
+    // Per endpoint, for diagnostics. latency is 0 until measured.
+    const char *host(int endpoint);
+    uint32_t latency(int endpoint);
+    uint8_t failures(int endpoint);
+    bool healthy(int endpoint);
+    int current();
+    int preferred();
+
+  private:
+    struct Endpoint {
+      const char *host;
+      uint32_t latency_ms;  // moving average
+      uint8_t failures;     // consecutive
+    };
+    Endpoint endpoints[ENDPOINTS];
+#if defined(CLOUD_IOT_CORE_ENDPOINTS_FS)
+    fs::FS *fs;
+#endif
+    const char *path;
+    uint8_t selected;
+    uint16_t since_probe;
+
+    void save();
+};
+
+#endif  // CloudIoTCoreEndpoints_h
@@ -0,0 +1,260 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <string.h>
+#include "CloudIoTCoreGorilla.h"
+
+#define GORILLA_MAGIC 'G'
+#define GORILLA_HEADER_BITS 32
+#define NO_WINDOW 0xff
+
+GorillaEncoder::GorillaEncoder(uint8_t *_buffer, size_t _size,
+                               uint8_t _columns)
+    : buffer(_buffer), size(_size)
+{
+  columns = _columns < CLOUD_IOT_CORE_GORILLA_COLUMNS
+                ? _columns
+                : CLOUD_IOT_CORE_GORILLA_COLUMNS;
+  reset();
+}
+
+void GorillaEncoder::reset()
+{
+  memset(&state, 0, sizeof(state));
+  bits = 0;
+  if (size >= GORILLA_HEADER_BITS / 8) {
+    buffer[0] = GORILLA_MAGIC;
+    buffer[1] = columns;
+    buffer[2] = 0;
+    buffer[3] = 0;
+    bits = GORILLA_HEADER_BITS;
+  }
+}
+
+// Appends the low n bits of value, most significant first.
+bool GorillaEncoder::put(uint32_t value, uint8_t n)
+{
+  if (bits + n > size * 8) {
+    return false;
+  }
+  while (n > 0) {
+    size_t byte = bits / 8;
+    uint8_t used = bits % 8;
+    if (used == 0) {
+      buffer[byte] = 0;
+    }
+    uint8_t room = 8 - used;
+    uint8_t take = n < room ? n : room;
+    uint8_t chunk = (value >> (n - take)) & ((1 << take) - 1);
+    buffer[byte] |= chunk << (room - take);
+    bits += take;
+    n -= take;
+  }
+  return true;
+}
+
+bool GorillaEncoder::putTimestamp(uint32_t timestamp)
+{
+  int32_t delta = (int32_t)(timestamp - state.timestamp);
+  int32_t dod = delta - state.delta;
+  state.timestamp = timestamp;
+  state.delta = delta;
+
+  if (dod == 0) {
+    return put(0, 1);
+  } else if (dod >= -63 && dod <= 64) {
+    return put(0x2, 2) && put(dod + 63, 7);
+  } else if (dod >= -255 && dod <= 256) {
+    return put(0x6, 3) && put(dod + 255, 9);
+  } else if (dod >= -2047 && dod <= 2048) {
+    return put(0xe, 4) && put(dod + 2047, 12);
+  }
+  return put(0xf, 4) && put((uint32_t)dod, 32);
+}
+
+bool GorillaEncoder::putValue(uint8_t column, uint32_t value)
+{
+  uint32_t x = value ^ state.value[column];
+  state.value[column] = value;
+  if (x == 0) {
+    return put(0, 1);
+  }
+
+  uint8_t leading = __builtin_clz(x);
+  uint8_t trailing = __builtin_ctz(x);
+  uint8_t &window_leading = state.leading[column];
+  uint8_t &window_trailing = state.trailing[column];
+  if (window_leading != NO_WINDOW && leading >= window_leading &&
+      trailing >= window_trailing) {
+    return put(0x2, 2) &&
+           put(x >> window_trailing, 32 - window_leading - window_trailing);
+  }
+
+  uint8_t significant = 32 - leading - trailing;
+  window_leading = leading;
+  window_trailing = trailing;
+  return put(0x3, 2) && put(leading, 5) && put(significant - 1, 5) &&
+         put(x >> trailing, significant);
+}
+
+bool GorillaEncoder::append(uint32_t timestamp, const float *values)
+{
+  if (bits == 0 || state.samples == 0xffff) {
+    return false;
+  }
+
+  // Roll back to here if the sample does not fit.
+  State saved = state;
+  size_t saved_bits = bits;
+  uint8_t saved_byte = buffer[bits / 8 < size ? bits / 8 : 0];
+
+  bool fits;
+  if (state.samples == 0) {
+    state.timestamp = timestamp;
+    fits = put(timestamp, 32);
+    for (uint8_t i = 0; i < columns && fits; i++) {
+      memcpy(&state.value[i], &values[i], 4);
+      state.leading[i] = NO_WINDOW;
+      fits = put(state.value[i], 32);
+    }
+  } else {
+    fits = putTimestamp(timestamp);
+    for (uint8_t i = 0; i < columns && fits; i++) {
+      uint32_t value;
+      memcpy(&value, &values[i], 4);
+      fits = putValue(i, value);
+    }
+  }
+
+  if (!fits) {
+    state = saved;
+    bits = saved_bits;
+    if (bits / 8 < size) {
+      buffer[bits / 8] = saved_byte;
+    }
+    return false;
+  }
+  state.samples++;
+  buffer[2] = state.samples >> 8;
+  buffer[3] = state.samples;
+  return true;
+}
+
+GorillaDecoder::GorillaDecoder(const uint8_t *_data, size_t _length)
+    : data(_data), length(_length), bits(GORILLA_HEADER_BITS), read(0),
+      timestamp(0), delta(0)
+{
+  valid = length >= GORILLA_HEADER_BITS / 8 && data[0] == GORILLA_MAGIC &&
+          data[1] >= 1 && data[1] <= CLOUD_IOT_CORE_GORILLA_COLUMNS;
+  ncolumns = valid ? data[1] : 0;
+  samples = valid ? (data[2] << 8) | data[3] : 0;
+}
+
+bool GorillaDecoder::get(uint8_t n, uint32_t *out)
+{
+  if (bits + n > length * 8) {
+    return false;
+  }
+  uint32_t value = 0;
+  while (n > 0) {
+    uint8_t used = bits % 8;
+    uint8_t room = 8 - used;
+    uint8_t take = n < room ? n : room;
+    uint8_t chunk = (data[bits / 8] >> (room - take)) & ((1 << take) - 1);
+    value = (value << take) | chunk;
+    bits += take;
+    n -= take;
+  }
+  *out = value;
+  return true;
+}
+
+bool GorillaDecoder::next(uint32_t *out_timestamp, float *values)
+{
+  if (!valid || read >= samples) {
+    return false;
+  }
+
+  uint32_t v;
+  if (read == 0) {
+    if (!get(32, &timestamp)) {
+      return false;
+    }
+    for (uint8_t i = 0; i < ncolumns; i++) {
+      if (!get(32, &value[i])) {
+        return false;
+      }
+      leading[i] = NO_WINDOW;
+    }
+  } else {
+    // Count the leading ones of the timestamp prefix, at most four.
+    uint8_t ones = 0;
+    while (ones < 4) {
+      if (!get(1, &v)) {
+        return false;
+      }
+      if (v == 0) {
+        break;
+      }
+      ones++;
+    }
+    static const uint8_t widths[] = {0, 7, 9, 12, 32};
+    static const int32_t bias[] = {0, 63, 255, 2047, 0};
+    int32_t dod = 0;
+    if (ones > 0) {
+      if (!get(widths[ones], &v)) {
+        return false;
+      }
+      dod = (int32_t)v - bias[ones];
+    }
+    delta += dod;
+    timestamp += delta;
+
+    for (uint8_t i = 0; i < ncolumns; i++) {
+      if (!get(1, &v)) {
+        return false;
+      }
+      if (v == 0) {
+        continue;
+      }
+      if (!get(1, &v)) {
+        return false;
+      }
+      if (v == 1) {
+        uint32_t lead, significant;
+        if (!get(5, &lead) || !get(5, &significant) ||
+            lead + significant + 1 > 32) {
+          return false;
+        }
+        leading[i] = lead;
+        trailing[i] = 32 - lead - (significant + 1);
+      } else if (leading[i] == NO_WINDOW) {
+        return false;
+      }
+      uint8_t n = 32 - leading[i] - trailing[i];
+      if (!get(n, &v)) {
+        return false;
+      }
+      value[i] ^= v << trailing[i];
+    }
+  }
+
+  *out_timestamp = timestamp;
+  for (uint8_t i = 0; i < ncolumns; i++) {
+    memcpy(&values[i], &value[i], 4);
+  }
+  read++;
+  return true;
+}
@@ -0,0 +1,113 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreGorilla_h
+#define CloudIoTCoreGorilla_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Most float columns per sample.
+#ifndef CLOUD_IOT_CORE_GORILLA_COLUMNS
+#define CLOUD_IOT_CORE_GORILLA_COLUMNS 8
+#endif
+
+// Time series compression after Facebook's Gorilla (VLDB 2015), for
+// samples of a 32 bit timestamp and up to CLOUD_IOT_CORE_GORILLA_COLUMNS
+// float readings. Regular timestamps cost one bit (delta of delta is 0)
+// and a reading equal to the previous one costs one bit; small changes
+// only store the bits that differ.
+//
+// Layout: 'G', columns, sample count (16 bit big endian), then a bit
+// stream, most significant bit first. The first sample is stored raw,
+// later ones as
+//   timestamp: delta of delta d
+//     0                      '0'
+//     -63..64                '10'   + 7 bits (d + 63)
+//     -255..256              '110'  + 9 bits (d + 255)
+//     -2047..2048            '1110' + 12 bits (d + 2047)
+//     otherwise              '1111' + 32 bits
+//   each column: x = value XOR previous value
+//     x == 0                 '0'
+//     fits previous window   '10' + the window's bits of x
+//     otherwise              '11' + 5 bits leading zeros
+//                            + 5 bits (length - 1) + length bits of x
+class GorillaEncoder {
+  public:
+    GorillaEncoder(uint8_t *buffer, size_t size, uint8_t columns = 1);
+    void reset();
+
+    // False, with nothing written, once the buffer is full. The single
+    // value form is for one column series only, false otherwise.
+    bool append(uint32_t timestamp, const float *values);
+    bool append(uint32_t timestamp, float value) {
+      return columns == 1 && append(timestamp, &value);
+    }
+
+    const uint8_t *data() const { return buffer; }
+    size_t length() const { return (bits + 7) / 8; }
+    uint16_t count() const { return state.samples; }
+
+  private:
+    struct State {
+      uint16_t samples;
+      uint32_t timestamp;
+      int32_t delta;
+      uint32_t value[CLOUD_IOT_CORE_GORILLA_COLUMNS];
+      uint8_t leading[CLOUD_IOT_CORE_GORILLA_COLUMNS];
+      uint8_t trailing[CLOUD_IOT_CORE_GORILLA_COLUMNS];
+    };
+    uint8_t *buffer;
+    size_t size;
+    uint8_t columns;
+    size_t bits;
+    State state;
+
+    bool put(uint32_t value, uint8_t n);
+    bool putTimestamp(uint32_t timestamp);
+    bool putValue(uint8_t column, uint32_t value);
+};
+
+// Reads what GorillaEncoder wrote, e.g. on a host receiving the payload.
+class GorillaDecoder {
+  public:
+    GorillaDecoder(const uint8_t *data, size_t length);
+
+    // False if the header is damaged.
+    bool ok() const { return valid; }
+    uint8_t columns() const { return ncolumns; }
+    uint16_t count() const { return samples; }
+    // values must hold columns() floats. False after the last sample or on
+    // truncated data.
+    bool next(uint32_t *timestamp, float *values);
+
+  private:
+    const uint8_t *data;
+    size_t length;
+    size_t bits;
+    bool valid;
+    uint8_t ncolumns;
+    uint16_t samples;
+    uint16_t read;
+    uint32_t timestamp;
+    int32_t delta;
+    uint32_t value[CLOUD_IOT_CORE_GORILLA_COLUMNS];
+    uint8_t leading[CLOUD_IOT_CORE_GORILLA_COLUMNS];
+    uint8_t trailing[CLOUD_IOT_CORE_GORILLA_COLUMNS];
+
+    bool get(uint8_t n, uint32_t *value);
+};
+
+#endif  // CloudIoTCoreGorilla_h
@@ -0,0 +1,107 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include "CloudIoTCoreIngest.h"
+
+#define INGEST_MASK (CLOUD_IOT_CORE_INGEST_SLOTS - 1)
+
+CloudIoTCoreIngest::CloudIoTCoreIngest()
+    : enqueuePos(0), dequeuePos(0), drops(0)
+{
+  for (uint32_t i = 0; i < CLOUD_IOT_CORE_INGEST_SLOTS; i++) {
+    slots[i].seq = i;
+    slots[i].length = 0;
+  }
+}
+
+CLOUD_IOT_CORE_INGEST_IRAM bool CloudIoTCoreIngest::push(const void *data,
+                                                         size_t length)
+{
+  if (length == 0) {
+    return false;
+  }
+  Slot *slot = NULL;
+  if (length <= CLOUD_IOT_CORE_INGEST_PAYLOAD) {
+    uint32_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    while (true) {
+      Slot *s = &slots[pos & INGEST_MASK];
+      int32_t diff =
+          (int32_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+      if (diff < 0) {
+        break;  // full
+      }
+      if (diff > 0) {
+        // Another producer took this position.
+        pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+        continue;
+      }
+#if CLOUD_IOT_CORE_INGEST_MPSC
+      if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        slot = s;
+        break;
+      }
+#else
+      __atomic_store_n(&enqueuePos, pos + 1, __ATOMIC_RELAXED);
+      slot = s;
+      break;
+#endif
+    }
+  }
+
+  if (slot == NULL) {
+#if CLOUD_IOT_CORE_INGEST_MPSC
+    __atomic_fetch_add(&drops, 1, __ATOMIC_RELAXED);
+#else
+    __atomic_store_n(&drops, __atomic_load_n(&drops, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELAXED);
+#endif
+    return false;
+  }
+  memcpy(slot->data, data, length);
+  slot->length = length;
+  // Hands the slot to the consumer; seq was pos, the claimed position.
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+int CloudIoTCoreIngest::pop(void *out, size_t size)
+{
+  Slot *slot = &slots[dequeuePos & INGEST_MASK];
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != dequeuePos + 1) {
+    return 0;
+  }
+  if (slot->length > size) {
+    return -1;
+  }
+  int length = slot->length;
+  memcpy(out, slot->data, length);
+  // Free for the push one lap later.
+  __atomic_store_n(&slot->seq, dequeuePos + CLOUD_IOT_CORE_INGEST_SLOTS,
+                   __ATOMIC_RELEASE);
+  dequeuePos++;
+  return length;
+}
+
+bool CloudIoTCoreIngest::empty()
+{
+  Slot *slot = &slots[dequeuePos & INGEST_MASK];
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != dequeuePos + 1;
+}
+
+uint32_t CloudIoTCoreIngest::dropped()
+{
+  return __atomic_load_n(&drops, __ATOMIC_RELAXED);
+}
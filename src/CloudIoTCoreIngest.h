@@ -0,0 +1,89 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreIngest_h
+#define CloudIoTCoreIngest_h
+
+#include <Arduino.h>
+
+// Slots in the queue, a power of two, and the largest payload each holds.
+#ifndef CLOUD_IOT_CORE_INGEST_SLOTS
+#define CLOUD_IOT_CORE_INGEST_SLOTS 16
+#endif
+#ifndef CLOUD_IOT_CORE_INGEST_PAYLOAD
+#define CLOUD_IOT_CORE_INGEST_PAYLOAD 48
+#endif
+#if (CLOUD_IOT_CORE_INGEST_SLOTS & (CLOUD_IOT_CORE_INGEST_SLOTS - 1)) != 0
+#error CLOUD_IOT_CORE_INGEST_SLOTS must be a power of two
+#endif
+
+// Several producers need a compare-and-swap, which ESP8266 and AVR only
+// have through libatomic; there push() may be called from one producer
+// (one ISR, or loop() with interrupts as the consumer) at a time.
+#ifndef CLOUD_IOT_CORE_INGEST_MPSC
+#if defined(ESP8266) || defined(__AVR__)
+#define CLOUD_IOT_CORE_INGEST_MPSC 0
+#else
+#define CLOUD_IOT_CORE_INGEST_MPSC 1
+#endif
+#endif
+
+// push() is placed in IRAM on ESP32 and ESP8266, where interrupt handlers
+// must not run from flash. The memcpy it calls is in ROM or IRAM there.
+#if defined(IRAM_ATTR)
+#define CLOUD_IOT_CORE_INGEST_IRAM IRAM_ATTR
+#elif defined(ICACHE_RAM_ATTR)
+#define CLOUD_IOT_CORE_INGEST_IRAM ICACHE_RAM_ATTR
+#else
+#define CLOUD_IOT_CORE_INGEST_IRAM
+#endif
+
+// Bounded lock-free queue of telemetry payloads for producers that cannot
+// publish themselves: interrupt handlers, or other threads on a Linux
+// gateway. push() copies into a fixed slot and never blocks or allocates;
+// a full queue drops the payload and counts it.
+//
+// Attach it with CloudIoTCoreMqtt::setIngest(); poll() then pops up to
+// CLOUD_IOT_CORE_INGEST_DRAIN payloads each call into
+// publishTelemetry(data, length). Only one context may pop.
+class CloudIoTCoreIngest {
+  public:
+    CloudIoTCoreIngest();
+
+    // Safe from interrupt handlers. False if length is 0 or more than
+    // CLOUD_IOT_CORE_INGEST_PAYLOAD, or the queue is full.
+    bool push(const void *data, size_t length);
+    // Copies the oldest payload to out and returns its length, 0 if the
+    // queue is empty and -1 if out is too small (the payload stays).
+    int pop(void *out, size_t size);
+    bool empty();
+    // Payloads push() could not queue.
+    uint32_t dropped();
+
+  private:
+    // seq says whose turn a slot is: equal to the enqueue position it is
+    // free for that push, one more it holds that push's payload.
+    struct Slot {
+      uint32_t seq;
+      uint16_t length;
+      uint8_t data[CLOUD_IOT_CORE_INGEST_PAYLOAD];
+    };
+    uint32_t enqueuePos;
+    uint32_t dequeuePos;
+    uint32_t drops;
+    Slot slots[CLOUD_IOT_CORE_INGEST_SLOTS];
+};
+
+#endif  // CloudIoTCoreIngest_h
@@ -0,0 +1,101 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include "CloudIoTCoreLog.h"
+
+static size_t serial_output(const char *data, size_t length)
+{
+  int room = Serial.availableForWrite();
+  if (room <= 0) {
+    return 0;
+  }
+  if ((size_t)room < length) {
+    length = room;
+  }
+  return Serial.write((const uint8_t *)data, length);
+}
+
+static LogOutput output = serial_output;
+static char ring[CLOUD_IOT_CORE_LOG_BUFFER];
+static size_t head = 0;  // next byte written
+static size_t tail = 0;  // next byte handed to the output
+static size_t used = 0;
+static unsigned long dropped = 0;
+
+void ciotc_log_set_output(LogOutput _output)
+{
+  output = _output;
+}
+
+void ciotc_log(int level, const char *format, ...)
+{
+  static const char prefix[] = "?EWID";
+  char line[CLOUD_IOT_CORE_LOG_LINE];
+
+  line[0] = prefix[level < 0 || level > 4 ? 0 : level];
+  line[1] = ':';
+  line[2] = ' ';
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(line + 3, sizeof(line) - 5, format, args);
+  va_end(args);
+  if (n < 0) {
+    return;
+  }
+  size_t length = 3 + ((size_t)n < sizeof(line) - 5 ? n : sizeof(line) - 6);
+  line[length++] = '\r';
+  line[length++] = '\n';
+
+  if (length > CLOUD_IOT_CORE_LOG_BUFFER - used) {
+    ciotc_log_flush();
+  }
+  if (length > CLOUD_IOT_CORE_LOG_BUFFER - used) {
+    dropped++;
+    return;
+  }
+  for (size_t i = 0; i < length; i++) {
+    ring[head] = line[i];
+    head = (head + 1) % CLOUD_IOT_CORE_LOG_BUFFER;
+  }
+  used += length;
+  ciotc_log_flush();
+}
+
+void ciotc_log_flush()
+{
+  if (output == NULL) {
+    head = tail = used = 0;
+    return;
+  }
+  while (used > 0) {
+    size_t chunk = CLOUD_IOT_CORE_LOG_BUFFER - tail;
+    if (chunk > used) {
+      chunk = used;
+    }
+    size_t n = output(ring + tail, chunk);
+    if (n == 0) {
+      break;
+    }
+    tail = (tail + n) % CLOUD_IOT_CORE_LOG_BUFFER;
+    used -= n;
+  }
+}
+
+unsigned long ciotc_log_dropped()
+{
+  return dropped;
+}
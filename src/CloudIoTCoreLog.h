@@ -0,0 +1,84 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreLog_h
+#define CloudIoTCoreLog_h
+
+#include <stddef.h>
+
+// Library logging. Messages below CLOUD_IOT_CORE_LOG_LEVEL compile to
+// nothing, arguments included. The rest are formatted into a ring buffer
+// and written out only as fast as the output accepts them, so logging never
+// waits on a slow UART. Anything left over is written by later log calls or
+// by ciotc_log_flush(), which can be called from loop().
+//
+// Set the level with a build flag, e.g. -DCLOUD_IOT_CORE_LOG_LEVEL=4.
+#define CLOUD_IOT_CORE_LOG_NONE 0
+#define CLOUD_IOT_CORE_LOG_ERROR 1
+#define CLOUD_IOT_CORE_LOG_WARN 2
+#define CLOUD_IOT_CORE_LOG_INFO 3
+#define CLOUD_IOT_CORE_LOG_DEBUG 4
+
+#ifndef CLOUD_IOT_CORE_LOG_LEVEL
+#define CLOUD_IOT_CORE_LOG_LEVEL CLOUD_IOT_CORE_LOG_INFO
+#endif
+
+// Ring buffer size and longest single message, bytes.
+#ifndef CLOUD_IOT_CORE_LOG_BUFFER
+#define CLOUD_IOT_CORE_LOG_BUFFER 512
+#endif
+#ifndef CLOUD_IOT_CORE_LOG_LINE
+#define CLOUD_IOT_CORE_LOG_LINE 300
+#endif
+
+#if CLOUD_IOT_CORE_LOG_LEVEL >= CLOUD_IOT_CORE_LOG_ERROR
+#define ciotc_log_error(...) ciotc_log(CLOUD_IOT_CORE_LOG_ERROR, __VA_ARGS__)
+#else
+#define ciotc_log_error(...) do {} while (0)
+#endif
+#if CLOUD_IOT_CORE_LOG_LEVEL >= CLOUD_IOT_CORE_LOG_WARN
+#define ciotc_log_warn(...) ciotc_log(CLOUD_IOT_CORE_LOG_WARN, __VA_ARGS__)
+#else
+#define ciotc_log_warn(...) do {} while (0)
+#endif
+#if CLOUD_IOT_CORE_LOG_LEVEL >= CLOUD_IOT_CORE_LOG_INFO
+#define ciotc_log_info(...) ciotc_log(CLOUD_IOT_CORE_LOG_INFO, __VA_ARGS__)
+#else
+#define ciotc_log_info(...) do {} while (0)
+#endif
+#if CLOUD_IOT_CORE_LOG_LEVEL >= CLOUD_IOT_CORE_LOG_DEBUG
+#define ciotc_log_debug(...) ciotc_log(CLOUD_IOT_CORE_LOG_DEBUG, __VA_ARGS__)
+#else
+#define ciotc_log_debug(...) do {} while (0)
+#endif
+
+// Writes up to length bytes without blocking and returns how many it took.
+// The default output writes to Serial within availableForWrite().
+typedef size_t (*LogOutput)(const char *data, size_t length);
+
+// Replaces the output, NULL discards everything.
+void ciotc_log_set_output(LogOutput output);
+
+// printf style, one line per call. Use the level macros above instead.
+void ciotc_log(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Hands buffered bytes to the output until it stops accepting them.
+void ciotc_log_flush();
+
+// Messages dropped because the ring buffer was full.
+unsigned long ciotc_log_dropped();
+
+#endif  // CloudIoTCoreLog_h
@@ -0,0 +1,156 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <string.h>
+#include "CloudIoTCoreLz.h"
+
+LzEncoder::LzEncoder() : start(0), end(0), bits(0), nbits(0) {}
+
+void LzEncoder::put(uint16_t value, uint8_t n)
+{
+  while (n > 0) {
+    uint8_t take = n < 8 ? n : 8;
+    n -= take;
+    bits = (bits << take) | ((value >> n) & ((1 << take) - 1));
+    nbits += take;
+    if (nbits >= 8) {
+      nbits -= 8;
+      out[written++] = bits >> nbits;
+    }
+  }
+}
+
+// Encodes the byte at start as a literal or the longest match it begins.
+void LzEncoder::step()
+{
+  size_t limit = end - start < LZ_MAX_MATCH ? end - start : LZ_MAX_MATCH;
+  size_t best_length = 0;
+  size_t best_distance = 0;
+  size_t first = start > LZ_WINDOW ? start - LZ_WINDOW : 0;
+  const uint8_t *here = buffer + start;
+
+  for (size_t candidate = first; candidate < start; candidate++) {
+    if (buffer[candidate] != here[0]) {
+      continue;
+    }
+    // May run past start into the bytes being encoded, the decoder copies
+    // byte by byte so overlapping references work.
+    size_t length = 1;
+    while (length < limit && buffer[candidate + length] == here[length]) {
+      length++;
+    }
+    if (length > best_length) {
+      best_length = length;
+      best_distance = start - candidate;
+      if (length == limit) {
+        break;
+      }
+    }
+  }
+
+  if (best_length >= LZ_MIN_MATCH) {
+    put(0, 1);
+    put(best_distance - 1, LZ_WINDOW_BITS);
+    put(best_length - LZ_MIN_MATCH, LZ_LENGTH_BITS);
+    start += best_length;
+  } else {
+    put(0x100 | here[0], 9);
+    start++;
+  }
+}
+
+size_t LzEncoder::update(const uint8_t *in, size_t len, uint8_t *_out)
+{
+  out = _out;
+  written = 0;
+  while (len > 0) {
+    if (end == sizeof(buffer)) {
+      // Keep one window of history before start.
+      size_t drop = start - LZ_WINDOW;
+      memmove(buffer, buffer + drop, end - drop);
+      start -= drop;
+      end -= drop;
+    }
+    size_t take = sizeof(buffer) - end;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(buffer + end, in, take);
+    end += take;
+    in += take;
+    len -= take;
+    // Only encode with a full lookahead so matches are not cut short.
+    while (end - start >= LZ_MAX_MATCH) {
+      step();
+    }
+  }
+  return written;
+}
+
+size_t LzEncoder::final(uint8_t *_out)
+{
+  out = _out;
+  written = 0;
+  while (start < end) {
+    step();
+  }
+  if (nbits > 0) {
+    out[written++] = bits << (8 - nbits);
+  }
+  start = end = 0;
+  bits = 0;
+  nbits = 0;
+  return written;
+}
+
+static uint32_t read_bits(const uint8_t *in, size_t *pos, int count)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < count; i++, (*pos)++) {
+    value = (value << 1) | ((in[*pos / 8] >> (7 - *pos % 8)) & 1);
+  }
+  return value;
+}
+
+int lz_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t size)
+{
+  size_t total = len * 8;
+  size_t pos = 0;
+  size_t n = 0;
+
+  // Anything shorter than a literal is padding.
+  while (total - pos >= 9) {
+    if (read_bits(in, &pos, 1)) {
+      if (n >= size) {
+        return -1;
+      }
+      out[n++] = read_bits(in, &pos, 8);
+      continue;
+    }
+    if (total - pos < LZ_WINDOW_BITS + LZ_LENGTH_BITS) {
+      // Zero padding after the last item.
+      break;
+    }
+    size_t distance = read_bits(in, &pos, LZ_WINDOW_BITS) + 1;
+    size_t length = read_bits(in, &pos, LZ_LENGTH_BITS) + LZ_MIN_MATCH;
+    if (distance > n || length > size - n) {
+      return -1;
+    }
+    for (size_t i = 0; i < length; i++, n++) {
+      out[n] = out[n - distance];
+    }
+  }
+  return n;
+}
@@ -0,0 +1,73 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreLz_h
+#define CloudIoTCoreLz_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// LZSS compression in the style of heatshrink: a 2^LZ_WINDOW_BITS byte
+// window and matches of LZ_MIN_MATCH..LZ_MAX_MATCH bytes. The encoder
+// needs LZ_WINDOW + LZ_MAX_MATCH bytes of state, 273 by default.
+//
+// Bit stream, most significant bit first, zero padded to a byte:
+//   '1' + 8 bits                   literal byte
+//   '0' + LZ_WINDOW_BITS bits      back reference, distance - 1
+//       + LZ_LENGTH_BITS bits      length - LZ_MIN_MATCH
+#ifndef LZ_WINDOW_BITS
+#define LZ_WINDOW_BITS 8
+#endif
+#ifndef LZ_LENGTH_BITS
+#define LZ_LENGTH_BITS 4
+#endif
+#define LZ_WINDOW (1 << LZ_WINDOW_BITS)
+#define LZ_MIN_MATCH 2
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + (1 << LZ_LENGTH_BITS) - 1)
+
+// Upper bound for the output of one update() or final() call given n
+// input bytes; incompressible data grows by 1/8.
+#define LZ_OUTPUT_MAX(n) \
+  ((n) + LZ_MAX_MATCH + ((n) + LZ_MAX_MATCH) / 8 + 2)
+
+// Streaming encoder, input may be split at arbitrary byte boundaries.
+class LzEncoder {
+  public:
+    LzEncoder();
+    // Returns the number of bytes written to out, at most LZ_OUTPUT_MAX(len).
+    size_t update(const uint8_t *in, size_t len, uint8_t *out);
+    // Encodes what is still buffered and pads the last byte, then starts
+    // over for the next stream.
+    size_t final(uint8_t *out);
+
+  private:
+    uint8_t buffer[LZ_WINDOW + LZ_MAX_MATCH];
+    size_t start;  // next byte to encode, history is before it
+    size_t end;
+    uint16_t bits;
+    uint8_t nbits;
+    uint8_t *out;
+    size_t written;
+
+    void step();
+    void put(uint16_t value, uint8_t n);
+};
+
+// Decompresses a whole stream into out, also builds on the host (only needs
+// the C library) for the subscriber side. Returns the decompressed length or
+// -1 if out is too small or the input is malformed.
+int lz_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t size);
+
+#endif  // CloudIoTCoreLz_h
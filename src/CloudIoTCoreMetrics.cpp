@@ -0,0 +1,135 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include "CloudIoTCoreMetrics.h"
+
+#if CLOUD_IOT_CORE_METRICS
+
+#include <string.h>
+#include "CloudIoTCoreCbor.h"
+
+struct Histogram {
+  uint32_t count;
+  uint32_t sum;
+  uint32_t max;
+  uint32_t buckets[CLOUD_IOT_CORE_METRICS_BUCKETS];
+};
+
+static uint32_t counters[CIOTC_COUNTERS];
+static int32_t gauges[CIOTC_GAUGES];
+static Histogram histograms[CIOTC_HISTOGRAMS];
+static uint32_t errors[CLOUD_IOT_CORE_METRICS_ERRORS];
+
+void ciotc_metric_count(int counter, uint32_t n)
+{
+  if (counter >= 0 && counter < CIOTC_COUNTERS) {
+    counters[counter] += n;
+  }
+}
+
+void ciotc_metric_gauge(int gauge, int32_t value)
+{
+  if (gauge >= 0 && gauge < CIOTC_GAUGES) {
+    gauges[gauge] = value;
+  }
+}
+
+void ciotc_metric_observe(int histogram, uint32_t value)
+{
+  if (histogram < 0 || histogram >= CIOTC_HISTOGRAMS) {
+    return;
+  }
+  Histogram &h = histograms[histogram];
+  int bucket = 0;
+  for (uint32_t v = value; v != 0 && bucket < CLOUD_IOT_CORE_METRICS_BUCKETS - 1;
+       v >>= 1) {
+    bucket++;
+  }
+  h.buckets[bucket]++;
+  h.count++;
+  h.sum += value;
+  if (value > h.max) {
+    h.max = value;
+  }
+}
+
+void ciotc_metric_error(int code)
+{
+  gauges[CIOTC_GAUGE_LAST_ERROR] = code;
+  int index = code < 0 ? -code : code;
+  if (index < CLOUD_IOT_CORE_METRICS_ERRORS) {
+    errors[index]++;
+  }
+}
+
+uint32_t ciotc_metric_counter(int counter)
+{
+  return counter >= 0 && counter < CIOTC_COUNTERS ? counters[counter] : 0;
+}
+
+int32_t ciotc_metric_gauge_value(int gauge)
+{
+  return gauge >= 0 && gauge < CIOTC_GAUGES ? gauges[gauge] : 0;
+}
+
+size_t ciotc_metrics_write(uint8_t *out, size_t size)
+{
+  CborWriter cbor(out, size);
+  cbor.beginMap(4);
+
+  cbor.key("c").beginArray(CIOTC_COUNTERS);
+  for (int i = 0; i < CIOTC_COUNTERS; i++) {
+    cbor.addUint(counters[i]);
+  }
+  cbor.key("g").beginArray(CIOTC_GAUGES);
+  for (int i = 0; i < CIOTC_GAUGES; i++) {
+    cbor.addInt(gauges[i]);
+  }
+
+  cbor.key("h").beginArray(CIOTC_HISTOGRAMS);
+  for (int i = 0; i < CIOTC_HISTOGRAMS; i++) {
+    const Histogram &h = histograms[i];
+    int used = CLOUD_IOT_CORE_METRICS_BUCKETS;
+    while (used > 0 && h.buckets[used - 1] == 0) {
+      used--;
+    }
+    cbor.beginArray(3 + used).addUint(h.count).addUint(h.sum).addUint(h.max);
+    for (int b = 0; b < used; b++) {
+      cbor.addUint(h.buckets[b]);
+    }
+  }
+
+  int seen = 0;
+  for (int i = 0; i < CLOUD_IOT_CORE_METRICS_ERRORS; i++) {
+    seen += errors[i] != 0;
+  }
+  cbor.key("e").beginMap(seen);
+  for (int i = 0; i < CLOUD_IOT_CORE_METRICS_ERRORS; i++) {
+    if (errors[i] != 0) {
+      cbor.addInt(-i).addUint(errors[i]);
+    }
+  }
+  return cbor.ok() ? cbor.length() : 0;
+}
+
+void ciotc_metrics_reset()
+{
+  memset(counters, 0, sizeof(counters));
+  memset(gauges, 0, sizeof(gauges));
+  memset(histograms, 0, sizeof(histograms));
+  memset(errors, 0, sizeof(errors));
+}
+
+#endif  // CLOUD_IOT_CORE_METRICS
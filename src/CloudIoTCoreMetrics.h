@@ -0,0 +1,112 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreMetrics_h
+#define CloudIoTCoreMetrics_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Library metrics: counters, gauges and histograms with log2 buckets, all
+// in static memory. The library updates the built in ones below, apps can
+// reserve more with CLOUD_IOT_CORE_METRICS_USER_* and use the ids from
+// CIOTC_COUNTER_USER and so on. Each metric must only be updated from one
+// task, reads from others may see a torn histogram.
+//
+// Build with -DCLOUD_IOT_CORE_METRICS=0 to turn all of it into no-ops.
+#ifndef CLOUD_IOT_CORE_METRICS
+#define CLOUD_IOT_CORE_METRICS 1
+#endif
+#ifndef CLOUD_IOT_CORE_METRICS_USER_COUNTERS
+#define CLOUD_IOT_CORE_METRICS_USER_COUNTERS 0
+#endif
+#ifndef CLOUD_IOT_CORE_METRICS_USER_GAUGES
+#define CLOUD_IOT_CORE_METRICS_USER_GAUGES 0
+#endif
+#ifndef CLOUD_IOT_CORE_METRICS_USER_HISTOGRAMS
+#define CLOUD_IOT_CORE_METRICS_USER_HISTOGRAMS 0
+#endif
+// Bucket 0 counts zeros, bucket i values in [2^(i-1), 2^i), the last one
+// everything above. 24 buckets reach 8 seconds in microseconds.
+#ifndef CLOUD_IOT_CORE_METRICS_BUCKETS
+#define CLOUD_IOT_CORE_METRICS_BUCKETS 24
+#endif
+// lwmqtt error codes counted, by their negated value.
+#define CLOUD_IOT_CORE_METRICS_ERRORS 16
+
+enum {
+  CIOTC_COUNTER_JWT_SIGNS,
+  CIOTC_COUNTER_CONNECT_ATTEMPTS,
+  CIOTC_COUNTER_CONNECTS,
+  CIOTC_COUNTER_BACKOFFS,
+  CIOTC_COUNTER_PUBLISHES,
+  CIOTC_COUNTER_PUBLISH_BYTES,
+  CIOTC_COUNTER_PUBLISH_FAILURES,
+  CIOTC_COUNTER_SESSIONS_RESUMED,  // connects that skipped subscribing
+  CIOTC_COUNTER_USER,
+  CIOTC_COUNTERS = CIOTC_COUNTER_USER + CLOUD_IOT_CORE_METRICS_USER_COUNTERS
+};
+
+enum {
+  CIOTC_GAUGE_LAST_ERROR,   // lwmqtt lastError() of the last failure
+  CIOTC_GAUGE_RETURN_CODE,  // CONNACK return code of the last failure
+  CIOTC_GAUGE_BACKOFF_MS,   // current backoff
+  CIOTC_GAUGE_USER,
+  CIOTC_GAUGES = CIOTC_GAUGE_USER + CLOUD_IOT_CORE_METRICS_USER_GAUGES
+};
+
+enum {
+  CIOTC_HISTOGRAM_JWT_SIGN_US,   // CPU time of one signature
+  CIOTC_HISTOGRAM_CONNECT_MS,    // start of a connect to subscribed
+  CIOTC_HISTOGRAM_SUBSCRIBE_MS,
+  CIOTC_HISTOGRAM_BACKOFF_MS,
+  CIOTC_HISTOGRAM_PUBLISH_US,    // time in the publish call
+  CIOTC_HISTOGRAM_USER,
+  CIOTC_HISTOGRAMS = CIOTC_HISTOGRAM_USER + CLOUD_IOT_CORE_METRICS_USER_HISTOGRAMS
+};
+
+#if CLOUD_IOT_CORE_METRICS
+
+void ciotc_metric_count(int counter, uint32_t n = 1);
+void ciotc_metric_gauge(int gauge, int32_t value);
+void ciotc_metric_observe(int histogram, uint32_t value);
+// Counts an lwmqtt error code and keeps it in CIOTC_GAUGE_LAST_ERROR.
+void ciotc_metric_error(int code);
+
+uint32_t ciotc_metric_counter(int counter);
+int32_t ciotc_metric_gauge_value(int gauge);
+
+// Writes everything as CBOR:
+//   {"c": [counters], "g": [gauges],
+//    "h": [[count, sum, max, bucket0, ...], ...], "e": {code: count}}
+// with trailing empty buckets left out and only codes seen in "e".
+// Returns the length, 0 if it did not fit.
+size_t ciotc_metrics_write(uint8_t *out, size_t size);
+void ciotc_metrics_reset();
+
+#else
+
+inline void ciotc_metric_count(int, uint32_t = 1) {}
+inline void ciotc_metric_gauge(int, int32_t) {}
+inline void ciotc_metric_observe(int, uint32_t) {}
+inline void ciotc_metric_error(int) {}
+inline uint32_t ciotc_metric_counter(int) { return 0; }
+inline int32_t ciotc_metric_gauge_value(int) { return 0; }
+inline size_t ciotc_metrics_write(uint8_t *, size_t) { return 0; }
+inline void ciotc_metrics_reset() {}
+
+#endif
+
+#endif  // CloudIoTCoreMetrics_h
@@ -13,22 +13,36 @@
  * limitations under the License.
  *****************************************************************************/
 #include "CloudIoTCoreMqtt.h"
+#include "CloudIoTCoreLog.h"
+#include "CloudIoTCoreMetrics.h"
 
 #include <cstring>
 
 // Forward global callback declarations
 extern void messageReceived(String &topic, String &payload);
 
+// Maps the MQTTClient of a message back to its CloudIoTCoreMqtt.
+static CloudIoTCoreMqtt *instances[CLOUD_IOT_CORE_INSTANCES];
+
+LzEncoder CloudIoTCoreMqtt::lzEncoder;
+uint8_t CloudIoTCoreMqtt::lzOutput[LZ_OUTPUT_MAX(CLOUD_IOT_CORE_LZ_PAYLOAD_MAX)];
+
 
 ///////////////////////////////
 // MQTT common functions
 ///////////////////////////////
 CloudIoTCoreMqtt::CloudIoTCoreMqtt(
     MQTTClient *_mqttClient, Client *_netClient, CloudIoTCoreDevice *_device)
+    : transport(_netClient)
 {
   this->mqttClient = _mqttClient;
   this->netClient = _netClient;
   this->device = _device;
+  for (int i = 0; i < CLOUD_IOT_CORE_QOS1_WINDOW; i++) {
+    this->inFlight[i].id = 0;
+  }
+  this->transport.onPuback(pubackReceived, this);
+  this->transport.onPacketId(packetIdSent, this);
 }
 
 void CloudIoTCoreMqtt::setLogConnect(boolean enabled)
@@ -41,19 +55,86 @@ void CloudIoTCoreMqtt::setUseLts(boolean enabled)
   this->useLts = enabled;
 }
 
+void CloudIoTCoreMqtt::setPersistentSession(boolean enabled)
+{
+  this->persistentSession = enabled;
+  this->mqttClient->setCleanSession(!enabled);
+}
+
+void CloudIoTCoreMqtt::setEndpoints(CloudIoTCoreEndpoints *_endpoints)
+{
+  this->endpoints = _endpoints;
+}
+
+void CloudIoTCoreMqtt::setBatch(CloudIoTCoreBatch *_batch)
+{
+  this->batch = _batch;
+}
+
+void CloudIoTCoreMqtt::setAggregate(CloudIoTCoreAggregate *_aggregate)
+{
+  this->aggregate = _aggregate;
+}
+
+void CloudIoTCoreMqtt::setScheduler(CloudIoTCoreScheduler *_scheduler)
+{
+  this->scheduler = _scheduler;
+}
+
+void CloudIoTCoreMqtt::setStateSlot(CloudIoTCoreStateSlot *slot)
+{
+  this->stateSlot = slot;
+}
+
+void CloudIoTCoreMqtt::setCoalescer(CloudIoTCoreCoalescer *coalescer)
+{
+  this->transport.setCoalescer(coalescer);
+}
+
+bool CloudIoTCoreMqtt::flushWrites()
+{
+  return this->transport.flushWrites();
+}
+
+void CloudIoTCoreMqtt::setIngest(CloudIoTCoreIngest *_ingest)
+{
+  this->ingest = _ingest;
+}
+
+void CloudIoTCoreMqtt::setSpool(CloudIoTCoreSpool *_spool, unsigned long replay_interval_ms)
+{
+  this->spool = _spool;
+  this->replayInterval = replay_interval_ms;
+}
+
 void CloudIoTCoreMqtt::startMQTT()
 {
   if (this->useLts) {
-    //TODO: Debugging
-    //Serial.println("Connect with " + String(CLOUD_IOT_CORE_MQTT_HOST_LTS) + ":" + String(CLOUD_IOT_CORE_MQTT_PORT));
-    this->mqttClient->begin(CLOUD_IOT_CORE_MQTT_HOST_LTS, CLOUD_IOT_CORE_MQTT_PORT, *netClient);
+    this->host = CLOUD_IOT_CORE_MQTT_HOST_LTS;
   }
   else {
-    //TODO: Debugging
-    //Serial.println("Connect with " + String(CLOUD_IOT_CORE_MQTT_HOST_LTS) + ":" + String(CLOUD_IOT_CORE_MQTT_PORT));
-    this->mqttClient->begin(CLOUD_IOT_CORE_MQTT_HOST, CLOUD_IOT_CORE_MQTT_PORT, *netClient);
+    this->host = CLOUD_IOT_CORE_MQTT_HOST;
+  }
+  ciotc_log_debug("Connect with %s:%d", this->host, CLOUD_IOT_CORE_MQTT_PORT);
+  this->mqttClient->begin(this->host, CLOUD_IOT_CORE_MQTT_PORT, transport);
+
+  // Without the "/#" the commands topic is also the prefix of every
+  // command, with or without a subfolder.
+  this->commandsPrefixLength = strlen(device->getCommandsTopic()) - 2;
+  int slot = -1;
+  for (int i = 0; i < CLOUD_IOT_CORE_INSTANCES; i++) {
+    if (instances[i] == this || (slot < 0 && instances[i] == NULL)) {
+      slot = i;
+    }
   }
-  this->mqttClient->onMessage(messageReceived);
+  if (slot < 0) {
+    ciotc_log_error("more than %d instances, messages are not routed",
+                    CLOUD_IOT_CORE_INSTANCES);
+    this->mqttClient->onMessage(messageReceived);
+    return;
+  }
+  instances[slot] = this;
+  this->mqttClient->onMessageAdvanced(messageArrived);
 }
 
 // bool CloudIoTCoreMqtt::publishTelemetry(String data)
@@ -65,17 +146,272 @@ void CloudIoTCoreMqtt::startMQTT()
 
 bool CloudIoTCoreMqtt::publishTelemetry(const char* data, int length)
 {
-  char topic[64];
-  device->getEventsTopic(topic);
-  return this->mqttClient->publish(topic, data, length);
+  if (this->batch == NULL) {
+    return publishEvents(data, length);
+  }
+
+  if (!this->batch->fits(length) && !flushTelemetry()) {
+    return false;
+  }
+  if (!this->batch->add(data, length)) {
+    ciotc_log_error("sample of %d bytes does not fit a batch", length);
+    return false;
+  }
+  if (this->batch->due()) {
+    flushTelemetry();
+  }
+  return true;
+}
+
+// Binary payloads go to a subfolder, a batch would wrap them in JSON.
+bool CloudIoTCoreMqtt::publishTelemetry(const CborWriter &cbor, const char* subfolder)
+{
+  if (!cbor.ok()) {
+    ciotc_log_error("CBOR payload does not fit its buffer");
+    return false;
+  }
+  return publishTelemetry(subfolder, (const char*)cbor.data(), cbor.length());
+}
+
+bool CloudIoTCoreMqtt::publishTelemetry(const GorillaEncoder &series, const char* subfolder)
+{
+  if (series.count() == 0) {
+    return true;
+  }
+  return publishTelemetry(subfolder, (const char*)series.data(), series.length());
+}
+
+bool CloudIoTCoreMqtt::publishTelemetryCompressed(const char* data, int length)
+{
+  if (length < 0 || length > CLOUD_IOT_CORE_LZ_PAYLOAD_MAX) {
+    ciotc_log_error("payload of %d bytes is too long to compress", length);
+    return false;
+  }
+  // final() leaves the encoder ready for the next call.
+  size_t n = lzEncoder.update((const uint8_t*)data, length, lzOutput);
+  n += lzEncoder.final(lzOutput + n);
+  if (n >= (size_t)length) {
+    return publishTelemetry(data, length);
+  }
+  return publishTelemetry(CLOUD_IOT_CORE_LZ_SUBFOLDER, (const char*)lzOutput, n);
+}
+
+bool CloudIoTCoreMqtt::flushTelemetry()
+{
+  if (this->batch == NULL || this->batch->count() == 0) {
+    return true;
+  }
+  if (!publishEvents(this->batch->data(), this->batch->length())) {
+    return false;
+  }
+  this->batch->clear();
+  return true;
+}
+
+void CloudIoTCoreMqtt::publishAggregate()
+{
+  char report[CLOUD_IOT_CORE_AGGREGATE_PAYLOAD];
+  int length = this->aggregate->write(report, sizeof(report));
+  if (length < 0) {
+    ciotc_log_error("aggregate report longer than %d bytes",
+                    CLOUD_IOT_CORE_AGGREGATE_PAYLOAD);
+    this->aggregate->clear();
+  } else if (length > 0) {
+    publishTelemetry(report, length);
+  }
+}
+
+void CloudIoTCoreMqtt::drainIngest()
+{
+  char payload[CLOUD_IOT_CORE_INGEST_PAYLOAD];
+  for (int i = 0; i < CLOUD_IOT_CORE_INGEST_DRAIN; i++) {
+    int length = this->ingest->pop(payload, sizeof(payload));
+    if (length <= 0) {
+      break;
+    }
+    publishTelemetry(payload, length);
+  }
+}
+
+// QoS 0 publishes through lwmqtt all go through here to be counted.
+bool CloudIoTCoreMqtt::sendPublish(const char* topic, const char* data, int length)
+{
+  unsigned long start = micros();
+  bool ok = this->mqttClient->publish(topic, data, length);
+  countPublish(ok, length, micros() - start);
+  return ok;
+}
+
+void CloudIoTCoreMqtt::countPublish(bool ok, size_t length, unsigned long elapsed_us)
+{
+  ciotc_metric_observe(CIOTC_HISTOGRAM_PUBLISH_US, elapsed_us);
+  if (ok) {
+    ciotc_metric_count(CIOTC_COUNTER_PUBLISHES);
+    ciotc_metric_count(CIOTC_COUNTER_PUBLISH_BYTES, length);
+  } else {
+    ciotc_metric_count(CIOTC_COUNTER_PUBLISH_FAILURES);
+  }
+}
+
+bool CloudIoTCoreMqtt::publishMetrics(const char* subfolder)
+{
+  uint8_t buffer[CLOUD_IOT_CORE_METRICS_PAYLOAD];
+  size_t length = ciotc_metrics_write(buffer, sizeof(buffer));
+  if (length == 0) {
+    return false;
+  }
+  return publishTelemetry(subfolder, (const char*)buffer, length);
+}
+
+void CloudIoTCoreMqtt::setMetricsInterval(unsigned long interval_ms, const char* subfolder)
+{
+  this->metricsInterval = interval_ms;
+  this->metricsSubfolder = subfolder;
+  this->lastMetrics = millis();
+}
+
+bool CloudIoTCoreMqtt::publishEvents(const char* data, int length)
+{
+  // New telemetry queues behind a backlog so it all arrives in order.
+  if (this->spool != NULL && this->spool->depth() > 0 &&
+      this->spool->push(data, length)) {
+    return true;
+  }
+  if (this->scheduler != NULL) {
+    if ((this->spool == NULL || this->mqttClient->connected()) &&
+        this->scheduler->push(CloudIoTCoreScheduler::CLASS_TELEMETRY,
+                              CloudIoTCoreScheduler::LANE_NORMAL,
+                              device->getEventsTopic(), data, length)) {
+      return true;
+    }
+    return this->spool != NULL && this->spool->push(data, length);
+  }
+  if (this->spool == NULL) {
+    return sendPublish(device->getEventsTopic(), data, length);
+  }
+  if (this->mqttClient->connected() &&
+      sendPublish(device->getEventsTopic(), data, length)) {
+    return true;
+  }
+  return this->spool->push(data, length);
+}
+
+void CloudIoTCoreMqtt::replaySpool()
+{
+  if (this->spool == NULL || this->spool->depth() == 0 ||
+      !this->mqttClient->connected() ||
+      millis() - this->lastReplay < this->replayInterval) {
+    return;
+  }
+  this->lastReplay = millis();
+
+  // Bulk lane: only when nothing else is queued and within the telemetry
+  // rate.
+  if (this->scheduler != NULL && this->scheduler->depth() > 0) {
+    return;
+  }
+  char data[CLOUD_IOT_CORE_SPOOL_RECORD_MAX];
+  unsigned long start = millis();
+  do {
+    int length = this->spool->peek(data, sizeof(data));
+    if (length <= 0 ||
+        (this->scheduler != NULL &&
+         !this->scheduler->take(CloudIoTCoreScheduler::CLASS_TELEMETRY)) ||
+        !sendPublish(device->getEventsTopic(), data, length)) {
+      return;
+    }
+    this->spool->commit();
+  } while (millis() - start < CLOUD_IOT_CORE_SPOOL_REPLAY_MS);
+}
+
+// The newest state, if it changed and the state class has a token. It
+// goes around the scheduler queue, which would hold a copy.
+void CloudIoTCoreMqtt::publishStateSlot()
+{
+  if (!this->stateSlot->due() ||
+      (this->scheduler != NULL &&
+       !this->scheduler->take(CloudIoTCoreScheduler::CLASS_STATE))) {
+    return;
+  }
+  if (sendPublish(device->getStateTopic(), this->stateSlot->data(),
+                  this->stateSlot->length())) {
+    this->stateSlot->sent();
+  }
+}
+
+// Sends what the rate limits allow, a few messages per poll().
+void CloudIoTCoreMqtt::drainScheduler()
+{
+  for (int i = 0; i < CLOUD_IOT_CORE_SCHED_SLOTS; i++) {
+    CloudIoTCoreScheduler::Message *message = this->scheduler->peek();
+    if (message == NULL ||
+        !sendPublish(message->topic, message->payload, message->length)) {
+      return;
+    }
+    this->scheduler->pop();
+  }
 }
 
 bool CloudIoTCoreMqtt::publishTelemetry(const char* subtopic, const char* data, int length)
 {
-  char topic[128];
-  device->getEventsTopic(topic);
-  strcat(topic, subtopic);
-  return this->mqttClient->publish(topic, data, length);
+  if (this->scheduler != NULL) {
+    return publishTelemetry(subtopic, data, length,
+                            CloudIoTCoreScheduler::LANE_NORMAL);
+  }
+  const char *topic = device->internEventsTopic(subtopic);
+  if (topic != NULL) {
+    return sendPublish(topic, data, length);
+  }
+
+  // Subtopic table full, send the topic in two pieces.
+  Fragment payload = {data, (size_t)length};
+  return publishTelemetry(subtopic, &payload, 1);
+}
+
+bool CloudIoTCoreMqtt::publishTelemetry(const char* subtopic, const char* data, int length,
+                                        CloudIoTCoreScheduler::Lane lane)
+{
+  const char *topic = subtopic == NULL ? device->getEventsTopic()
+                                       : device->internEventsTopic(subtopic);
+  if (this->scheduler == NULL) {
+    if (topic == NULL) {
+      return publishTelemetry(subtopic, data, length);
+    }
+    return sendPublish(topic, data, length);
+  }
+  // Queued messages keep a pointer to their topic, so it has to be one
+  // the device keeps.
+  if (topic == NULL) {
+    ciotc_log_error("no room to keep the topic for subtopic %s", subtopic);
+    return false;
+  }
+  return this->scheduler->push(this->scheduler->classFor(subtopic), lane,
+                               topic, data, length);
+}
+
+bool CloudIoTCoreMqtt::publishTelemetry(const Fragment* payload, size_t count)
+{
+  const char *events = device->getEventsTopic();
+  Fragment topic = {events, strlen(events)};
+  return publish(&topic, 1, payload, count);
+}
+
+bool CloudIoTCoreMqtt::publishTelemetry(const char* subtopic, const Fragment* payload, size_t count)
+{
+  const char *events = device->getEventsTopic();
+  Fragment topic[2] = {{events, strlen(events)}, {subtopic, strlen(subtopic)}};
+  return publish(topic, 2, payload, count);
+}
+
+bool CloudIoTCoreMqtt::publish(const Fragment* topic, size_t topic_count,
+                               const Fragment* payload, size_t payload_count,
+                               bool retained)
+{
+  if (!this->mqttClient->connected()) {
+    return false;
+  }
+  return writePublish(0x30 | (retained ? 0x01 : 0), topic, topic_count, 0,
+                      payload, payload_count);
 }
 
 // bool CloudIoTCoreMqtt::publishTelemetry(String subtopic, String data) {
@@ -96,9 +432,335 @@ bool CloudIoTCoreMqtt::publishTelemetry(const char* subtopic, const char* data,
 
 bool CloudIoTCoreMqtt::publishState(const char* data, int length)
 {
-  char topic[64];
-  device->getStateTopic(topic);
-  return this->mqttClient->publish(topic, data, length);
+  if (this->stateSlot != NULL) {
+    return this->stateSlot->write(data, length);
+  }
+  if (this->scheduler != NULL) {
+    return this->scheduler->push(CloudIoTCoreScheduler::CLASS_STATE,
+                                 CloudIoTCoreScheduler::LANE_NORMAL,
+                                 device->getStateTopic(), data, length);
+  }
+  return sendPublish(device->getStateTopic(), data, length);
+}
+
+bool CloudIoTCoreMqtt::publishTelemetryQos1(const char* data, int length, uint16_t* packet_id)
+{
+  return publishQos1(device->getEventsTopic(), data, length, packet_id);
+}
+
+bool CloudIoTCoreMqtt::publishStateQos1(const char* data, int length, uint16_t* packet_id)
+{
+  return publishQos1(device->getStateTopic(), data, length, packet_id);
+}
+
+void CloudIoTCoreMqtt::onPublishComplete(PublishCallback callback)
+{
+  this->publishCallback = callback;
+}
+
+uint8_t CloudIoTCoreMqtt::getInFlight()
+{
+  uint8_t n = 0;
+  for (int i = 0; i < CLOUD_IOT_CORE_QOS1_WINDOW; i++) {
+    if (this->inFlight[i].id != 0) {
+      n++;
+    }
+  }
+  return n;
+}
+
+bool CloudIoTCoreMqtt::publishQos1(const char* topic, const char* data, int length,
+                                   uint16_t* packet_id)
+{
+  if (length < 0 || length > CLOUD_IOT_CORE_QOS1_PAYLOAD_MAX ||
+      !this->mqttClient->connected()) {
+    return false;
+  }
+  InFlight *message = NULL;
+  for (int i = 0; i < CLOUD_IOT_CORE_QOS1_WINDOW && message == NULL; i++) {
+    if (this->inFlight[i].id == 0) {
+      message = &this->inFlight[i];
+    }
+  }
+  if (message == NULL) {
+    return false;
+  }
+
+  // mqttClient counts up through the whole range for its own packets and
+  // waits for each to be acknowledged. Ids half the range ahead of its
+  // last one stay clear of it for 32k of its packets, far longer than
+  // ours are kept.
+  bool used;
+  do {
+    uint16_t id = this->clientPacketId + 0x8000 + this->nextPacketId;
+    this->nextPacketId = (this->nextPacketId + 1) & 0xff;
+    message->id = id;
+    used = id == 0;
+    for (int i = 0; i < CLOUD_IOT_CORE_QOS1_WINDOW; i++) {
+      used |= &this->inFlight[i] != message && this->inFlight[i].id == id;
+    }
+  } while (used);
+
+  message->length = length;
+  message->topic = topic;
+  memcpy(message->payload, data, length);
+  if (packet_id != NULL) {
+    *packet_id = message->id;
+  }
+  // A failed write is retried on reconnect like a lost PUBACK.
+  message->attempts = sendQos1(*message, false) ? 1 : 0;
+  return true;
+}
+
+// Writes a QoS 1 PUBLISH to the transport without going through lwmqtt,
+// which would block until the PUBACK arrives.
+bool CloudIoTCoreMqtt::sendQos1(InFlight &message, bool dup)
+{
+  Fragment topic = {message.topic, strlen(message.topic)};
+  Fragment payload = {message.payload, message.length};
+  return writePublish(0x32 | (dup ? 0x08 : 0), &topic, 1, message.id,
+                      &payload, 1);
+}
+
+// Collects short pieces of a packet so they go out in one write (one TLS
+// record), longer ones are written from where they are.
+struct GatherWriter {
+  Client &out;
+  size_t used;
+  bool ok;
+  uint8_t buffer[CLOUD_IOT_CORE_GATHER_CHUNK];
+
+  GatherWriter(Client &out) : out(out), used(0), ok(true) {}
+
+  void put(const void *data, size_t length)
+  {
+    if (used + length > sizeof(buffer)) {
+      flush();
+      if (length >= sizeof(buffer)) {
+        ok = ok && out.write((const uint8_t *)data, length) == length;
+        return;
+      }
+    }
+    memcpy(buffer + used, data, length);
+    used += length;
+  }
+
+  bool flush()
+  {
+    if (used > 0) {
+      ok = ok && out.write(buffer, used) == used;
+      used = 0;
+    }
+    return ok;
+  }
+};
+
+// Serializes a PUBLISH straight from the fragments, packet_id is only sent
+// for QoS 1 and up.
+bool CloudIoTCoreMqtt::writePublish(uint8_t header, const Fragment *topic,
+                                    size_t topic_count, uint16_t packet_id,
+                                    const Fragment *payload,
+                                    size_t payload_count)
+{
+  size_t topic_length = 0;
+  size_t payload_length = 0;
+  for (size_t i = 0; i < topic_count; i++) {
+    topic_length += topic[i].length;
+  }
+  for (size_t i = 0; i < payload_count; i++) {
+    payload_length += payload[i].length;
+  }
+  if (topic_length == 0 || topic_length > 0xffff) {
+    ciotc_log_error("invalid topic length %u", (unsigned)topic_length);
+    return false;
+  }
+
+  uint8_t fixed[5 + 2];
+  size_t remaining = 2 + topic_length + (header & 0x06 ? 2 : 0) + payload_length;
+  size_t n = 0;
+  fixed[n++] = header;
+  do {
+    fixed[n] = remaining & 0x7f;
+    remaining >>= 7;
+    fixed[n++] |= remaining ? 0x80 : 0;
+  } while (remaining && n < 5);
+  fixed[n++] = topic_length >> 8;
+  fixed[n++] = topic_length;
+
+  unsigned long start = micros();
+  this->transport.setOwnWrites(true);
+  GatherWriter writer(this->transport);
+  writer.put(fixed, n);
+  for (size_t i = 0; i < topic_count; i++) {
+    writer.put(topic[i].data, topic[i].length);
+  }
+  if (header & 0x06) {
+    uint8_t id[2] = {(uint8_t)(packet_id >> 8), (uint8_t)packet_id};
+    writer.put(id, 2);
+  }
+  for (size_t i = 0; i < payload_count; i++) {
+    writer.put(payload[i].data, payload[i].length);
+  }
+  bool ok = writer.flush();
+  this->transport.setOwnWrites(false);
+  countPublish(ok, payload_length, micros() - start);
+  return ok;
+}
+
+// Sends unacknowledged publishes again after a reconnect. Only a resumed
+// session knows them, so only then are they marked DUP; after a clean
+// session they are new publishes. attempts counts the writes that went
+// out, so a write that failed does not use up a retry.
+void CloudIoTCoreMqtt::resendQos1(bool resumed)
+{
+  for (int i = 0; i < CLOUD_IOT_CORE_QOS1_WINDOW; i++) {
+    InFlight &message = this->inFlight[i];
+    if (message.id == 0) {
+      continue;
+    }
+    if (message.attempts > CLOUD_IOT_CORE_QOS1_RETRIES) {
+      completeQos1(message, false);
+    } else if (sendQos1(message, resumed && message.attempts > 0)) {
+      message.attempts++;
+    }
+  }
+}
+
+void CloudIoTCoreMqtt::completeQos1(InFlight &message, bool delivered)
+{
+  uint16_t id = message.id;
+  message.id = 0;
+  if (this->publishCallback != NULL) {
+    this->publishCallback(id, delivered);
+  }
+}
+
+void CloudIoTCoreMqtt::pubackReceived(void *mqtt, uint16_t packet_id)
+{
+  CloudIoTCoreMqtt *self = (CloudIoTCoreMqtt *)mqtt;
+  for (int i = 0; i < CLOUD_IOT_CORE_QOS1_WINDOW; i++) {
+    if (self->inFlight[i].id == packet_id) {
+      self->completeQos1(self->inFlight[i], true);
+      return;
+    }
+  }
+}
+
+void CloudIoTCoreMqtt::packetIdSent(void *mqtt, uint16_t packet_id)
+{
+  CloudIoTCoreMqtt *self = (CloudIoTCoreMqtt *)mqtt;
+  self->clientPacketId = packet_id;
+  // Should mqttClient still reach an id of ours, its acknowledgement can
+  // not be told apart: report ours as not delivered rather than guess.
+  for (int i = 0; i < CLOUD_IOT_CORE_QOS1_WINDOW; i++) {
+    if (self->inFlight[i].id == packet_id) {
+      ciotc_log_warn("packet id %u reused, QoS 1 publish given up", packet_id);
+      self->completeQos1(self->inFlight[i], false);
+    }
+  }
+}
+
+void CloudIoTCoreMqtt::onConfig(MessageHandler handler, void *context)
+{
+  this->configRoute.handler = handler;
+  this->configRoute.context = context;
+}
+
+void CloudIoTCoreMqtt::onCommands(MessageHandler handler, void *context)
+{
+  this->commandsRoute.handler = handler;
+  this->commandsRoute.context = context;
+}
+
+bool CloudIoTCoreMqtt::onCommand(const char *subfolder, MessageHandler handler, void *context)
+{
+  size_t length = strlen(subfolder);
+  int i = 0;
+  while (i < this->nroutes && this->routes[i].length >= length) {
+    if (this->routes[i].length == length &&
+        memcmp(this->routes[i].subfolder, subfolder, length) == 0) {
+      this->routes[i].handler = handler;
+      this->routes[i].context = context;
+      return true;
+    }
+    i++;
+  }
+  if (this->nroutes == CLOUD_IOT_CORE_ROUTES) {
+    return false;
+  }
+  memmove(&this->routes[i + 1], &this->routes[i],
+          (this->nroutes - i) * sizeof(Route));
+  this->routes[i] = {subfolder, length, handler, context};
+  this->nroutes++;
+  return true;
+}
+
+void CloudIoTCoreMqtt::setConfigTracking(CloudIoTCoreConfig *config)
+{
+  this->configTracking = config;
+}
+
+void CloudIoTCoreMqtt::messageArrived(MQTTClient *client, char topic[],
+                                      char bytes[], int length)
+{
+  for (int i = 0; i < CLOUD_IOT_CORE_INSTANCES; i++) {
+    CloudIoTCoreMqtt *self = instances[i];
+    if (self == NULL || self->mqttClient != client) {
+      continue;
+    }
+    if (self->dispatch(topic, bytes, length)) {
+      return;
+    }
+    break;
+  }
+  String topic_string(topic);
+  String payload_string;
+  payload_string.reserve(length);
+  for (int i = 0; i < length; i++) {
+    payload_string += bytes[i];
+  }
+  messageReceived(topic_string, payload_string);
+}
+
+// True if a handler took the message.
+bool CloudIoTCoreMqtt::dispatch(const char *topic, const char *payload, size_t length)
+{
+  if (strcmp(topic, device->getConfigTopic()) == 0) {
+    if (this->configTracking != NULL &&
+        !this->configTracking->update(payload, length)) {
+      ciotc_log_debug("config unchanged");
+      return true;
+    }
+    if (this->configRoute.handler == NULL) {
+      return false;
+    }
+    this->configRoute.handler(this->configRoute.context, "", payload, length);
+    return true;
+  }
+
+  const char *commands = device->getCommandsTopic();
+  if (strncmp(topic, commands, this->commandsPrefixLength) != 0) {
+    return false;
+  }
+  const char *subfolder = topic + this->commandsPrefixLength;
+  if (*subfolder == '/') {
+    subfolder++;
+  } else if (*subfolder != 0) {
+    return false;
+  }
+  for (int i = 0; i < this->nroutes; i++) {
+    const Route &route = this->routes[i];
+    if (strncmp(subfolder, route.subfolder, route.length) == 0 &&
+        (subfolder[route.length] == 0 || subfolder[route.length] == '/')) {
+      route.handler(route.context, subfolder, payload, length);
+      return true;
+    }
+  }
+  if (this->commandsRoute.handler == NULL) {
+    return false;
+  }
+  this->commandsRoute.handler(this->commandsRoute.context, subfolder, payload, length);
+  return true;
 }
 
 void CloudIoTCoreMqtt::onConnect() {
@@ -110,129 +772,271 @@ void CloudIoTCoreMqtt::onConnect() {
 }
 
 void CloudIoTCoreMqtt::logError() {
-  Serial.println(this->mqttClient->lastError());
+  const char *name;
   switch(this->mqttClient->lastError()) {
     case (LWMQTT_BUFFER_TOO_SHORT):
-      Serial.println("LWMQTT_BUFFER_TOO_SHORT");
+      name = "LWMQTT_BUFFER_TOO_SHORT";
       break;
     case (LWMQTT_VARNUM_OVERFLOW):
-      Serial.println("LWMQTT_VARNUM_OVERFLOW");
+      name = "LWMQTT_VARNUM_OVERFLOW";
       break;
     case (LWMQTT_NETWORK_FAILED_CONNECT):
-      Serial.println("LWMQTT_NETWORK_FAILED_CONNECT");
+      name = "LWMQTT_NETWORK_FAILED_CONNECT";
       break;
     case (LWMQTT_NETWORK_TIMEOUT):
-      Serial.println("LWMQTT_NETWORK_TIMEOUT");
+      name = "LWMQTT_NETWORK_TIMEOUT";
       break;
     case (LWMQTT_NETWORK_FAILED_READ):
-      Serial.println("LWMQTT_NETWORK_FAILED_READ");
+      name = "LWMQTT_NETWORK_FAILED_READ";
       break;
     case (LWMQTT_NETWORK_FAILED_WRITE):
-      Serial.println("LWMQTT_NETWORK_FAILED_WRITE");
+      name = "LWMQTT_NETWORK_FAILED_WRITE";
       break;
     case (LWMQTT_REMAINING_LENGTH_OVERFLOW):
-      Serial.println("LWMQTT_REMAINING_LENGTH_OVERFLOW");
+      name = "LWMQTT_REMAINING_LENGTH_OVERFLOW";
       break;
     case (LWMQTT_REMAINING_LENGTH_MISMATCH):
-      Serial.println("LWMQTT_REMAINING_LENGTH_MISMATCH");
+      name = "LWMQTT_REMAINING_LENGTH_MISMATCH";
       break;
     case (LWMQTT_MISSING_OR_WRONG_PACKET):
-      Serial.println("LWMQTT_MISSING_OR_WRONG_PACKET");
+      name = "LWMQTT_MISSING_OR_WRONG_PACKET";
       break;
     case (LWMQTT_CONNECTION_DENIED):
-      Serial.println("LWMQTT_CONNECTION_DENIED");
+      name = "LWMQTT_CONNECTION_DENIED";
       break;
     case (LWMQTT_FAILED_SUBSCRIPTION):
-      Serial.println("LWMQTT_FAILED_SUBSCRIPTION");
+      name = "LWMQTT_FAILED_SUBSCRIPTION";
       break;
     case (LWMQTT_SUBACK_ARRAY_OVERFLOW):
-      Serial.println("LWMQTT_SUBACK_ARRAY_OVERFLOW");
+      name = "LWMQTT_SUBACK_ARRAY_OVERFLOW";
       break;
     case (LWMQTT_PONG_TIMEOUT):
-      Serial.println("LWMQTT_PONG_TIMEOUT");
+      name = "LWMQTT_PONG_TIMEOUT";
       break;
     default:
-      Serial.println("This error code should never be reached.");
+      name = "This error code should never be reached.";
       break;
   }
+  ciotc_log_error("%d %s", this->mqttClient->lastError(), name);
+  ciotc_metric_error(this->mqttClient->lastError());
 }
 
 void CloudIoTCoreMqtt::logReturnCode() {
-  Serial.println(this->mqttClient->returnCode());
+  const char *name;
   switch(this->mqttClient->returnCode()) {
     case (LWMQTT_CONNECTION_ACCEPTED):
-      Serial.println("OK");
+      name = "OK";
       break;
     case (LWMQTT_UNACCEPTABLE_PROTOCOL):
-      Serial.println("LWMQTT_UNACCEPTABLE_PROTOCOLL");
+      name = "LWMQTT_UNACCEPTABLE_PROTOCOLL";
       break;
     case (LWMQTT_IDENTIFIER_REJECTED):
-      Serial.println("LWMQTT_IDENTIFIER_REJECTED");
+      name = "LWMQTT_IDENTIFIER_REJECTED";
       break;
     case (LWMQTT_SERVER_UNAVAILABLE):
-      Serial.println("LWMQTT_SERVER_UNAVAILABLE");
+      name = "LWMQTT_SERVER_UNAVAILABLE";
       break;
     case (LWMQTT_BAD_USERNAME_OR_PASSWORD):
-      Serial.println("LWMQTT_BAD_USERNAME_OR_PASSWORD");
+      name = "LWMQTT_BAD_USERNAME_OR_PASSWORD";
       device->invalidateJWT();
       break;
     case (LWMQTT_NOT_AUTHORIZED):
-      Serial.println("LWMQTT_NOT_AUTHORIZED");
+      name = "LWMQTT_NOT_AUTHORIZED";
       device->invalidateJWT();
       break;
     case (LWMQTT_UNKNOWN_RETURN_CODE):
-      Serial.println("LWMQTT_UNKNOWN_RETURN_CODE");
+      name = "LWMQTT_UNKNOWN_RETURN_CODE";
       break;
     default:
-      Serial.println("This return code should never be reached.");
+      name = "This return code should never be reached.";
       break;
   }
+  ciotc_log_error("%d %s", this->mqttClient->returnCode(), name);
+  ciotc_metric_gauge(CIOTC_GAUGE_RETURN_CODE, this->mqttClient->returnCode());
 }
 
 void CloudIoTCoreMqtt::mqttConnect(bool skip) {
-  Serial.print("\nconnecting...");
-  bool keepgoing = true;
-  char client_id[200];
-  char topic[64];
-  device->getClientId(client_id);
-
-  while (keepgoing) {
-    this->mqttClient->connect(client_id, "unused", device->getJWT(), skip);
-
-    if (this->mqttClient->lastError() != LWMQTT_SUCCESS){
-      logError();
-      logReturnCode();
-      // See https://cloud.google.com/iot/docs/how-tos/exponential-backoff
-      if (this->__backoff__ < this->__minbackoff__) {
+  ciotc_log_info("connecting...");
+  this->skipNetwork = skip;
+  setState(CONN_SIGNING);
+  while (this->state != CONN_CONNECTED) {
+    poll();
+    delay(1);
+  }
+}
+
+CloudIoTCoreMqtt::State CloudIoTCoreMqtt::getState() {
+  return this->state;
+}
+
+void CloudIoTCoreMqtt::onStateChange(StateCallback callback) {
+  this->stateCallback = callback;
+}
+
+void CloudIoTCoreMqtt::connected(bool resumed)
+{
+  setState(CONN_CONNECTED);
+  resendQos1(resumed);
+  onConnect();
+}
+
+void CloudIoTCoreMqtt::setState(State next) {
+  State previous = this->state;
+  this->state = next;
+  if (next == CONN_SIGNING && previous != CONN_SIGNING) {
+    this->connectStart = millis();
+    ciotc_metric_count(CIOTC_COUNTER_CONNECT_ATTEMPTS);
+  } else if (next == CONN_NETWORK) {
+    this->networkStart = millis();
+    if (this->endpoints != NULL && !this->skipNetwork) {
+      this->host = this->endpoints->select();
+    }
+  } else if (next == CONN_SUBSCRIBE) {
+    this->subscribeStart = millis();
+    if (this->endpoints != NULL && !this->skipNetwork) {
+      this->endpoints->report(true, millis() - this->networkStart);
+    }
+  } else if (next == CONN_CONNECTED && previous == CONN_SUBSCRIBE) {
+    ciotc_metric_count(CIOTC_COUNTER_CONNECTS);
+    ciotc_metric_observe(CIOTC_HISTOGRAM_CONNECT_MS, millis() - this->connectStart);
+    ciotc_metric_observe(CIOTC_HISTOGRAM_SUBSCRIBE_MS, millis() - this->subscribeStart);
+  }
+  if (this->stateCallback != NULL && previous != next) {
+    this->stateCallback(previous, next);
+  }
+}
+
+void CloudIoTCoreMqtt::fail() {
+  // See https://cloud.google.com/iot/docs/how-tos/exponential-backoff
+  if (this->__backoff__ < this->__minbackoff__) {
+    this->__backoff__ = this->__minbackoff__;
+  }
+  this->__backoff__ = (this->__backoff__ * this->__factor__) + random(this->__jitter__);
+  if (this->__backoff__ > this->__max_backoff__) {
+    this->__backoff__ = this->__max_backoff__;
+  }
+
+  // Rejected credentials are not the endpoint's fault.
+  if (this->endpoints != NULL && !this->skipNetwork &&
+      (this->state == CONN_NETWORK ||
+       (this->state == CONN_MQTT &&
+        this->mqttClient->returnCode() != LWMQTT_BAD_USERNAME_OR_PASSWORD &&
+        this->mqttClient->returnCode() != LWMQTT_NOT_AUTHORIZED))) {
+    this->endpoints->report(false, 0);
+  }
+
+  ciotc_metric_count(CIOTC_COUNTER_BACKOFFS);
+  ciotc_metric_gauge(CIOTC_GAUGE_BACKOFF_MS, this->__backoff__);
+  ciotc_metric_observe(CIOTC_HISTOGRAM_BACKOFF_MS, this->__backoff__);
+
+  // Clean up the client
+  this->mqttClient->disconnect();
+  this->skipNetwork = false;
+  ciotc_log_info("Delaying %ldms", this->__backoff__);
+  this->backoffStart = millis();
+  setState(CONN_BACKOFF);
+}
+
+void CloudIoTCoreMqtt::poll() {
+  device->loop();
+  if (this->aggregate != NULL && this->aggregate->due() &&
+      (this->state == CONN_CONNECTED || this->spool != NULL)) {
+    publishAggregate();
+  }
+  if (this->ingest != NULL &&
+      (this->state == CONN_CONNECTED || this->spool != NULL)) {
+    drainIngest();
+  }
+
+  switch (this->state) {
+    case CONN_IDLE:
+      ciotc_log_info("connecting...");
+      setState(CONN_SIGNING);
+      break;
+
+    case CONN_SIGNING:
+      if (device->isJWTValid() ||
+          device->refreshJWT(CLOUD_IOT_CORE_JWT_SLICE_US)) {
+        setState(CONN_NETWORK);
+      }
+      break;
+
+    case CONN_NETWORK:
+      if (this->skipNetwork || this->transport.connect(this->host, CLOUD_IOT_CORE_MQTT_PORT)) {
+        setState(CONN_MQTT);
+      } else {
+        ciotc_log_error("TCP/TLS connect to %s failed", this->host);
+        fail();
+      }
+      break;
+
+    case CONN_MQTT:
+      // The network is up, so lwmqtt only sends CONNECT and waits for the
+      // CONNACK.
+      this->transport.reset();
+      this->mqttClient->connect(device->getClientId(), "unused",
+                                device->getJWT(), true);
+      if (this->mqttClient->lastError() != LWMQTT_SUCCESS) {
+        logError();
+        logReturnCode();
+        fail();
+      } else {
+        // We're now connected
+        ciotc_log_info("connected!");
         this->__backoff__ = this->__minbackoff__;
+        setState(CONN_SUBSCRIBE);
+        if (this->persistentSession && this->mqttClient->sessionPresent()) {
+          // The broker kept our subscriptions, save the two SUBSCRIBE
+          // round trips.
+          ciotc_log_debug("session resumed");
+          ciotc_metric_count(CIOTC_COUNTER_SESSIONS_RESUMED);
+          connected(true);
+        }
       }
-      this->__backoff__ = (this->__backoff__ * this->__factor__) + random(this->__jitter__);
-      if (this->__backoff__ > this->__max_backoff__) {
-        this->__backoff__ = this->__max_backoff__;
+      break;
+
+    case CONN_SUBSCRIBE:
+      // Set QoS to 1 (ack) for configuration messages
+      // QoS 0 (no ack) for commands
+      if (this->mqttClient->subscribe(device->getConfigTopic(), 1) &&
+          this->mqttClient->subscribe(device->getCommandsTopic(), 0)) {
+        connected(false);
+      } else {
+        logError();
+        fail();
       }
+      break;
 
-      // Clean up the client
-      this->mqttClient->disconnect();
-      skip = false;
-      Serial.print("Delaying ");
-      Serial.print(this->__backoff__);
-      Serial.println("ms");
-      delay(this->__backoff__);
-      keepgoing = true;
-    } else {
-      // We're now connected
-      Serial.println("\nconnected!");
-      keepgoing = false;
-      this->__backoff__ = this->__minbackoff__;
-    }
-  }
-
-  // Set QoS to 1 (ack) for configuration messages
-  device->getConfigTopic(topic);
-  this->mqttClient->subscribe(topic, 1);
-  // QoS 0 (no ack) for commands
-  device->getCommandsTopic(topic);
-  this->mqttClient->subscribe(topic, 0);
+    case CONN_CONNECTED:
+      this->mqttClient->loop();
+      if (this->batch != NULL && this->batch->due()) {
+        flushTelemetry();
+      }
+      if (this->stateSlot != NULL) {
+        publishStateSlot();
+      }
+      if (this->metricsInterval != 0 &&
+          millis() - this->lastMetrics >= this->metricsInterval) {
+        this->lastMetrics = millis();
+        publishMetrics(this->metricsSubfolder);
+      }
+      if (this->scheduler != NULL) {
+        drainScheduler();
+      }
+      replaySpool();
+      this->transport.flushIfDue();
+      if (!this->mqttClient->connected()) {
+        ciotc_log_info("connection lost");
+        this->mqttClient->disconnect();
+        this->skipNetwork = false;
+        setState(CONN_SIGNING);
+      }
+      break;
 
-  onConnect();
+    case CONN_BACKOFF:
+      if (millis() - this->backoffStart >= (unsigned long)this->__backoff__) {
+        setState(CONN_SIGNING);
+      }
+      break;
+  }
 }
@@ -16,11 +16,127 @@
 #define __CLOUDIOTCORE_MQTT_H__
 #include <Arduino.h>
 #include "CloudIoTCore.h"
+#include "CloudIoTCoreAggregate.h"
+#include "CloudIoTCoreBatch.h"
+#include "CloudIoTCoreCbor.h"
+#include "CloudIoTCoreClient.h"
+#include "CloudIoTCoreCoalescer.h"
+#include "CloudIoTCoreConfig.h"
 #include "CloudIoTCoreDevice.h"
+#include "CloudIoTCoreEndpoints.h"
+#include "CloudIoTCoreGorilla.h"
+#include "CloudIoTCoreIngest.h"
+#include "CloudIoTCoreLz.h"
+#include "CloudIoTCoreMqttCodec.h"
+#include "CloudIoTCoreScheduler.h"
+#include "CloudIoTCoreSpool.h"
+#include "CloudIoTCoreStateSlot.h"
 #include <Client.h>
+#if CLOUD_IOT_CORE_NATIVE_MQTT
+typedef CloudIoTCoreMqttCodec MQTTClient;
+#else
 #include <MQTTClient.h>
+#endif
+
+// Batches that cannot be published go to the spool as one record.
+#if CLOUD_IOT_CORE_BATCH_SIZE > CLOUD_IOT_CORE_SPOOL_RECORD_MAX
+#error CLOUD_IOT_CORE_BATCH_SIZE must not exceed CLOUD_IOT_CORE_SPOOL_RECORD_MAX
+#endif
+
+// How long one replay of the spool may keep sending records, ms. A
+// backlog drains while new telemetry keeps joining it as long as this
+// many ms of sending outpace replay_interval_ms of publishing.
+#ifndef CLOUD_IOT_CORE_SPOOL_REPLAY_MS
+#define CLOUD_IOT_CORE_SPOOL_REPLAY_MS 20
+#endif
+
+// QoS 1 publishes that may await their PUBACK at the same time, the
+// largest payload each can hold, and how many times one is sent again on
+// reconnects before it is reported as not delivered.
+#ifndef CLOUD_IOT_CORE_QOS1_WINDOW
+#define CLOUD_IOT_CORE_QOS1_WINDOW 4
+#endif
+#ifndef CLOUD_IOT_CORE_QOS1_PAYLOAD_MAX
+#define CLOUD_IOT_CORE_QOS1_PAYLOAD_MAX 256
+#endif
+#ifndef CLOUD_IOT_CORE_QOS1_RETRIES
+#define CLOUD_IOT_CORE_QOS1_RETRIES 3
+#endif
+
+// Events subfolder for LZ compressed telemetry and the longest payload
+// publishTelemetryCompressed() takes.
+#ifndef CLOUD_IOT_CORE_LZ_SUBFOLDER
+#define CLOUD_IOT_CORE_LZ_SUBFOLDER "/lz"
+#endif
+#ifndef CLOUD_IOT_CORE_LZ_PAYLOAD_MAX
+#define CLOUD_IOT_CORE_LZ_PAYLOAD_MAX 512
+#endif
+
+// Events subfolders for binary telemetry, which is never batched: CBOR
+// payloads and Gorilla compressed series.
+#ifndef CLOUD_IOT_CORE_CBOR_SUBFOLDER
+#define CLOUD_IOT_CORE_CBOR_SUBFOLDER "/cbor"
+#endif
+#ifndef CLOUD_IOT_CORE_GORILLA_SUBFOLDER
+#define CLOUD_IOT_CORE_GORILLA_SUBFOLDER "/gorilla"
+#endif
+
+// Commands subfolders that can have their own handler, and how many
+// CloudIoTCoreMqtt instances can receive messages at the same time.
+#ifndef CLOUD_IOT_CORE_ROUTES
+#define CLOUD_IOT_CORE_ROUTES 8
+#endif
+#ifndef CLOUD_IOT_CORE_INSTANCES
+#define CLOUD_IOT_CORE_INSTANCES 2
+#endif
+
+// Events subfolder for publishMetrics() and the largest report.
+#ifndef CLOUD_IOT_CORE_METRICS_SUBFOLDER
+#define CLOUD_IOT_CORE_METRICS_SUBFOLDER "/metrics"
+#endif
+#ifndef CLOUD_IOT_CORE_METRICS_PAYLOAD
+#define CLOUD_IOT_CORE_METRICS_PAYLOAD 512
+#endif
+
+// Fragments shorter than this are gathered on the stack and written to the
+// transport together, longer ones are written in place.
+#ifndef CLOUD_IOT_CORE_GATHER_CHUNK
+#define CLOUD_IOT_CORE_GATHER_CHUNK 128
+#endif
+
+// Payloads poll() takes from the ingest queue per call.
+#ifndef CLOUD_IOT_CORE_INGEST_DRAIN
+#define CLOUD_IOT_CORE_INGEST_DRAIN 8
+#endif
 
 class CloudIoTCoreMqtt {
+  public:
+    // Connection states driven by poll(). Each poll() does at most one
+    // bounded step: a slice of JWT signing, the TCP/TLS connect, the MQTT
+    // CONNECT or the subscriptions. Failures go to CONN_BACKOFF and retry
+    // from CONN_SIGNING once the backoff has passed.
+    enum State {
+      CONN_IDLE,
+      CONN_SIGNING,
+      CONN_NETWORK,
+      CONN_MQTT,
+      CONN_SUBSCRIBE,
+      CONN_CONNECTED,
+      CONN_BACKOFF
+    };
+    typedef void (*StateCallback)(State from, State to);
+    typedef void (*PublishCallback)(uint16_t packet_id, bool delivered);
+    // Inbound message handler. subfolder is what follows "commands/" in the
+    // topic ("" for config and for commands without one). payload is the
+    // client's receive buffer, only valid during the call.
+    typedef void (*MessageHandler)(void *context, const char *subfolder,
+                                   const char *payload, size_t length);
+    // One piece of a topic or payload for the scatter-gather publishes.
+    struct Fragment {
+      const char *data;
+      size_t length;
+    };
+
   private:
     long __backoff__ = 1000; // current backoff, milliseconds
     float __factor__ = 2.5;
@@ -30,9 +146,91 @@ class CloudIoTCoreMqtt {
     boolean logConnect = true;
     boolean useLts = false;
 
+    State state = CONN_IDLE;
+    StateCallback stateCallback = NULL;
+    unsigned long backoffStart = 0;
+    bool skipNetwork = false;
+    bool persistentSession = false;
+    const char *host = CLOUD_IOT_CORE_MQTT_HOST;
+    CloudIoTCoreBatch *batch = NULL;
+    CloudIoTCoreSpool *spool = NULL;
+    CloudIoTCoreAggregate *aggregate = NULL;
+    CloudIoTCoreIngest *ingest = NULL;
+    CloudIoTCoreScheduler *scheduler = NULL;
+    CloudIoTCoreStateSlot *stateSlot = NULL;
+    CloudIoTCoreEndpoints *endpoints = NULL;
+    unsigned long networkStart = 0;
+    unsigned long replayInterval = 100;
+    unsigned long lastReplay = 0;
+    unsigned long connectStart = 0;
+    unsigned long subscribeStart = 0;
+    unsigned long metricsInterval = 0;
+    unsigned long lastMetrics = 0;
+    const char *metricsSubfolder = CLOUD_IOT_CORE_METRICS_SUBFOLDER;
+
+    // QoS 1 publishes written straight to the transport, a slot is free
+    // when its id is 0.
+    struct InFlight {
+      uint16_t id;
+      uint16_t length;
+      uint8_t attempts;
+      const char *topic;
+      char payload[CLOUD_IOT_CORE_QOS1_PAYLOAD_MAX];
+    };
+    InFlight inFlight[CLOUD_IOT_CORE_QOS1_WINDOW];
+    uint16_t nextPacketId = 0;
+    // Last id mqttClient used, ours are kept half the range away.
+    uint16_t clientPacketId = 0;
+    PublishCallback publishCallback = NULL;
+
+    // publishTelemetryCompressed() state, shared by all instances to keep
+    // about 1 KB off the stack.
+    static LzEncoder lzEncoder;
+    static uint8_t lzOutput[LZ_OUTPUT_MAX(CLOUD_IOT_CORE_LZ_PAYLOAD_MAX)];
+
+    // Inbound routing. Routes are kept longest subfolder first so the
+    // first match is the most specific one.
+    struct Route {
+      const char *subfolder;
+      size_t length;
+      MessageHandler handler;
+      void *context;
+    };
+    Route routes[CLOUD_IOT_CORE_ROUTES];
+    uint8_t nroutes = 0;
+    Route configRoute = {"", 0, NULL, NULL};
+    Route commandsRoute = {"", 0, NULL, NULL};
+    size_t commandsPrefixLength = 0;
+    CloudIoTCoreConfig *configTracking = NULL;
+
     MQTTClient *mqttClient;
     Client *netClient;
     CloudIoTCoreDevice *device;
+    CloudIoTCoreClient transport;
+
+    void setState(State next);
+    void connected(bool resumed);
+    void fail();
+    bool publishEvents(const char* data, int length);
+    bool sendPublish(const char* topic, const char* data, int length);
+    void countPublish(bool ok, size_t length, unsigned long elapsed_us);
+    void publishAggregate();
+    void drainIngest();
+    void drainScheduler();
+    void publishStateSlot();
+    bool publishQos1(const char* topic, const char* data, int length,
+                     uint16_t* packet_id);
+    bool sendQos1(InFlight &message, bool dup);
+    bool writePublish(uint8_t header, const Fragment *topic, size_t topic_count,
+                      uint16_t packet_id, const Fragment *payload,
+                      size_t payload_count);
+    void resendQos1(bool resumed);
+    void completeQos1(InFlight &message, bool delivered);
+    static void pubackReceived(void *mqtt, uint16_t packet_id);
+    static void packetIdSent(void *mqtt, uint16_t packet_id);
+    static void messageArrived(MQTTClient *client, char topic[], char bytes[],
+                               int length);
+    bool dispatch(const char *topic, const char *payload, size_t length);
 
   public:
     CloudIoTCoreMqtt(MQTTClient *mqttClient, Client *netClient, CloudIoTCoreDevice *device);
@@ -41,15 +239,123 @@ class CloudIoTCoreMqtt {
     //bool publishTelemetry(String data);
     bool publishTelemetry(const char* data, int length);
     bool publishTelemetry(const char* subtopic, const char* data, int length);
+    /* Queues telemetry in a scheduler lane, subtopic may be NULL. Without
+       a scheduler it is published at once. */
+    bool publishTelemetry(const char* subtopic, const char* data, int length,
+                          CloudIoTCoreScheduler::Lane lane);
+    /* Scatter-gather QoS 0 publishes: the topic and the payload are the
+       concatenation of their fragments, which are written to the network
+       client as they are without being joined first. False if not
+       connected, nothing is spooled or batched. */
+    bool publish(const Fragment* topic, size_t topic_count,
+                 const Fragment* payload, size_t payload_count,
+                 bool retained = false);
+    bool publishTelemetry(const Fragment* payload, size_t count);
+    bool publishTelemetry(const char* subtopic, const Fragment* payload, size_t count);
+    /* Publishes a finished CBOR payload to subfolder, false if it
+       overflowed. */
+    bool publishTelemetry(const CborWriter &cbor,
+                          const char* subfolder = CLOUD_IOT_CORE_CBOR_SUBFOLDER);
+    /* Publishes the samples collected so far to subfolder, the caller
+       resets it. */
+    bool publishTelemetry(const GorillaEncoder &series,
+                          const char* subfolder = CLOUD_IOT_CORE_GORILLA_SUBFOLDER);
+    /* Compresses data with LzEncoder and publishes it to the
+       CLOUD_IOT_CORE_LZ_SUBFOLDER subfolder, or uncompressed as usual if
+       that would not save anything. Not reentrant, the buffers are
+       shared by all instances. */
+    bool publishTelemetryCompressed(const char* data, int length);
+    /* Publishes the library metrics (CloudIoTCoreMetrics.h) as CBOR,
+       false if they do not fit CLOUD_IOT_CORE_METRICS_PAYLOAD. */
+    bool publishMetrics(const char* subfolder = CLOUD_IOT_CORE_METRICS_SUBFOLDER);
+    /* Lets poll() publish them every interval_ms while connected, 0 stops. */
+    void setMetricsInterval(unsigned long interval_ms,
+                            const char* subfolder = CLOUD_IOT_CORE_METRICS_SUBFOLDER);
+    /* Publishes whatever the batch holds, true if there was nothing to do. */
+    bool flushTelemetry();
     //bool publishTelemetry(String subtopic, String data);
     //bool publishTelemetry(String subtopic, const char* data, int length);
     //bool publishState(String data);
     bool publishState(const char* data, int length);
+    /* QoS 1 publishes that return without waiting for the PUBACK. False
+       if not connected, the window is full or the payload is longer than
+       CLOUD_IOT_CORE_QOS1_PAYLOAD_MAX. The packet id is reported to the
+       onPublishComplete() callback once the broker acknowledges it, or as
+       not delivered after CLOUD_IOT_CORE_QOS1_RETRIES resends. They are
+       resent as DUP when the session was resumed and as new publishes
+       otherwise. */
+    bool publishTelemetryQos1(const char* data, int length, uint16_t* packet_id = NULL);
+    bool publishStateQos1(const char* data, int length, uint16_t* packet_id = NULL);
+    void onPublishComplete(PublishCallback callback);
+    /* QoS 1 publishes awaiting their PUBACK. */
+    uint8_t getInFlight();
     void onConnect();
+    /* Handlers for inbound messages, called without allocating. A command
+       goes to the route whose subfolder is the longest match ("led" gets
+       "led" and "led/on"), then to onCommands(). subfolder must stay valid.
+       Messages no handler takes go to messageReceived(String&, String&) as
+       before. onCommand() is false once CLOUD_IOT_CORE_ROUTES are used. */
+    void onConfig(MessageHandler handler, void *context = NULL);
+    void onCommands(MessageHandler handler, void *context = NULL);
+    bool onCommand(const char *subfolder, MessageHandler handler, void *context = NULL);
+    /* Drop config messages config has already seen, whether they would go
+       to onConfig() or messageReceived(). NULL delivers every one. */
+    void setConfigTracking(CloudIoTCoreConfig *config);
     void setLogConnect(boolean enabled);
     void setUseLts(boolean enabled);
+    /* Ask the broker to keep the session (cleanSession = false on
+       mqttClient) and skip subscribing when the CONNACK says it did. Call
+       it after mqttClient->setOptions(), which sets cleanSession too. */
+    void setPersistentSession(boolean enabled);
+    /* Let endpoints choose the host for each connect, instead of useLts,
+       and tell it how each connect went. NULL goes back to useLts. */
+    void setEndpoints(CloudIoTCoreEndpoints *endpoints);
+    /* Collect publishTelemetry(data, length) samples in batch, NULL turns
+       batching off. Subtopic telemetry is never batched. */
+    void setBatch(CloudIoTCoreBatch *batch);
+    /* Keep publishTelemetry(data, length) payloads that cannot be sent in
+       spool, which must have been begin()'d, and send them again once
+       connected, every replay_interval_ms as many as fit in
+       CLOUD_IOT_CORE_SPOOL_REPLAY_MS. Until the spool is empty new
+       payloads are added to it as well, so they are delivered in the
+       order they were published. */
+    void setSpool(CloudIoTCoreSpool *spool, unsigned long replay_interval_ms = 100);
+    /* Let poll() publish the reports of aggregate through
+       publishTelemetry(data, length), NULL turns it off. Reports wait for
+       the connection unless there is a spool to keep them. */
+    void setAggregate(CloudIoTCoreAggregate *aggregate);
+    /* Queue QoS 0 telemetry and state in scheduler and send them from
+       poll() as its rate limits allow, NULL sends them at once. Spooled
+       telemetry is replayed in the bulk lane. */
+    void setScheduler(CloudIoTCoreScheduler *scheduler);
+    /* Coalesce publishState() calls in slot, which poll() publishes when
+       the state rate allows. NULL publishes every call. */
+    void setStateSlot(CloudIoTCoreStateSlot *slot);
+    /* Buffer outgoing packets in coalescer so several share one network
+       write. poll() writes them out once its latency has passed, NULL
+       writes every packet at once. */
+    void setCoalescer(CloudIoTCoreCoalescer *coalescer);
+    /* Writes out buffered packets now, e.g. before sleeping. Call it from
+       loop() when using mqttConnect() instead of poll(). */
+    bool flushWrites();
+    /* Let poll() publish what interrupt handlers or other threads push to
+       ingest through publishTelemetry(data, length), NULL turns it off.
+       Payloads wait in the queue for the connection unless there is a
+       spool to keep them. */
+    void setIngest(CloudIoTCoreIngest *ingest);
+    /* Sends the oldest spooled payload if it is time to. Called by poll(),
+       call it from loop() when using mqttConnect() instead. */
+    void replaySpool();
     void logError();
     void logReturnCode();
+    /* Blocks until connected, retrying with exponential backoff. Pass
+       skip = true if netClient is already connected. */
     void mqttConnect(bool skip = false);
+    /* Non-blocking alternative to mqttConnect() and mqttClient->loop():
+       call from loop() to connect, stay connected and reconnect. */
+    void poll();
+    State getState();
+    /* Called on every state change, e.g. to light a status LED. */
+    void onStateChange(StateCallback callback);
 };
 #endif // __CLOUDIOTCORE_MQTT_H__
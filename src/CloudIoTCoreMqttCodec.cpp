@@ -0,0 +1,555 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include "CloudIoTCoreMqttCodec.h"
+
+#if CLOUD_IOT_CORE_NATIVE_MQTT
+
+#include "CloudIoTCoreLog.h"
+
+// Packet types, the high nibble of the fixed header.
+#define MQTT_CONNECT 1
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_SUBSCRIBE 8
+#define MQTT_SUBACK 9
+#define MQTT_PINGREQ 12
+#define MQTT_PINGRESP 13
+#define MQTT_DISCONNECT 14
+
+// Streams one packet to the Client. Small pieces are gathered in a stack
+// chunk, pieces that do not fit are written from the caller's memory.
+struct PacketWriter {
+  Client &client;
+  uint8_t chunk[CLOUD_IOT_CORE_CODEC_CHUNK];
+  size_t used;
+  bool ok;
+
+  explicit PacketWriter(Client &c) : client(c), used(0), ok(true) {}
+
+  bool flush()
+  {
+    if (ok && used > 0) {
+      ok = client.write(chunk, used) == used;
+    }
+    used = 0;
+    return ok;
+  }
+
+  void put(const uint8_t *data, size_t length)
+  {
+    if (used + length <= sizeof(chunk)) {
+      memcpy(chunk + used, data, length);
+      used += length;
+      return;
+    }
+    flush();
+    if (ok && length > 0) {
+      ok = client.write(data, length) == length;
+    }
+  }
+
+  void putByte(uint8_t b)
+  {
+    put(&b, 1);
+  }
+
+  void putShort(uint16_t v)
+  {
+    uint8_t b[2] = {(uint8_t)(v >> 8), (uint8_t)v};
+    put(b, 2);
+  }
+
+  void putString(const char *s, size_t length)
+  {
+    putShort(length);
+    put((const uint8_t *)s, length);
+  }
+
+  void header(uint8_t type_flags, size_t remaining)
+  {
+    putByte(type_flags);
+    do {
+      uint8_t b = remaining & 0x7f;
+      remaining >>= 7;
+      putByte(remaining ? b | 0x80 : b);
+    } while (remaining);
+  }
+};
+
+CloudIoTCoreMqttCodec::CloudIoTCoreMqttCodec(int size)
+    : client(NULL), host(NULL), port(0), simpleCallback(NULL),
+      advancedCallback(NULL), keepAliveMs(10000), cleanSession(true),
+      timeoutMs(1000), isConnected(false), present(false),
+      error(LWMQTT_SUCCESS), code(LWMQTT_CONNECTION_ACCEPTED),
+      nextPacketId(1), lastSend(0), lastReceive(0), pingOutstanding(false),
+      parseState(PARSE_HEADER), header(0), lengthShift(0), remaining(0),
+      bodyLength(0), bodyRead(0), ackType(0), ackId(0), ackCode(0)
+{
+  (void)size;
+}
+
+void CloudIoTCoreMqttCodec::begin(const char *_host, int _port,
+                                  Client &_client)
+{
+  host = _host;
+  port = _port;
+  client = &_client;
+}
+
+void CloudIoTCoreMqttCodec::onMessage(MQTTClientCallbackSimple callback)
+{
+  simpleCallback = callback;
+}
+
+void CloudIoTCoreMqttCodec::onMessageAdvanced(
+    MQTTClientCallbackAdvanced callback)
+{
+  advancedCallback = callback;
+}
+
+void CloudIoTCoreMqttCodec::setOptions(int keep_alive, bool clean_session,
+                                       int timeout)
+{
+  keepAliveMs = (unsigned long)keep_alive * 1000;
+  cleanSession = clean_session;
+  timeoutMs = timeout;
+}
+
+void CloudIoTCoreMqttCodec::setCleanSession(bool clean_session)
+{
+  cleanSession = clean_session;
+}
+
+uint16_t CloudIoTCoreMqttCodec::packetId()
+{
+  uint16_t id = nextPacketId++;
+  if (nextPacketId == 0) {
+    nextPacketId = 1;
+  }
+  return id;
+}
+
+// Like lwmqtt, any error ends the connection.
+void CloudIoTCoreMqttCodec::fail(lwmqtt_err_t err)
+{
+  error = err;
+  isConnected = false;
+  if (client != NULL) {
+    client->stop();
+  }
+}
+
+bool CloudIoTCoreMqttCodec::connect(const char *client_id,
+                                    const char *username,
+                                    const char *password, bool skip)
+{
+  if (client == NULL) {
+    return false;
+  }
+  isConnected = false;
+  present = false;
+  pingOutstanding = false;
+  parseState = PARSE_HEADER;
+  ackType = 0;
+
+  if (!skip && !client->connect(host, port)) {
+    fail(LWMQTT_NETWORK_FAILED_CONNECT);
+    return false;
+  }
+
+  static const uint8_t protocol[] = {0, 4, 'M', 'Q', 'T', 'T', 4};
+  size_t id_len = strlen(client_id);
+  size_t user_len = username != NULL ? strlen(username) : 0;
+  size_t pass_len = password != NULL ? strlen(password) : 0;
+  uint8_t flags = cleanSession ? 0x02 : 0;
+  size_t length = sizeof(protocol) + 3 + 2 + id_len;
+  if (username != NULL) {
+    flags |= 0x80;
+    length += 2 + user_len;
+  }
+  if (password != NULL) {
+    flags |= 0x40;
+    length += 2 + pass_len;
+  }
+
+  PacketWriter w(*client);
+  w.header(MQTT_CONNECT << 4, length);
+  w.put(protocol, sizeof(protocol));
+  w.putByte(flags);
+  w.putShort(keepAliveMs / 1000);
+  w.putString(client_id, id_len);
+  if (username != NULL) {
+    w.putString(username, user_len);
+  }
+  if (password != NULL) {
+    w.putString(password, pass_len);
+  }
+  if (!w.flush()) {
+    fail(LWMQTT_NETWORK_FAILED_WRITE);
+    return false;
+  }
+  lastSend = millis();
+
+  if (!waitFor(MQTT_CONNACK, 0)) {
+    return false;
+  }
+  code = ackCode <= LWMQTT_NOT_AUTHORIZED ? (lwmqtt_return_code_t)ackCode
+                                          : LWMQTT_UNKNOWN_RETURN_CODE;
+  if (code != LWMQTT_CONNECTION_ACCEPTED) {
+    fail(LWMQTT_CONNECTION_DENIED);
+    return false;
+  }
+  error = LWMQTT_SUCCESS;
+  isConnected = true;
+  return true;
+}
+
+bool CloudIoTCoreMqttCodec::publish(const char *topic, const char *payload,
+                                    int length)
+{
+  return publish(topic, payload, length, false, 0);
+}
+
+bool CloudIoTCoreMqttCodec::publish(const char *topic, const char *payload,
+                                    int length, bool retained, int qos)
+{
+  if (!connected()) {
+    return false;
+  }
+  qos = qos > 0 ? 1 : 0;
+  size_t topic_len = strlen(topic);
+  uint16_t id = qos ? packetId() : 0;
+  ackType = 0;
+
+  PacketWriter w(*client);
+  w.header((MQTT_PUBLISH << 4) | (qos << 1) | (retained ? 1 : 0),
+           2 + topic_len + (qos ? 2 : 0) + length);
+  w.putString(topic, topic_len);
+  if (qos) {
+    w.putShort(id);
+  }
+  w.put((const uint8_t *)payload, length);
+  if (!w.flush()) {
+    fail(LWMQTT_NETWORK_FAILED_WRITE);
+    return false;
+  }
+  lastSend = millis();
+  error = LWMQTT_SUCCESS;
+  return qos == 0 || waitFor(MQTT_PUBACK, id);
+}
+
+bool CloudIoTCoreMqttCodec::subscribe(const char *topic, int qos)
+{
+  if (!connected()) {
+    return false;
+  }
+  size_t topic_len = strlen(topic);
+  uint16_t id = packetId();
+  ackType = 0;
+
+  PacketWriter w(*client);
+  w.header((MQTT_SUBSCRIBE << 4) | 0x02, 2 + 2 + topic_len + 1);
+  w.putShort(id);
+  w.putString(topic, topic_len);
+  w.putByte(qos > 0 ? 1 : 0);
+  if (!w.flush()) {
+    fail(LWMQTT_NETWORK_FAILED_WRITE);
+    return false;
+  }
+  lastSend = millis();
+
+  if (!waitFor(MQTT_SUBACK, id)) {
+    return false;
+  }
+  if (ackCode == 0x80) {
+    fail(LWMQTT_FAILED_SUBSCRIPTION);
+    return false;
+  }
+  error = LWMQTT_SUCCESS;
+  return true;
+}
+
+bool CloudIoTCoreMqttCodec::loop()
+{
+  if (!connected()) {
+    return false;
+  }
+  if (!receive()) {
+    return false;
+  }
+  if (keepAliveMs > 0 && millis() - lastSend >= keepAliveMs) {
+    if (pingOutstanding) {
+      fail(LWMQTT_PONG_TIMEOUT);
+      return false;
+    }
+    uint8_t ping[2] = {MQTT_PINGREQ << 4, 0};
+    if (client->write(ping, sizeof(ping)) != sizeof(ping)) {
+      fail(LWMQTT_NETWORK_FAILED_WRITE);
+      return false;
+    }
+    pingOutstanding = true;
+    lastSend = millis();
+  }
+  return isConnected;
+}
+
+bool CloudIoTCoreMqttCodec::connected()
+{
+  if (isConnected && (client == NULL || !client->connected())) {
+    isConnected = false;
+  }
+  return isConnected;
+}
+
+bool CloudIoTCoreMqttCodec::sessionPresent()
+{
+  return present;
+}
+
+bool CloudIoTCoreMqttCodec::disconnect()
+{
+  if (client == NULL) {
+    return false;
+  }
+  if (connected()) {
+    uint8_t packet[2] = {MQTT_DISCONNECT << 4, 0};
+    client->write(packet, sizeof(packet));
+  }
+  isConnected = false;
+  client->stop();
+  return true;
+}
+
+lwmqtt_err_t CloudIoTCoreMqttCodec::lastError()
+{
+  return error;
+}
+
+lwmqtt_return_code_t CloudIoTCoreMqttCodec::returnCode()
+{
+  return code;
+}
+
+bool CloudIoTCoreMqttCodec::sendAck(uint8_t type, uint16_t packet_id)
+{
+  uint8_t packet[4] = {(uint8_t)(type << 4), 2, (uint8_t)(packet_id >> 8),
+                       (uint8_t)packet_id};
+  if (client->write(packet, sizeof(packet)) != sizeof(packet)) {
+    fail(LWMQTT_NETWORK_FAILED_WRITE);
+    return false;
+  }
+  lastSend = millis();
+  return true;
+}
+
+// Feeds whatever the Client has buffered to the parser.
+bool CloudIoTCoreMqttCodec::receive()
+{
+  uint8_t buffer[64];
+  int available;
+  while (client != NULL && (available = client->available()) > 0) {
+    if (available > (int)sizeof(buffer)) {
+      available = sizeof(buffer);
+    }
+    int n = client->read(buffer, available);
+    if (n <= 0) {
+      fail(LWMQTT_NETWORK_FAILED_READ);
+      return false;
+    }
+    if (!parse(buffer, n)) {
+      return false;
+    }
+  }
+  return client != NULL;
+}
+
+// False once an error has closed the connection.
+bool CloudIoTCoreMqttCodec::parse(const uint8_t *data, size_t length)
+{
+  while (length > 0) {
+    switch (parseState) {
+      case PARSE_HEADER:
+        header = *data++;
+        length--;
+        remaining = 0;
+        lengthShift = 0;
+        parseState = PARSE_LENGTH;
+        break;
+
+      case PARSE_LENGTH: {
+        uint8_t b = *data++;
+        length--;
+        remaining |= (uint32_t)(b & 0x7f) << lengthShift;
+        lengthShift += 7;
+        if (b & 0x80) {
+          if (lengthShift >= 28) {
+            fail(LWMQTT_VARNUM_OVERFLOW);
+            parseState = PARSE_HEADER;
+            return false;
+          }
+          break;
+        }
+        bodyLength = remaining;
+        bodyRead = 0;
+        // A QoS 1 message that cannot be delivered must not be acked, so
+        // close the connection like lwmqtt does and let the broker send it
+        // again. Longer QoS 0 messages are skipped.
+        if ((header >> 4) == MQTT_PUBLISH && (header & 0x06) &&
+            bodyLength > CLOUD_IOT_CORE_CODEC_INBOUND) {
+          ciotc_log_error("QoS 1 message of %u bytes, more than %d",
+                          (unsigned)bodyLength, CLOUD_IOT_CORE_CODEC_INBOUND);
+          fail(LWMQTT_BUFFER_TOO_SHORT);
+          parseState = PARSE_HEADER;
+          return false;
+        }
+        if (bodyLength == 0) {
+          packetDone();
+        } else {
+          parseState = PARSE_BODY;
+        }
+        break;
+      }
+
+      case PARSE_BODY: {
+        // Copy what fits in the buffer, drop the rest of an oversized body.
+        size_t n = bodyLength - bodyRead;
+        if (n > length) {
+          n = length;
+        }
+        if (bodyRead < CLOUD_IOT_CORE_CODEC_INBOUND) {
+          size_t room = CLOUD_IOT_CORE_CODEC_INBOUND - bodyRead;
+          memcpy(body + bodyRead, data, n < room ? n : room);
+        }
+        bodyRead += n;
+        data += n;
+        length -= n;
+        if (bodyRead == bodyLength) {
+          packetDone();
+        }
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+void CloudIoTCoreMqttCodec::packetDone()
+{
+  parseState = PARSE_HEADER;
+  lastReceive = millis();
+  uint8_t type = header >> 4;
+  size_t held = bodyLength < CLOUD_IOT_CORE_CODEC_INBOUND
+                    ? bodyLength
+                    : CLOUD_IOT_CORE_CODEC_INBOUND;
+
+  switch (type) {
+    case MQTT_CONNACK:
+      if (held >= 2) {
+        present = body[0] & 0x01;
+        ackCode = body[1];
+        ackType = type;
+      }
+      break;
+
+    case MQTT_PUBACK:
+      if (held >= 2) {
+        ackId = (body[0] << 8) | body[1];
+        ackType = type;
+      }
+      break;
+
+    case MQTT_SUBACK:
+      if (held >= 3) {
+        ackId = (body[0] << 8) | body[1];
+        ackCode = body[2];
+        ackType = type;
+      }
+      break;
+
+    case MQTT_PINGRESP:
+      pingOutstanding = false;
+      break;
+
+    case MQTT_PUBLISH: {
+      uint8_t qos = (header >> 1) & 0x03;
+      if (held < 2) {
+        break;
+      }
+      size_t topic_len = (body[0] << 8) | body[1];
+      size_t offset = 2 + topic_len + (qos ? 2 : 0);
+      if (offset > held) {
+        ciotc_log_warn("dropped message, topic too long");
+        break;
+      }
+      uint16_t id = qos ? (body[2 + topic_len] << 8) | body[3 + topic_len] : 0;
+      if (bodyLength > CLOUD_IOT_CORE_CODEC_INBOUND) {
+        ciotc_log_warn("dropped message of %u bytes", (unsigned)bodyLength);
+      } else {
+        // NUL terminate both in place: the topic moves over its length
+        // prefix and the buffer has a spare byte after the payload.
+        char *payload = (char *)body + offset;
+        int payload_len = bodyLength - offset;
+        memmove(body, body + 2, topic_len);
+        body[topic_len] = 0;
+        body[bodyLength] = 0;
+        if (advancedCallback != NULL) {
+          advancedCallback(this, (char *)body, payload, payload_len);
+        } else if (simpleCallback != NULL) {
+          String topic((char *)body);
+          String text;
+          text.reserve(payload_len);
+          for (int i = 0; i < payload_len; i++) {
+            text += payload[i];
+          }
+          simpleCallback(topic, text);
+        }
+      }
+      if (qos == 1) {
+        sendAck(MQTT_PUBACK, id);
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+// Reads until the acknowledgement arrives, messages that come first are
+// delivered on the way.
+bool CloudIoTCoreMqttCodec::waitFor(uint8_t type, uint16_t packet_id)
+{
+  unsigned long start = millis();
+  while (millis() - start < timeoutMs) {
+    if (!receive()) {
+      return false;
+    }
+    if (ackType == type && (packet_id == 0 || ackId == packet_id)) {
+      ackType = 0;
+      return true;
+    }
+    if (!client->connected()) {
+      fail(LWMQTT_NETWORK_FAILED_READ);
+      return false;
+    }
+    yield();
+  }
+  fail(LWMQTT_NETWORK_TIMEOUT);
+  return false;
+}
+
+#endif  // CLOUD_IOT_CORE_NATIVE_MQTT
@@ -0,0 +1,166 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreMqttCodec_h
+#define CloudIoTCoreMqttCodec_h
+
+// Built in MQTT 3.1.1 client, used instead of arduino-mqtt/lwmqtt when
+// the library is built with -DCLOUD_IOT_CORE_NATIVE_MQTT=1. It has the
+// part of the MQTTClient interface CloudIoTCoreMqtt uses and takes its
+// place under that name, so sketches keep constructing an MQTTClient but
+// must not include <MQTTClient.h> themselves.
+//
+// Outgoing packets are serialized around the caller's buffers: headers
+// are built on the stack and payloads (and the JWT in CONNECT) are written
+// to the Client from where they are. Inbound packets are parsed as bytes
+// arrive; a PUBLISH is collected in one fixed buffer of
+// CLOUD_IOT_CORE_CODEC_INBOUND bytes, so nothing needs a read/write buffer
+// pair or the heap.
+#ifndef CLOUD_IOT_CORE_NATIVE_MQTT
+#define CLOUD_IOT_CORE_NATIVE_MQTT 0
+#endif
+
+#if CLOUD_IOT_CORE_NATIVE_MQTT
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Largest inbound PUBLISH body (topic and payload) that is delivered,
+// which must cover the largest config. A longer QoS 0 message is skipped;
+// a longer QoS 1 message (config) closes the connection with
+// LWMQTT_BUFFER_TOO_SHORT without acknowledging it.
+#ifndef CLOUD_IOT_CORE_CODEC_INBOUND
+#define CLOUD_IOT_CORE_CODEC_INBOUND 512
+#endif
+// Headers and payloads up to this size are written in one Client write.
+#ifndef CLOUD_IOT_CORE_CODEC_CHUNK
+#define CLOUD_IOT_CORE_CODEC_CHUNK 128
+#endif
+
+// Same names and values as lwmqtt so error reporting does not change.
+typedef enum {
+  LWMQTT_SUCCESS = 0,
+  LWMQTT_BUFFER_TOO_SHORT = -1,
+  LWMQTT_VARNUM_OVERFLOW = -2,
+  LWMQTT_NETWORK_FAILED_CONNECT = -3,
+  LWMQTT_NETWORK_TIMEOUT = -4,
+  LWMQTT_NETWORK_FAILED_READ = -5,
+  LWMQTT_NETWORK_FAILED_WRITE = -6,
+  LWMQTT_REMAINING_LENGTH_OVERFLOW = -7,
+  LWMQTT_REMAINING_LENGTH_MISMATCH = -8,
+  LWMQTT_MISSING_OR_WRONG_PACKET = -9,
+  LWMQTT_CONNECTION_DENIED = -10,
+  LWMQTT_FAILED_SUBSCRIPTION = -11,
+  LWMQTT_SUBACK_ARRAY_OVERFLOW = -12,
+  LWMQTT_PONG_TIMEOUT = -13
+} lwmqtt_err_t;
+
+typedef enum {
+  LWMQTT_CONNECTION_ACCEPTED = 0,
+  LWMQTT_UNACCEPTABLE_PROTOCOL = 1,
+  LWMQTT_IDENTIFIER_REJECTED = 2,
+  LWMQTT_SERVER_UNAVAILABLE = 3,
+  LWMQTT_BAD_USERNAME_OR_PASSWORD = 4,
+  LWMQTT_NOT_AUTHORIZED = 5,
+  LWMQTT_UNKNOWN_RETURN_CODE = 6
+} lwmqtt_return_code_t;
+
+class CloudIoTCoreMqttCodec;
+typedef void (*MQTTClientCallbackSimple)(String &topic, String &payload);
+typedef void (*MQTTClientCallbackAdvanced)(CloudIoTCoreMqttCodec *client,
+                                           char topic[], char bytes[],
+                                           int length);
+
+class CloudIoTCoreMqttCodec {
+  public:
+    // The size is accepted for compatibility, the inbound buffer is
+    // CLOUD_IOT_CORE_CODEC_INBOUND.
+    explicit CloudIoTCoreMqttCodec(int size = 0);
+
+    void begin(const char *host, int port, Client &client);
+    void onMessage(MQTTClientCallbackSimple callback);
+    void onMessageAdvanced(MQTTClientCallbackAdvanced callback);
+    // keep_alive in seconds, timeout in milliseconds for each wait on the
+    // broker (CONNACK, SUBACK, QoS 1 PUBACK).
+    void setOptions(int keep_alive, bool clean_session, int timeout);
+    void setCleanSession(bool clean_session);
+
+    // Connects the Client first unless skip is true, then sends CONNECT
+    // and waits for the CONNACK.
+    bool connect(const char *client_id, const char *username = NULL,
+                 const char *password = NULL, bool skip = false);
+    bool publish(const char *topic, const char *payload, int length);
+    bool publish(const char *topic, const char *payload, int length,
+                 bool retained, int qos);
+    bool subscribe(const char *topic, int qos = 0);
+    // Reads what has arrived, delivers messages and keeps the connection
+    // alive.
+    bool loop();
+    bool connected();
+    bool sessionPresent();
+    bool disconnect();
+    lwmqtt_err_t lastError();
+    lwmqtt_return_code_t returnCode();
+
+  private:
+    enum ParseState {
+      PARSE_HEADER,
+      PARSE_LENGTH,
+      PARSE_BODY
+    };
+
+    Client *client;
+    const char *host;
+    int port;
+    MQTTClientCallbackSimple simpleCallback;
+    MQTTClientCallbackAdvanced advancedCallback;
+    unsigned long keepAliveMs;
+    bool cleanSession;
+    unsigned long timeoutMs;
+
+    bool isConnected;
+    bool present;
+    lwmqtt_err_t error;
+    lwmqtt_return_code_t code;
+    uint16_t nextPacketId;
+    unsigned long lastSend;
+    unsigned long lastReceive;
+    bool pingOutstanding;
+
+    // Incremental parser.
+    ParseState parseState;
+    uint8_t header;
+    uint8_t lengthShift;
+    uint32_t remaining;
+    uint32_t bodyLength;
+    uint32_t bodyRead;
+    // Last acknowledgement seen, for the waits.
+    uint8_t ackType;
+    uint16_t ackId;
+    uint8_t ackCode;
+    uint8_t body[CLOUD_IOT_CORE_CODEC_INBOUND + 1];
+
+    bool sendAck(uint8_t type, uint16_t packet_id);
+    bool receive();
+    bool parse(const uint8_t *data, size_t length);
+    void packetDone();
+    bool waitFor(uint8_t type, uint16_t packet_id);
+    void fail(lwmqtt_err_t err);
+    uint16_t packetId();
+};
+
+#endif  // CLOUD_IOT_CORE_NATIVE_MQTT
+
+#endif  // CloudIoTCoreMqttCodec_h
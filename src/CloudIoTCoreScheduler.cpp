@@ -0,0 +1,204 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <string.h>
+#include "CloudIoTCoreScheduler.h"
+#include "CloudIoTCoreLog.h"
+
+CloudIoTCoreScheduler::CloudIoTCoreScheduler()
+    : nclasses(2), peeked(NULL), nextSeq(1)
+{
+  buckets[CLASS_STATE].subfolder = NULL;
+  buckets[CLASS_TELEMETRY].subfolder = NULL;
+  setRate(CLASS_STATE, 1, 1);
+  setRate(CLASS_TELEMETRY, 10, 10);
+  for (int i = 0; i < CLOUD_IOT_CORE_SCHED_SLOTS; i++) {
+    slots[i].seq = 0;
+  }
+  for (int i = 0; i < LANES; i++) {
+    lost[i] = 0;
+  }
+}
+
+void CloudIoTCoreScheduler::setRate(int cls, float rate, float burst)
+{
+  if (cls < 0 || cls >= nclasses) {
+    return;
+  }
+  Bucket &b = buckets[cls];
+  b.rate = rate;
+  b.burst = burst < 1 ? 1 : burst;
+  b.tokens = b.burst;
+  b.last = millis();
+}
+
+int CloudIoTCoreScheduler::addSubfolder(const char *subfolder, float rate,
+                                        float burst)
+{
+  int cls = classFor(subfolder);
+  if (cls == CLASS_TELEMETRY) {
+    if (nclasses == CLOUD_IOT_CORE_SCHED_CLASSES) {
+      return -1;
+    }
+    cls = nclasses++;
+    buckets[cls].subfolder = subfolder;
+  }
+  setRate(cls, rate, burst);
+  return cls;
+}
+
+int CloudIoTCoreScheduler::classFor(const char *subfolder)
+{
+  if (subfolder != NULL) {
+    for (int i = CLASS_TELEMETRY + 1; i < nclasses; i++) {
+      if (strcmp(buckets[i].subfolder, subfolder) == 0) {
+        return i;
+      }
+    }
+  }
+  return CLASS_TELEMETRY;
+}
+
+bool CloudIoTCoreScheduler::hasToken(int cls)
+{
+  Bucket &b = buckets[cls];
+  unsigned long now = millis();
+  b.tokens += (now - b.last) * b.rate / 1000;
+  if (b.tokens > b.burst) {
+    b.tokens = b.burst;
+  }
+  b.last = now;
+  return b.tokens >= 1;
+}
+
+bool CloudIoTCoreScheduler::take(int cls)
+{
+  if (cls < 0 || cls >= nclasses || !hasToken(cls)) {
+    return false;
+  }
+  buckets[cls].tokens -= 1;
+  return true;
+}
+
+bool CloudIoTCoreScheduler::push(int cls, Lane lane, const char *topic,
+                                 const char *data, size_t length)
+{
+  if (cls < 0 || cls >= nclasses || lane >= LANES ||
+      length > CLOUD_IOT_CORE_SCHED_PAYLOAD) {
+    ciotc_log_error("message of %u bytes cannot be queued", (unsigned)length);
+    lost[lane < LANES ? lane : LANE_BULK]++;
+    return false;
+  }
+
+  // A free slot, or else the oldest message of the lowest lane below this
+  // one.
+  Message *slot = NULL;
+  for (int i = 0; i < CLOUD_IOT_CORE_SCHED_SLOTS; i++) {
+    Message &m = slots[i];
+    if (m.seq == 0) {
+      slot = &m;
+      break;
+    }
+    if (m.lane > lane && &m != peeked &&
+        (slot == NULL || m.lane > slot->lane ||
+         (m.lane == slot->lane && m.seq < slot->seq))) {
+      slot = &m;
+    }
+  }
+  if (slot == NULL) {
+    lost[lane]++;
+    return false;
+  }
+  if (slot->seq != 0) {
+    lost[slot->lane]++;
+  }
+
+  slot->topic = topic;
+  slot->length = length;
+  slot->lane = lane;
+  slot->cls = cls;
+  slot->seq = nextSeq++;
+  memcpy(slot->payload, data, length);
+  return true;
+}
+
+CloudIoTCoreScheduler::Message *CloudIoTCoreScheduler::peek()
+{
+  // Classes are checked at most once, a class without tokens blocks all
+  // of its messages.
+  bool ready[CLOUD_IOT_CORE_SCHED_CLASSES];
+  bool checked[CLOUD_IOT_CORE_SCHED_CLASSES] = {false};
+  peeked = NULL;
+  for (int i = 0; i < CLOUD_IOT_CORE_SCHED_SLOTS; i++) {
+    Message &m = slots[i];
+    if (m.seq == 0) {
+      continue;
+    }
+    if (peeked != NULL && (m.lane > peeked->lane ||
+                           (m.lane == peeked->lane && m.seq > peeked->seq))) {
+      continue;
+    }
+    if (!checked[m.cls]) {
+      ready[m.cls] = hasToken(m.cls);
+      checked[m.cls] = true;
+    }
+    if (ready[m.cls]) {
+      peeked = &m;
+    }
+  }
+  return peeked;
+}
+
+void CloudIoTCoreScheduler::pop()
+{
+  if (peeked == NULL) {
+    return;
+  }
+  buckets[peeked->cls].tokens -= 1;
+  peeked->seq = 0;
+  peeked = NULL;
+}
+
+uint8_t CloudIoTCoreScheduler::depth()
+{
+  uint8_t n = 0;
+  for (int i = 0; i < CLOUD_IOT_CORE_SCHED_SLOTS; i++) {
+    n += slots[i].seq != 0;
+  }
+  return n;
+}
+
+uint8_t CloudIoTCoreScheduler::depth(Lane lane)
+{
+  uint8_t n = 0;
+  for (int i = 0; i < CLOUD_IOT_CORE_SCHED_SLOTS; i++) {
+    n += slots[i].seq != 0 && slots[i].lane == lane;
+  }
+  return n;
+}
+
+uint32_t CloudIoTCoreScheduler::dropped()
+{
+  uint32_t n = 0;
+  for (int i = 0; i < LANES; i++) {
+    n += lost[i];
+  }
+  return n;
+}
+
+uint32_t CloudIoTCoreScheduler::dropped(Lane lane)
+{
+  return lane < LANES ? lost[lane] : 0;
+}
@@ -0,0 +1,113 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreScheduler_h
+#define CloudIoTCoreScheduler_h
+
+#include <Arduino.h>
+
+// Messages waiting to be sent, the largest payload one can hold, and
+// message classes (state, telemetry and per-subfolder telemetry).
+#ifndef CLOUD_IOT_CORE_SCHED_SLOTS
+#define CLOUD_IOT_CORE_SCHED_SLOTS 8
+#endif
+#ifndef CLOUD_IOT_CORE_SCHED_PAYLOAD
+#define CLOUD_IOT_CORE_SCHED_PAYLOAD 256
+#endif
+#ifndef CLOUD_IOT_CORE_SCHED_CLASSES
+#define CLOUD_IOT_CORE_SCHED_CLASSES 6
+#endif
+
+// Outbound rate limiter. Every message class has a token bucket and a
+// message is only sent once its class has a token, which keeps a device
+// under the IoT Core limits (state updates at 1 per second) instead of
+// being disconnected for exceeding them. Among the messages that may go,
+// urgent ones go before normal ones and normal ones before bulk; bulk is
+// also where CloudIoTCoreMqtt replays its spool. When the queue is full a
+// new message replaces the oldest one of a lower lane, or is dropped.
+//
+// Attach it with CloudIoTCoreMqtt::setScheduler(), which then queues QoS 0
+// publishes here and sends them from poll().
+class CloudIoTCoreScheduler {
+  public:
+    enum Lane {
+      LANE_URGENT,
+      LANE_NORMAL,
+      LANE_BULK,
+      LANES
+    };
+    // Built in classes, addSubfolder() adds more.
+    enum {
+      CLASS_STATE,
+      CLASS_TELEMETRY
+    };
+
+    struct Message {
+      const char *topic;
+      uint16_t length;
+      uint8_t lane;
+      uint8_t cls;
+      uint32_t seq;  // 0 when the slot is free
+      char payload[CLOUD_IOT_CORE_SCHED_PAYLOAD];
+    };
+
+    // State defaults to 1 per second, telemetry to 10 per second with
+    // bursts of 10.
+    CloudIoTCoreScheduler();
+
+    // rate in messages per second, burst the most that can go at once.
+    void setRate(int cls, float rate, float burst);
+    // Class for telemetry to one subfolder such as "/alerts", -1 if there
+    // are too many classes. subfolder must stay valid.
+    int addSubfolder(const char *subfolder, float rate, float burst);
+    // The subfolder's class, CLASS_TELEMETRY if it has none.
+    int classFor(const char *subfolder);
+
+    // Copies the message in, false if it was dropped. topic must stay
+    // valid until it is sent.
+    bool push(int cls, Lane lane, const char *topic, const char *data,
+              size_t length);
+    // The message to send now or NULL, it stays queued until pop().
+    Message *peek();
+    // Removes the message peek() returned and uses its token.
+    void pop();
+    // Takes a token for a message sent outside the queue, false if the
+    // class has none left.
+    bool take(int cls);
+
+    uint8_t depth();
+    uint8_t depth(Lane lane);
+    uint32_t dropped();
+    uint32_t dropped(Lane lane);
+
+  private:
+    struct Bucket {
+      const char *subfolder;
+      float rate;
+      float burst;
+      float tokens;
+      unsigned long last;
+    };
+    Bucket buckets[CLOUD_IOT_CORE_SCHED_CLASSES];
+    uint8_t nclasses;
+    Message slots[CLOUD_IOT_CORE_SCHED_SLOTS];
+    Message *peeked;
+    uint32_t nextSeq;
+    uint32_t lost[LANES];
+
+    bool hasToken(int cls);
+};
+
+#endif  // CloudIoTCoreScheduler_h
@@ -0,0 +1,286 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <Arduino.h>
+#include "CloudIoTCoreSigner.h"
+
+// Shared by all signers, filled by the first SIGNER_INIT step. ecc.cpp
+// keeps the same table but does not expose it, so ecc_init() (which fills
+// it) is not called: the curve is loaded on its own and ecc.cpp's copy is
+// never computed, nor linked where unused sections are dropped.
+static bool curve_ready = false;
+static point_t base_table[NUM_POINTS];
+static NN_DIGIT order[NUMWORDS];
+
+static bool is_one(NN_DIGIT *a)
+{
+  if (a[0] != 1) {
+    return false;
+  }
+  for (int i = 1; i < NUMWORDS; i++) {
+    if (a[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Mixed Jacobian + affine addition, P0 = P1 + P2, copied from the static
+// c_add_mix in crypto/ecc.cpp which ecc_win_mul uses (ecc_add_proj
+// mishandles the general case).
+static void add_mix(point_t *P0, NN_DIGIT *Z0, point_t *P1, NN_DIGIT *Z1,
+                    point_t *P2)
+{
+  curve_params_t *param = ecc_get_param();
+  NN_DIGIT t1[NUMWORDS];
+  NN_DIGIT t2[NUMWORDS];
+  NN_DIGIT t3[NUMWORDS];
+  NN_DIGIT t4[NUMWORDS];
+  NN_DIGIT Z2[NUMWORDS];
+
+  /* P2 == infinity */
+  if (NN_Zero(P2->x, NUMWORDS) && NN_Zero(P2->y, NUMWORDS)) {
+    *P0 = *P1;
+    NN_Assign(Z0, Z1, NUMWORDS);
+    return;
+  }
+
+  /* P1 == infinity */
+  if (NN_Zero(Z1, NUMWORDS)) {
+    *P0 = *P2;
+    NN_AssignDigit(Z0, 1, NUMWORDS);
+    return;
+  }
+
+  /* T1 = Z1^2 * P2->x - P1->x, T2 = Z1^3 * P2->y - P1->y */
+  NN_ModSqrOpt(t1, Z1, param->p, param->omega, NUMWORDS);
+  NN_ModMultOpt(t2, t1, Z1, param->p, param->omega, NUMWORDS);
+  NN_ModMultOpt(t1, t1, P2->x, param->p, param->omega, NUMWORDS);
+  NN_ModMultOpt(t2, t2, P2->y, param->p, param->omega, NUMWORDS);
+  NN_ModSub(t1, t1, P1->x, param->p, NUMWORDS);
+  NN_ModSub(t2, t2, P1->y, param->p, NUMWORDS);
+
+  if (NN_Zero(t1, NUMWORDS)) {
+    if (NN_Zero(t2, NUMWORDS)) {
+      NN_AssignDigit(Z2, 1, NUMWORDS);
+      ecc_dbl_proj(P0, Z0, P2, Z2);
+    } else {
+      NN_AssignDigit(Z0, 0, NUMWORDS);
+    }
+    return;
+  }
+
+  /* Z3 = Z1*T1, T4 = T1^3, T3 = T1^2 * P1->x */
+  NN_ModMultOpt(Z0, Z1, t1, param->p, param->omega, NUMWORDS);
+  NN_ModSqrOpt(t3, t1, param->p, param->omega, NUMWORDS);
+  NN_ModMultOpt(t4, t3, t1, param->p, param->omega, NUMWORDS);
+  NN_ModMultOpt(t3, t3, P1->x, param->p, param->omega, NUMWORDS);
+  /* X3 = T2^2 - 2*T3 - T4 */
+  NN_LShift(t1, t3, 1, NUMWORDS);
+  NN_ModSmall(t1, param->p, NUMWORDS);
+  NN_ModSqrOpt(P0->x, t2, param->p, param->omega, NUMWORDS);
+  NN_ModSub(P0->x, P0->x, t1, param->p, NUMWORDS);
+  NN_ModSub(P0->x, P0->x, t4, param->p, NUMWORDS);
+  /* Y3 = T2 * (T3 - X3) - T4 * P1->y */
+  NN_ModSub(t3, t3, P0->x, param->p, NUMWORDS);
+  NN_ModMultOpt(t3, t3, t2, param->p, param->omega, NUMWORDS);
+  NN_ModMultOpt(t4, t4, P1->y, param->p, param->omega, NUMWORDS);
+  NN_ModSub(P0->y, t3, t4, param->p, NUMWORDS);
+}
+
+EcdsaSigner::EcdsaSigner() : state(SIGNER_IDLE), d(NULL) {}
+
+void EcdsaSigner::begin(const unsigned char _hash[SHA256_DIGEST_LENGTH],
+                        NN_DIGIT *priv_key)
+{
+  memcpy(hash, _hash, SHA256_DIGEST_LENGTH);
+  d = priv_key;
+  state = curve_ready ? SIGNER_NONCE : SIGNER_INIT;
+}
+
+bool EcdsaSigner::done()
+{
+  return state == SIGNER_DONE;
+}
+
+void EcdsaSigner::getSignature(NN_DIGIT *_r, NN_DIGIT *_s)
+{
+  NN_Assign(_r, r, NUMWORDS);
+  NN_Assign(_s, s, NUMWORDS);
+}
+
+bool EcdsaSigner::step(unsigned long budget_us)
+{
+  unsigned long start = micros();
+  do {
+    unit();
+  } while (state != SIGNER_DONE && state != SIGNER_IDLE &&
+           micros() - start < budget_us);
+  return state == SIGNER_DONE;
+}
+
+void EcdsaSigner::startInverse(NN_DIGIT *value, NN_DIGIT *mod)
+{
+  NN_AssignZero(u1, NUMWORDS);
+  u1[0] = 1;
+  NN_AssignZero(v1, NUMWORDS);
+  NN_Assign(u3, value, NUMWORDS);
+  NN_Assign(v3, mod, NUMWORDS);
+  u1Sign = 1;
+  modulus = mod;
+}
+
+// One iteration of the extended Euclidean algorithm in NN_ModInv. Returns
+// true and writes the inverse once it is complete.
+bool EcdsaSigner::stepInverse(NN_DIGIT *result)
+{
+  if (!NN_Zero(v3, NUMWORDS)) {
+    NN_DIGIT q[NUMWORDS], t1[NUMWORDS], t3[NUMWORDS], w[2 * NUMWORDS];
+    NN_Div(q, t3, u3, NUMWORDS, v3, NUMWORDS);
+    NN_Mult(w, q, v1, NUMWORDS);
+    NN_Add(t1, u1, w, NUMWORDS);
+    NN_Assign(u1, v1, NUMWORDS);
+    NN_Assign(v1, t1, NUMWORDS);
+    NN_Assign(u3, v3, NUMWORDS);
+    NN_Assign(v3, t3, NUMWORDS);
+    u1Sign = -u1Sign;
+    return false;
+  }
+  if (u1Sign < 0) {
+    NN_Sub(result, modulus, u1, NUMWORDS);
+  } else {
+    NN_Assign(result, u1, NUMWORDS);
+  }
+  return true;
+}
+
+void EcdsaSigner::unit()
+{
+  curve_params_t *param = ecc_get_param();
+
+  switch (state) {
+    case SIGNER_IDLE:
+    case SIGNER_DONE:
+      break;
+
+    case SIGNER_INIT:
+      get_curve_param(param);
+      ecc_win_precompute(ecc_get_base_p(), base_table);
+      ecc_get_order(order);
+      curve_ready = true;
+      state = SIGNER_NONCE;
+      break;
+
+    case SIGNER_NONCE:
+      ecc_gen_private_key(k);
+      if (NN_Zero(k, NUMWORDS)) {
+        break;
+      }
+      NN_AssignZero(P.x, NUMWORDS);
+      NN_AssignZero(P.y, NUMWORDS);
+      NN_AssignZero(Z0, NUMWORDS);
+      digit = NN_Digits(k, NUMWORDS) - 1;
+      window = NN_DIGIT_BITS / W_BITS - 1;
+      doubled = false;
+      state = SIGNER_MUL;
+      break;
+
+    case SIGNER_MUL:
+      if (digit < 0) {
+        if (is_one(Z0)) {
+          state = SIGNER_AFFINE;
+        } else {
+          startInverse(Z0, param->p);
+          state = SIGNER_INV_Z;
+        }
+      } else if (!doubled) {
+        ecc_m_dbl_projective(&P, Z0, W_BITS);
+        doubled = true;
+      } else {
+        NN_DIGIT windex = (k[digit] >> (window * W_BITS)) & BASIC_MASK;
+        if (windex) {
+          add_mix(&P, Z0, &P, Z0, &base_table[windex - 1]);
+        }
+        doubled = false;
+        if (--window < 0) {
+          window = NN_DIGIT_BITS / W_BITS - 1;
+          digit--;
+        }
+      }
+      break;
+
+    case SIGNER_INV_Z: {
+      NN_DIGIT Z1[NUMWORDS];
+      if (!stepInverse(Z1)) {
+        break;
+      }
+      NN_ModMultOpt(Z0, Z1, Z1, param->p, param->omega, NUMWORDS);
+      NN_ModMultOpt(P.x, P.x, Z0, param->p, param->omega, NUMWORDS);
+      NN_ModMultOpt(Z0, Z0, Z1, param->p, param->omega, NUMWORDS);
+      NN_ModMultOpt(P.y, P.y, Z0, param->p, param->omega, NUMWORDS);
+      state = SIGNER_AFFINE;
+      break;
+    }
+
+    case SIGNER_AFFINE:
+      NN_Mod(r, P.x, NUMWORDS, order, NUMWORDS);
+      if (NN_Zero(r, NUMWORDS)) {
+        state = SIGNER_NONCE;
+        break;
+      }
+      startInverse(k, order);
+      state = SIGNER_INV_K;
+      break;
+
+    case SIGNER_INV_K: {
+      // k is not needed once inverted, keep k^-1 in its place.
+      NN_DIGIT k_inv[NUMWORDS];
+      if (stepInverse(k_inv)) {
+        NN_Assign(k, k_inv, NUMWORDS);
+        state = SIGNER_FINISH;
+      }
+      break;
+    }
+
+    case SIGNER_FINISH: {
+      // Same digest reduction as ecdsa_sign().
+      NN_DIGIT digest[NUMWORDS];
+      NN_DIGIT sha256tmp[SHA256_DIGEST_LENGTH / NN_DIGIT_LEN];
+      NN_DIGIT dr[NUMWORDS];
+      NN_DIGIT tmp[NUMWORDS];
+      NN_Decode(sha256tmp, SHA256_DIGEST_LENGTH / NN_DIGIT_LEN, hash,
+                SHA256_DIGEST_LENGTH);
+      NN_UINT result_bit_len =
+          NN_Bits(sha256tmp, SHA256_DIGEST_LENGTH / NN_DIGIT_LEN);
+      NN_UINT order_bit_len = NN_Bits(order, NUMWORDS);
+      if (result_bit_len > order_bit_len) {
+        NN_Mod(digest, sha256tmp, SHA256_DIGEST_LENGTH / NN_DIGIT_LEN, order,
+               NUMWORDS);
+      } else {
+        memset(digest, 0, NUMBYTES);
+        NN_Assign(digest, sha256tmp, SHA256_DIGEST_LENGTH / NN_DIGIT_LEN);
+        if (result_bit_len == order_bit_len) {
+          NN_ModSmall(digest, order, NUMWORDS);
+        }
+      }
+
+      NN_ModMult(dr, d, r, order, NUMWORDS);
+      NN_ModAdd(tmp, digest, dr, order, NUMWORDS);
+      NN_ModMult(s, k, tmp, order, NUMWORDS);
+      state = NN_Zero(s, NUMWORDS) ? SIGNER_NONCE : SIGNER_DONE;
+      break;
+    }
+  }
+}
@@ -0,0 +1,80 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreSigner_h
+#define CloudIoTCoreSigner_h
+
+#include "crypto/ecdsa.h"
+
+// ECDSA signing split into small units of work (one window of point
+// doublings, one point addition or one Euclid iteration) so it can be spread
+// over several loop() iterations:
+//
+//   signer.begin(hash, priv_key);
+//   while (!signer.step(5000)) { /* service other work */ }
+//   signer.getSignature(r, s);
+//
+// Produces the same signatures as ecdsa_sign(). The first begin() after boot
+// also initializes the curve, which happens in the first step().
+class EcdsaSigner {
+  public:
+    EcdsaSigner();
+    void begin(const unsigned char hash[SHA256_DIGEST_LENGTH],
+               NN_DIGIT *priv_key);
+    // Works for roughly budget_us microseconds (at least one unit) and
+    // returns true once the signature is ready.
+    bool step(unsigned long budget_us);
+    bool done();
+    // r and s must hold NUMWORDS digits.
+    void getSignature(NN_DIGIT *r, NN_DIGIT *s);
+
+  private:
+    enum State {
+      SIGNER_IDLE,
+      SIGNER_INIT,      // one time curve setup
+      SIGNER_NONCE,     // pick k
+      SIGNER_MUL,       // P = k * G, mirrors ecc_win_mul()
+      SIGNER_INV_Z,     // Z^-1 mod p, one Euclid iteration per unit
+      SIGNER_AFFINE,    // back to affine, r = P.x mod n
+      SIGNER_INV_K,     // k^-1 mod n, one Euclid iteration per unit
+      SIGNER_FINISH,    // s = k^-1 (e + d r) mod n
+      SIGNER_DONE
+    };
+    State state;
+    NN_DIGIT *d;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+
+    // Scalar multiplication state, mirrors the loops of ecc_win_mul().
+    NN_DIGIT k[NUMWORDS];
+    point_t P;
+    NN_DIGIT Z0[NUMWORDS];
+    int16_t digit;
+    int8_t window;
+    bool doubled;
+
+    // Extended Euclid state, mirrors NN_ModInv().
+    NN_DIGIT u1[NUMWORDS], v1[NUMWORDS], u3[NUMWORDS], v3[NUMWORDS];
+    int u1Sign;
+    NN_DIGIT *modulus;
+
+    NN_DIGIT r[NUMWORDS];
+    NN_DIGIT s[NUMWORDS];
+
+    void unit();
+    void startInverse(NN_DIGIT *value, NN_DIGIT *mod);
+    bool stepInverse(NN_DIGIT *result);
+};
+
+#endif  // CloudIoTCoreSigner_h
@@ -0,0 +1,484 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include "CloudIoTCoreSpool.h"
+
+#if defined(CLOUD_IOT_CORE_SPOOL_STDIO)
+#include <stdio.h>
+#include <sys/stat.h>
+#endif
+
+#define RECORD_HEADER 4
+#define CURSOR_MAGIC 0x5350
+
+static uint16_t fletcher16(const char *data, size_t length)
+{
+  uint16_t a = 0, b = 0;
+  for (size_t i = 0; i < length; i++) {
+    a = (a + (uint8_t)data[i]) % 255;
+    b = (b + a) % 255;
+  }
+  return (b << 8) | a;
+}
+
+static void put32(char *out, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) {
+    out[i] = (char)(v >> (8 * i));
+  }
+}
+
+static uint32_t get32(const char *in)
+{
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--) {
+    v = (v << 8) | (uint8_t)in[i];
+  }
+  return v;
+}
+
+#if defined(CLOUD_IOT_CORE_SPOOL_FS)
+CloudIoTCoreSpool::CloudIoTCoreSpool(fs::FS &_fs, const char *_dir)
+    : fs(_fs), ready(false)
+#else
+CloudIoTCoreSpool::CloudIoTCoreSpool(const char *_dir) : ready(false)
+#endif
+{
+  strncpy(dir, _dir, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+  head_seq = tail_seq = 1;
+  head_size = tail_offset = 0;
+  generation = 0;
+  unsynced = 0;
+  records = payload_bytes = lost = 0;
+  peeked_offset = 0;
+  peeked_length = 0;
+}
+
+void CloudIoTCoreSpool::segmentPath(uint32_t seq, char *out)
+{
+  sprintf(out, "%s/%08lx.spl", dir, (unsigned long)seq);
+}
+
+bool CloudIoTCoreSpool::begin()
+{
+  char path[40];
+
+#if !defined(CLOUD_IOT_CORE_SPOOL_FS) && !defined(CLOUD_IOT_CORE_SPOOL_STDIO)
+  return false;
+#endif
+  makeDir();
+  if (!loadCursor()) {
+    tail_seq = 1;
+    tail_offset = 0;
+    generation = 0;
+  }
+
+  // Segments consumed just before a crash, not removed yet.
+  for (uint32_t i = 1; i <= CLOUD_IOT_CORE_SPOOL_SEGMENTS && i < tail_seq;
+       i++) {
+    segmentPath(tail_seq - i, path);
+    removeFile(path);
+  }
+
+  // Never append behind a possibly torn record, start a fresh segment.
+  uint32_t last = count();
+  head_seq = last ? last + 1 : tail_seq;
+  head_size = 0;
+  ready = true;
+  return true;
+}
+
+// Counts the readable records from the read cursor on and returns the
+// newest segment, 0 if there is none.
+uint32_t CloudIoTCoreSpool::count()
+{
+  char path[40];
+  char record[CLOUD_IOT_CORE_SPOOL_RECORD_MAX];
+  records = payload_bytes = 0;
+  uint32_t last = 0;
+  for (uint32_t seq = tail_seq; seq < tail_seq + CLOUD_IOT_CORE_SPOOL_SEGMENTS;
+       seq++) {
+    segmentPath(seq, path);
+    if (fileSize(path) < 0) {
+      continue;
+    }
+    last = seq;
+    uint32_t offset = seq == tail_seq ? tail_offset : 0;
+    int n;
+    while ((n = readRecord(seq, offset, record, sizeof(record))) >= 0) {
+      records++;
+      payload_bytes += n;
+      offset += RECORD_HEADER + n;
+    }
+  }
+  return last;
+}
+
+bool CloudIoTCoreSpool::push(const char *data, size_t length)
+{
+  if (!ready || length == 0 || length > CLOUD_IOT_CORE_SPOOL_RECORD_MAX) {
+    return false;
+  }
+  if (head_size > 0 &&
+      head_size + RECORD_HEADER + length > CLOUD_IOT_CORE_SPOOL_SEGMENT) {
+    head_seq++;
+    head_size = 0;
+  }
+  while (head_seq - tail_seq >= CLOUD_IOT_CORE_SPOOL_SEGMENTS) {
+    dropOldest();
+  }
+
+  char header[RECORD_HEADER];
+  uint16_t sum = fletcher16(data, length);
+  header[0] = (char)length;
+  header[1] = (char)(length >> 8);
+  header[2] = (char)sum;
+  header[3] = (char)(sum >> 8);
+  char path[40];
+  segmentPath(head_seq, path);
+  if (!append(path, header, RECORD_HEADER, data, length)) {
+    // Part of the record may have been written, continue in a new segment.
+    head_size = CLOUD_IOT_CORE_SPOOL_SEGMENT;
+    return false;
+  }
+  head_size += RECORD_HEADER + length;
+  records++;
+  payload_bytes += length;
+  return true;
+}
+
+// Returns the record length, -1 if it does not fit out, -2 at the end of
+// the segment or on a damaged record.
+int CloudIoTCoreSpool::readRecord(uint32_t seq, uint32_t offset, char *out,
+                                  size_t size)
+{
+  char path[40];
+  char header[RECORD_HEADER];
+  segmentPath(seq, path);
+  if (readAt(path, offset, header, RECORD_HEADER) != RECORD_HEADER) {
+    return -2;
+  }
+  uint16_t length = (uint8_t)header[0] | ((uint8_t)header[1] << 8);
+  uint16_t sum = (uint8_t)header[2] | ((uint8_t)header[3] << 8);
+  if (length == 0 || length > CLOUD_IOT_CORE_SPOOL_RECORD_MAX) {
+    return -2;
+  }
+  if (length > size) {
+    return -1;
+  }
+  if (readAt(path, offset + RECORD_HEADER, out, length) != length ||
+      fletcher16(out, length) != sum) {
+    return -2;
+  }
+  return length;
+}
+
+int CloudIoTCoreSpool::peek(char *out, size_t size)
+{
+  while (records > 0) {
+    int n = readRecord(tail_seq, tail_offset, out, size);
+    if (n == -1) {
+      return -1;
+    }
+    if (n >= 0) {
+      peeked_offset = tail_offset + RECORD_HEADER + n;
+      peeked_length = n;
+      return n;
+    }
+    if (tail_seq == head_seq) {
+      // Damaged, nothing readable is left. New records go to a fresh
+      // segment, behind the damage they could not be read either.
+      lost += records;
+      records = payload_bytes = 0;
+      head_size = CLOUD_IOT_CORE_SPOOL_SEGMENT;
+      break;
+    }
+    skipSegment();
+  }
+  return 0;
+}
+
+void CloudIoTCoreSpool::commit()
+{
+  if (peeked_offset == 0) {
+    return;
+  }
+  tail_offset = peeked_offset;
+  records--;
+  payload_bytes -= peeked_length;
+  peeked_offset = 0;
+  if (records == 0 || ++unsynced >= CLOUD_IOT_CORE_SPOOL_SYNC_EVERY) {
+    sync();
+  }
+}
+
+void CloudIoTCoreSpool::advanceSegment()
+{
+  char path[40];
+  segmentPath(tail_seq, path);
+  tail_seq++;
+  tail_offset = 0;
+  peeked_offset = 0;
+  // Move the cursor past the segment before removing it.
+  sync();
+  removeFile(path);
+}
+
+// Moves the read cursor from tail_offset to the next segment. Records
+// behind a damaged one were counted but cannot be read, so if the segment
+// does not end at tail_offset the rest of the spool is counted again.
+void CloudIoTCoreSpool::skipSegment()
+{
+  char path[40];
+  segmentPath(tail_seq, path);
+  bool damaged = fileSize(path) > (long)tail_offset;
+  advanceSegment();
+  if (damaged) {
+    uint32_t before = records;
+    count();
+    if (before > records) {
+      lost += before - records;
+    }
+  }
+}
+
+void CloudIoTCoreSpool::dropOldest()
+{
+  char record[CLOUD_IOT_CORE_SPOOL_RECORD_MAX];
+  int n;
+  while ((n = readRecord(tail_seq, tail_offset, record, sizeof(record))) >=
+         0) {
+    records--;
+    payload_bytes -= n;
+    lost++;
+    tail_offset += RECORD_HEADER + n;
+  }
+  skipSegment();
+}
+
+void CloudIoTCoreSpool::sync()
+{
+  char path[40];
+  char cursor[16];
+  generation++;
+  put32(cursor, generation);
+  put32(cursor + 4, tail_seq);
+  put32(cursor + 8, tail_offset);
+  put32(cursor + 12, ((uint32_t)CURSOR_MAGIC << 16) | fletcher16(cursor, 12));
+  sprintf(path, "%s/cursor%d", dir, (int)(generation & 1));
+  writeFile(path, cursor, sizeof(cursor));
+  unsynced = 0;
+}
+
+bool CloudIoTCoreSpool::loadCursor()
+{
+  char path[40];
+  char cursor[16];
+  bool found = false;
+  for (int i = 0; i < 2; i++) {
+    sprintf(path, "%s/cursor%d", dir, i);
+    if (readAt(path, 0, cursor, sizeof(cursor)) != sizeof(cursor) ||
+        get32(cursor + 12) !=
+            (((uint32_t)CURSOR_MAGIC << 16) | fletcher16(cursor, 12))) {
+      continue;
+    }
+    if (!found || get32(cursor) > generation) {
+      generation = get32(cursor);
+      tail_seq = get32(cursor + 4);
+      tail_offset = get32(cursor + 8);
+      found = true;
+    }
+  }
+  return found;
+}
+
+uint32_t CloudIoTCoreSpool::depth()
+{
+  return records;
+}
+
+uint32_t CloudIoTCoreSpool::bytes()
+{
+  return payload_bytes;
+}
+
+uint32_t CloudIoTCoreSpool::dropped()
+{
+  return lost;
+}
+
+/* Storage backend */
+
+#if defined(CLOUD_IOT_CORE_SPOOL_FS)
+
+long CloudIoTCoreSpool::fileSize(const char *path)
+{
+  if (!fs.exists(path)) {
+    return -1;
+  }
+  File f = fs.open(path, "r");
+  if (!f) {
+    return -1;
+  }
+  long size = f.size();
+  f.close();
+  return size;
+}
+
+int CloudIoTCoreSpool::readAt(const char *path, uint32_t offset, char *out,
+                              size_t size)
+{
+  if (!fs.exists(path)) {
+    return -1;
+  }
+  File f = fs.open(path, "r");
+  if (!f) {
+    return -1;
+  }
+  int n = -1;
+  if (f.seek(offset, SeekSet)) {
+    n = f.read((uint8_t *)out, size);
+  }
+  f.close();
+  return n;
+}
+
+bool CloudIoTCoreSpool::append(const char *path, const char *a, size_t a_len,
+                               const char *b, size_t b_len)
+{
+  File f = fs.open(path, "a");
+  if (!f) {
+    return false;
+  }
+  bool ok = f.write((const uint8_t *)a, a_len) == a_len &&
+            f.write((const uint8_t *)b, b_len) == b_len;
+  f.close();
+  return ok;
+}
+
+bool CloudIoTCoreSpool::writeFile(const char *path, const char *data,
+                                  size_t length)
+{
+  File f = fs.open(path, "w");
+  if (!f) {
+    return false;
+  }
+  bool ok = f.write((const uint8_t *)data, length) == length;
+  f.close();
+  return ok;
+}
+
+void CloudIoTCoreSpool::removeFile(const char *path)
+{
+  if (fs.exists(path)) {
+    fs.remove(path);
+  }
+}
+
+void CloudIoTCoreSpool::makeDir()
+{
+  fs.mkdir(dir);
+}
+
+#elif defined(CLOUD_IOT_CORE_SPOOL_STDIO)
+
+long CloudIoTCoreSpool::fileSize(const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+int CloudIoTCoreSpool::readAt(const char *path, uint32_t offset, char *out,
+                              size_t size)
+{
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return -1;
+  }
+  int n = -1;
+  if (fseek(f, offset, SEEK_SET) == 0) {
+    n = fread(out, 1, size, f);
+  }
+  fclose(f);
+  return n;
+}
+
+bool CloudIoTCoreSpool::append(const char *path, const char *a, size_t a_len,
+                               const char *b, size_t b_len)
+{
+  FILE *f = fopen(path, "ab");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fwrite(a, 1, a_len, f) == a_len && fwrite(b, 1, b_len, f) == b_len;
+  return fclose(f) == 0 && ok;
+}
+
+bool CloudIoTCoreSpool::writeFile(const char *path, const char *data,
+                                  size_t length)
+{
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fwrite(data, 1, length, f) == length;
+  return fclose(f) == 0 && ok;
+}
+
+void CloudIoTCoreSpool::removeFile(const char *path)
+{
+  remove(path);
+}
+
+void CloudIoTCoreSpool::makeDir()
+{
+  mkdir(dir, 0755);
+}
+
+#else
+
+long CloudIoTCoreSpool::fileSize(const char *)
+{
+  return -1;
+}
+
+int CloudIoTCoreSpool::readAt(const char *, uint32_t, char *, size_t)
+{
+  return -1;
+}
+
+bool CloudIoTCoreSpool::append(const char *, const char *, size_t,
+                               const char *, size_t)
+{
+  return false;
+}
+
+bool CloudIoTCoreSpool::writeFile(const char *, const char *, size_t)
+{
+  return false;
+}
+
+void CloudIoTCoreSpool::removeFile(const char *) {}
+
+void CloudIoTCoreSpool::makeDir() {}
+
+#endif
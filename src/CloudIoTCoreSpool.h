@@ -0,0 +1,124 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreSpool_h
+#define CloudIoTCoreSpool_h
+
+#include <Arduino.h>
+
+// Storage backend: an Arduino FS (LittleFS, SPIFFS) on ESP32/ESP8266 and
+// stdio on Linux host builds. Elsewhere begin() fails and nothing is
+// spooled.
+#if defined(ESP32) || defined(ESP8266)
+#include <FS.h>
+#define CLOUD_IOT_CORE_SPOOL_FS
+#elif !defined(ARDUINO)
+#define CLOUD_IOT_CORE_SPOOL_STDIO
+#endif
+
+// The spool is a ring of segment files, CLOUD_IOT_CORE_SPOOL_SEGMENTS of
+// CLOUD_IOT_CORE_SPOOL_SEGMENT bytes. When it is full the oldest segment
+// is dropped.
+#ifndef CLOUD_IOT_CORE_SPOOL_SEGMENT
+#define CLOUD_IOT_CORE_SPOOL_SEGMENT 4096
+#endif
+#ifndef CLOUD_IOT_CORE_SPOOL_SEGMENTS
+#define CLOUD_IOT_CORE_SPOOL_SEGMENTS 16
+#endif
+// Largest record, bytes.
+#ifndef CLOUD_IOT_CORE_SPOOL_RECORD_MAX
+#define CLOUD_IOT_CORE_SPOOL_RECORD_MAX 512
+#endif
+// The read cursor is written to flash every this many commits. After a
+// crash up to this many records are replayed twice.
+#ifndef CLOUD_IOT_CORE_SPOOL_SYNC_EVERY
+#define CLOUD_IOT_CORE_SPOOL_SYNC_EVERY 8
+#endif
+
+// Append-only store-and-forward queue for telemetry published while
+// offline. Segments are named by an increasing sequence number, so writes
+// move across the whole area instead of rewriting one file. Records are
+// checksummed and a torn write at the end of a segment is skipped. The
+// read cursor is kept in two alternating files so one of them is always
+// intact.
+//
+//   spool.push(data, length);               // while offline
+//   int n = spool.peek(buffer, sizeof(buffer));
+//   if (n > 0 && publish(buffer, n)) spool.commit();
+class CloudIoTCoreSpool {
+  public:
+#if defined(CLOUD_IOT_CORE_SPOOL_FS)
+    // fs must already be mounted, e.g. LittleFS.begin().
+    CloudIoTCoreSpool(fs::FS &fs, const char *dir = "/ciotc");
+#else
+    CloudIoTCoreSpool(const char *dir);
+#endif
+
+    // Loads the cursor and counts what is left from a previous run.
+    bool begin();
+    bool push(const char *data, size_t length);
+    // Copies the oldest record into out and returns its length, 0 if the
+    // spool is empty or -1 if out is too small. Does not consume it.
+    int peek(char *out, size_t size);
+    // Consumes the record returned by the last peek().
+    void commit();
+    // Writes the read cursor now.
+    void sync();
+
+    uint32_t depth();
+    uint32_t bytes();
+    // Records lost because the spool was full or damaged.
+    uint32_t dropped();
+
+  private:
+#if defined(CLOUD_IOT_CORE_SPOOL_FS)
+    fs::FS &fs;
+#endif
+    char dir[24];
+    bool ready;
+
+    uint32_t head_seq;     // segment being appended to
+    uint32_t head_size;
+    uint32_t tail_seq;     // read cursor
+    uint32_t tail_offset;
+    uint32_t generation;   // of the last cursor written
+    uint8_t unsynced;
+
+    uint32_t records;
+    uint32_t payload_bytes;
+    uint32_t lost;
+    // Set by peek() for commit().
+    uint32_t peeked_offset;
+    uint16_t peeked_length;
+
+    void segmentPath(uint32_t seq, char *out);
+    int readRecord(uint32_t seq, uint32_t offset, char *out, size_t size);
+    uint32_t count();
+    void advanceSegment();
+    void skipSegment();
+    void dropOldest();
+    bool loadCursor();
+
+    // Storage backend.
+    long fileSize(const char *path);
+    int readAt(const char *path, uint32_t offset, char *out, size_t size);
+    bool append(const char *path, const char *a, size_t a_len, const char *b,
+                size_t b_len);
+    bool writeFile(const char *path, const char *data, size_t length);
+    void removeFile(const char *path);
+    void makeDir();
+};
+
+#endif  // CloudIoTCoreSpool_h
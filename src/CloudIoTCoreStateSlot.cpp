@@ -0,0 +1,92 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <string.h>
+#include "CloudIoTCoreStateSlot.h"
+
+// FNV-1a, only used to spot repeats.
+static uint32_t fnv1a(const char *data, size_t length)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+CloudIoTCoreStateSlot::CloudIoTCoreStateSlot(unsigned long min_interval_ms)
+    : min_interval_ms(min_interval_ms), last_sent(0), has_sent(false),
+      is_pending(false), sent_length(0), sent_hash(0), used(0), unchanged(0),
+      replaced(0) {}
+
+bool CloudIoTCoreStateSlot::write(const char *data, size_t length)
+{
+  if (length > CLOUD_IOT_CORE_STATE_MAX) {
+    return false;
+  }
+  if (is_pending) {
+    replaced++;
+  }
+  if (has_sent && length == sent_length && fnv1a(data, length) == sent_hash) {
+    // Back to what was published, nothing to send.
+    is_pending = false;
+    unchanged++;
+    return true;
+  }
+  memcpy(buffer, data, length);
+  used = length;
+  is_pending = true;
+  return true;
+}
+
+bool CloudIoTCoreStateSlot::pending()
+{
+  return is_pending;
+}
+
+bool CloudIoTCoreStateSlot::due()
+{
+  return is_pending &&
+         (!has_sent || millis() - last_sent >= min_interval_ms);
+}
+
+const char *CloudIoTCoreStateSlot::data()
+{
+  return buffer;
+}
+
+size_t CloudIoTCoreStateSlot::length()
+{
+  return used;
+}
+
+void CloudIoTCoreStateSlot::sent()
+{
+  sent_length = used;
+  sent_hash = fnv1a(buffer, used);
+  has_sent = true;
+  is_pending = false;
+  last_sent = millis();
+}
+
+uint32_t CloudIoTCoreStateSlot::skipped()
+{
+  return unchanged;
+}
+
+uint32_t CloudIoTCoreStateSlot::superseded()
+{
+  return replaced;
+}
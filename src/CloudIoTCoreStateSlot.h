@@ -0,0 +1,66 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreStateSlot_h
+#define CloudIoTCoreStateSlot_h
+
+#include <Arduino.h>
+
+// Largest state payload a slot holds, bytes.
+#ifndef CLOUD_IOT_CORE_STATE_MAX
+#define CLOUD_IOT_CORE_STATE_MAX 256
+#endif
+
+// Last-writer-wins buffer for device state. Each write() replaces the
+// pending value, so of several updates within the rate limit only the
+// newest is published, and a value equal (same length and hash) to the
+// one last published is not published again.
+//
+// Attach it with CloudIoTCoreMqtt::setStateSlot(); publishState() then
+// writes here and poll() publishes at most once per min_interval_ms, or
+// as the scheduler's state class allows if there is one.
+class CloudIoTCoreStateSlot {
+  public:
+    CloudIoTCoreStateSlot(unsigned long min_interval_ms = 1000);
+
+    // False if data is longer than CLOUD_IOT_CORE_STATE_MAX.
+    bool write(const char *data, size_t length);
+    bool pending();
+    // Pending and min_interval_ms has passed since the last publish.
+    bool due();
+    const char *data();
+    size_t length();
+    // The pending value was published.
+    void sent();
+
+    // Writes equal to the published value, and pending values replaced
+    // before they were published.
+    uint32_t skipped();
+    uint32_t superseded();
+
+  private:
+    unsigned long min_interval_ms;
+    unsigned long last_sent;
+    bool has_sent;
+    bool is_pending;
+    uint16_t sent_length;
+    uint32_t sent_hash;
+    uint16_t used;
+    uint32_t unchanged;
+    uint32_t replaced;
+    char buffer[CLOUD_IOT_CORE_STATE_MAX];
+};
+
+#endif  // CloudIoTCoreStateSlot_h
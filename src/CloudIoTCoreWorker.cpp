@@ -0,0 +1,141 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#include <Arduino.h>
+#include "CloudIoTCoreWorker.h"
+
+// Jobs that may wait for the worker.
+#define WORKER_JOBS 4
+
+struct WorkerJob {
+  void (*fn)(void *);
+  void *arg;
+};
+
+#if defined(CLOUD_IOT_CORE_WORKER_FREERTOS)
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+static QueueHandle_t worker_jobs = NULL;
+
+static void worker_task(void *)
+{
+  WorkerJob job;
+  while (true) {
+    if (xQueueReceive(worker_jobs, &job, portMAX_DELAY) == pdTRUE) {
+      job.fn(job.arg);
+    }
+  }
+}
+
+bool worker_start(void (*fn)(void *), void *arg)
+{
+  if (worker_jobs == NULL) {
+    // One task for the life of the sketch, later jobs only go through the
+    // queue. Pinned to the Arduino loop task's core at the same priority,
+    // so the two share the core and the jobs yield between slices. The
+    // other core stays free for WiFi.
+    worker_jobs = xQueueCreate(WORKER_JOBS, sizeof(WorkerJob));
+    if (worker_jobs == NULL) {
+      return false;
+    }
+#if defined(ARDUINO_RUNNING_CORE)
+    BaseType_t core = ARDUINO_RUNNING_CORE;
+#else
+    // Called from loop(), so this is the loop task's core.
+    BaseType_t core = xPortGetCoreID();
+#endif
+    if (xTaskCreatePinnedToCore(worker_task, "ciotc_worker",
+                                CLOUD_IOT_CORE_WORKER_STACK, NULL,
+                                tskIDLE_PRIORITY + 1, NULL,
+                                core) != pdPASS) {
+      vQueueDelete(worker_jobs);
+      worker_jobs = NULL;
+      return false;
+    }
+  }
+  WorkerJob job = {fn, arg};
+  return xQueueSend(worker_jobs, &job, 0) == pdTRUE;
+}
+
+void worker_yield()
+{
+  vTaskDelay(1);
+}
+
+#elif defined(CLOUD_IOT_CORE_WORKER_THREAD)
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Allocated once and never freed: destroying it at exit would wait on the
+// thread blocked in it.
+struct WorkerQueue {
+  std::mutex lock;
+  std::condition_variable wake;
+  std::deque<WorkerJob> jobs;
+};
+
+static WorkerQueue *worker_queue = NULL;
+
+static void worker_thread(WorkerQueue *queue)
+{
+  while (true) {
+    std::unique_lock<std::mutex> lock(queue->lock);
+    queue->wake.wait(lock, [queue] { return !queue->jobs.empty(); });
+    WorkerJob job = queue->jobs.front();
+    queue->jobs.pop_front();
+    lock.unlock();
+    job.fn(job.arg);
+  }
+}
+
+bool worker_start(void (*fn)(void *), void *arg)
+{
+  if (worker_queue == NULL) {
+    worker_queue = new WorkerQueue;
+    std::thread(worker_thread, worker_queue).detach();
+  }
+  std::lock_guard<std::mutex> lock(worker_queue->lock);
+  if (worker_queue->jobs.size() == WORKER_JOBS) {
+    return false;
+  }
+  worker_queue->jobs.push_back({fn, arg});
+  worker_queue->wake.notify_one();
+  return true;
+}
+
+void worker_yield()
+{
+  std::this_thread::yield();
+}
+
+#else
+
+bool worker_start(void (*fn)(void *), void *arg)
+{
+  (void)fn;
+  (void)arg;
+  return false;
+}
+
+void worker_yield()
+{
+  yield();
+}
+
+#endif
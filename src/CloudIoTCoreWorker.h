@@ -0,0 +1,44 @@
+/******************************************************************************
+ * Copyright 2019 Google
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *****************************************************************************/
+
+#ifndef CloudIoTCoreWorker_h
+#define CloudIoTCoreWorker_h
+
+// Minimal portable background task shim: a FreeRTOS task on ESP32 and a
+// std::thread on Linux host builds. Other boards have no worker and the
+// caller does the work cooperatively from loop() instead. Define
+// CLOUD_IOT_CORE_NO_WORKER to force the cooperative path.
+#if !defined(CLOUD_IOT_CORE_NO_WORKER)
+#if defined(ESP32)
+#define CLOUD_IOT_CORE_WORKER_FREERTOS
+#elif defined(__linux__) && !defined(ARDUINO)
+#define CLOUD_IOT_CORE_WORKER_THREAD
+#endif
+#endif
+
+#ifndef CLOUD_IOT_CORE_WORKER_STACK
+#define CLOUD_IOT_CORE_WORKER_STACK 8192
+#endif
+
+// Runs fn(arg) once on the background task, which is created on the first
+// call and kept. Call from one task (loop()) only. Returns false if the
+// platform has no worker, the task could not be created or too many jobs
+// are waiting.
+bool worker_start(void (*fn)(void *), void *arg);
+
+// Gives other tasks a chance to run between slices of background work.
+void worker_yield();
+
+#endif  // CloudIoTCoreWorker_h
@@ -16,132 +16,151 @@
 #include <stdio.h>
 #include <cstring>
 
-#include "crypto/ecdsa.h"
 #include "crypto/nn.h"
 #include "crypto/sha256.h"
+#include "CloudIoTCoreBase64.h"
+#include "CloudIoTCoreSigner.h"
 #include "jwt.h"
 
-// base64_encode copied from https://github.com/ReneNyffenegger/cpp-base64
-static const char* base64_chars =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-    "abcdefghijklmnopqrstuvwxyz"
-    "0123456789+/";
+// base64url of {"alg":"ES256","typ":"JWT"}, the header never changes.
+static const char jwt_header[] = "eyJhbGciOiJFUzI1NiIsInR5cCI6IkpXVCJ9";
+
+// Writes a JWT into a bounded buffer in a single pass. Input bytes are
+// base64url encoded (no padding) as they arrive and every emitted character
+// is fed to the SHA-256 of the signing input at the same time.
+struct JwtWriter {
+  char* out;
+  size_t len;
+  size_t cap;
+  bool overflow;
+  Sha256* sha;  // NULL when the output is not part of the signing input
+  Base64Encoder encoder;
+
+  JwtWriter(char* _out, size_t _cap, Sha256* _sha)
+      : out(_out), len(0), cap(_cap), overflow(false), sha(_sha),
+        encoder(BASE64_URL, false) {}
+
+  // Accounts for n characters just written at out + len.
+  void emitted(size_t n) {
+    if (sha) {
+      sha->update((const unsigned char*)out + len, n);
+    }
+    len += n;
+  }
 
-void base64_encode(const char *bytes_to_encode, unsigned int in_len,
-                   char *out)
-{
-  int i = 0;
-  int j = 0;
-  unsigned char char_array_3[3];
-  unsigned char char_array_4[4];
-
-  while (in_len--) {
-    char_array_3[i++] = *(bytes_to_encode++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] =
-          ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] =
-          ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-
-      for (i = 0; (i < 4); i++) {
-        *out = base64_chars[char_array_4[i]];
-        out++;
-      }
-      i = 0;
+  void raw(const char* s, size_t n) {
+    if (overflow || len + n >= cap) {
+      overflow = true;
+      return;
     }
+    memcpy(out + len, s, n);
+    emitted(n);
   }
 
-  if (i) {
-    for (j = i; j < 3; j++) {
-      char_array_3[j] = '\0';
+  void encode(const char* data, size_t n) {
+    if (overflow || len + BASE64_ENCODED_LENGTH(n + 2) >= cap) {
+      overflow = true;
+      return;
     }
+    emitted(encoder.update((const unsigned char*)data, n, out + len));
+  }
 
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] =
-        ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] =
-        ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-    char_array_4[3] = char_array_3[2] & 0x3f;
+  void encode(const char* s) {
+    encode(s, strlen(s));
+  }
 
-    for (j = 0; (j < i + 1); j++) {
-      *out = base64_chars[char_array_4[j]];
-      out++;
+  void encode(long long int value) {
+    char digits[20];
+    int n = 0;
+    unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+    do {
+      digits[sizeof(digits) - ++n] = '0' + (v % 10);
+      v /= 10;
+    } while (v);
+    if (value < 0) {
+      digits[sizeof(digits) - ++n] = '-';
     }
+    encode(digits + sizeof(digits) - n, n);
+  }
 
-    while ((i++ < 3)) {
-      *out = '=';
-      out++;
+  // Ends a base64url segment, emitting the trailing partial quantum.
+  void flush() {
+    if (overflow || len + 4 >= cap) {
+      overflow = true;
+      return;
     }
+    emitted(encoder.final(out + len));
   }
-}
+};
 
-// Get's sha256 of str. digest must have size SHA256_DIGEST_LENGTH
-void get_sha(const char* str, unsigned char* digest)
+size_t jwt_signing_input(char* jwt, const char* project_id, long long int time, int jwt_exp_secs, unsigned char* digest)
 {
   Sha256 sha256Instance;
-  sha256Instance.update((const unsigned char*)str, strlen(str));
+  JwtWriter writer(jwt, JWT_MAX_LENGTH, &sha256Instance);
+
+  // Header
+  writer.raw(jwt_header, sizeof(jwt_header) - 1);
+  writer.raw(".", 1);
+
+  // Payload
+  writer.encode("{\"iat\":");
+  writer.encode(time);
+  writer.encode(",\"exp\":");
+  writer.encode(time + jwt_exp_secs);
+  writer.encode(",\"aud\":\"");
+  writer.encode(project_id);
+  writer.encode("\"}");
+  writer.flush();
+
   sha256Instance.final(digest);
+
+  if (writer.overflow) {
+    jwt[0] = '\0';
+    return 0;
+  }
+  jwt[writer.len] = '\0';
+  return writer.len;
 }
 
-// Get base64 signature string from the signature_r and signature_s ecdsa
-// signature.
-void make_base64_signature(NN_DIGIT *signature_r, NN_DIGIT *signature_s, char *out)
+size_t jwt_append_signature(char* jwt, size_t len, NN_DIGIT* signature_r, NN_DIGIT* signature_s)
 {
+  JwtWriter writer(jwt, JWT_MAX_LENGTH, NULL);
+  writer.len = len;
+  writer.raw(".", 1);
+
+  // Signature is r and s as big endian 32 byte integers.
   unsigned char signature[64];
   NN_Encode(signature, (NUMWORDS - 1) * NN_DIGIT_LEN, signature_r,
             (NN_UINT)(NUMWORDS - 1));
   NN_Encode(signature + (NUMWORDS - 1) * NN_DIGIT_LEN,
             (NUMWORDS - 1) * NN_DIGIT_LEN, signature_s,
             (NN_UINT)(NUMWORDS - 1));
+  writer.encode((const char*)signature, sizeof(signature));
+  writer.flush();
 
-  base64_encode((char*)signature, 64, out);
+  if (len == 0 || writer.overflow) {
+    jwt[0] = '\0';
+    return 0;
+  }
+  jwt[writer.len] = '\0';
+  return writer.len;
 }
 
-
-void create_jwt(char* jwt, const char* project_id, long long int time, NN_DIGIT* priv_key, int jwt_exp_secs)
+size_t create_jwt(char* jwt, const char* project_id, long long int time, NN_DIGIT* priv_key, int jwt_exp_secs)
 {
-  char* current = jwt;
-  memset(jwt, 0, JWT_MAX_LENGTH);
-
-  ecc_init();
-
-  // Header
-  const char* header = "{\"alg\":\"ES256\",\"typ\":\"JWT\"}";
-  Serial.println(header);
-  base64_encode(header, strlen(header), current);
-  current += strlen(current);
-
-  *current = '.';
-  current++;
-
-  // Payload
-  char payload[100];
-  memset(payload, 0, 100);
-  sprintf(payload, "{\"iat\":%lld,\"exp\":%lld,\"aud\":\"%s\"}",
-           (long long int)time,  // iat
-           (long long int)(time + jwt_exp_secs),  // exp
-           project_id);  // aud
-  Serial.println(payload);
-  base64_encode(payload, strlen(payload), current);
-  current += strlen(current);
-
-  // sha256
   unsigned char sha256[SHA256_DIGEST_LENGTH];
-  get_sha(jwt, sha256);
-
-  // Signing sha with ec key. Bellow is the ec private key.
-  point_t pub_key;
-  ecc_gen_pub_key(priv_key, &pub_key);
+  size_t len = jwt_signing_input(jwt, project_id, time, jwt_exp_secs, sha256);
+  if (len == 0) {
+    // Did not fit, no point in signing.
+    return 0;
+  }
 
-  ecdsa_init(&pub_key);
+  EcdsaSigner signer;
+  signer.begin(sha256, priv_key);
+  while (!signer.step(~0UL)) {
+  }
 
   NN_DIGIT signature_r[NUMWORDS], signature_s[NUMWORDS];
-  ecdsa_sign(sha256, signature_r, signature_s, priv_key);
-
-  *current = '.';
-  current++;
-
-  make_base64_signature(signature_r, signature_s, current);
+  signer.getSignature(signature_r, signature_s);
+  return jwt_append_signature(jwt, len, signature_r, signature_s);
 }
@@ -18,9 +18,19 @@
 
 #include <Arduino.h>
 #include "crypto/nn.h"
+#include "crypto/ecdsa.h"
 
 #define JWT_MAX_LENGTH          256
 
-void create_jwt(char* jwt, const char* project_id, long long int time, NN_DIGIT* priv_key, int jwt_exp_secs);
+// Writes a signed ES256 JWT into jwt, which must hold JWT_MAX_LENGTH bytes.
+// Returns the length of the token, or 0 if it did not fit.
+size_t create_jwt(char* jwt, const char* project_id, long long int time, NN_DIGIT* priv_key, int jwt_exp_secs);
+
+// The two halves of create_jwt, for callers that sign incrementally with
+// EcdsaSigner. jwt_signing_input writes "header.payload" and its SHA-256
+// digest, jwt_append_signature appends ".signature" to it. Both return the
+// token length, or 0 if it did not fit.
+size_t jwt_signing_input(char* jwt, const char* project_id, long long int time, int jwt_exp_secs, unsigned char digest[SHA256_DIGEST_LENGTH]);
+size_t jwt_append_signature(char* jwt, size_t len, NN_DIGIT* signature_r, NN_DIGIT* signature_s);
 
 #endif  // JWT_H_